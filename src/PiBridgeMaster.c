@@ -2,8 +2,7 @@
 // SPDX-FileCopyrightText: 2016-2024 KUNBUS GmbH
 
 #include <linux/pibridge_comm.h>
-#include <linux/cpufreq.h>
-#include <linux/thermal.h>
+#include <linux/completion.h>
 
 #include "common_define.h"
 #include "piAIOComm.h"
@@ -13,6 +12,7 @@
 #include "revpi_core.h"
 #include "revpi_gate.h"
 #include "revpi_mio.h"
+#include "revpi_replay.h"
 #include "revpi_ro.h"
 #include "RS485FwuCommand.h"
 #include "piFirmwareUpdate.h"
@@ -20,6 +20,7 @@
 #define MAX_CONFIG_RETRIES 3		// max. retries for configuring a IO module
 #define MAX_INIT_RETRIES 1		// max. retries for configuring all IO modules
 #define END_CONFIG_TIME	3000		// max. time for configuring IO modules, same timeout is used in the modules
+#define FWU_STEP_TIMEOUT	30000		// max. time without progress in a firmware update step (msecs)
 
 /* The number of cycles after which the comm error counter is decreased */
 #define COMM_ERROR_CYCLES		(1<<3) /* must be power of 2! */
@@ -35,6 +36,8 @@ static enPiBridgeState eBridgeStateLast_s = piBridgeStop;
 static INT32U i32uFWUAddress, i32uFWUSerialNum, i32uFWUFlashAddr, i32uFWUlength, i8uFWUScanned;
 static INT32S i32sRetVal;
 static char *pcFWUdata;
+/* completed by the io thread when a firmware update step is done */
+static DECLARE_COMPLETION(fwu_done);
 
 void PiBridgeMaster_Stop(void)
 {
@@ -73,7 +76,7 @@ void PiBridgeMaster_Reset(void)
 	rt_mutex_unlock(&piCore_g.lockBridgeState);
 }
 
-static void PiBridgeMaster_Configure(void)
+void PiBridgeMaster_Configure(void)
 {
 	SDevice *sdev;
 	int ret;
@@ -355,8 +358,8 @@ int PiBridgeMaster_Run(void)
 	static int error_cnt;
 	static u16 last_led;
 	static u8 last_output;
-	static unsigned long last_update;
 	int ret = 0;
+	int err;
 	int i;
 
 	my_rt_mutex_lock(&piCore_g.lockBridgeState);
@@ -628,9 +631,10 @@ int PiBridgeMaster_Run(void)
 #endif
 				PiBridgeMaster_setDefaults();
 
-				my_rt_mutex_lock(&piDev_g.lockPI);
+				revpi_io_lock_pi();
 				memcpy(piDev_g.ai8uPI, piDev_g.ai8uPIDefault, KB_PI_LEN);
-				rt_mutex_unlock(&piDev_g.lockPI);
+				memcpy(piCore_g.cycle_image, piDev_g.ai8uPIDefault, KB_PI_LEN);
+				revpi_io_unlock_pi();
 				msleep(100);	// wait a while
 				pr_info("start data exchange\n");
 				RevPiDevice_startDataexchange();
@@ -655,7 +659,12 @@ int PiBridgeMaster_Run(void)
 			    (!(piCore_g.cycle_num & COMM_ERROR_CYCLES_MASK)))
 				piCore_g.comm_errors--;
 
-			if (RevPiDevice_run()) {
+			revpi_replay_cycle_start();
+			revpi_core_image_fetch();
+			err = RevPiDevice_run();
+			revpi_replay_cycle_end();
+
+			if (err) {
 				piCore_g.comm_errors++;
 
 				if (piCore_g.comm_errors > COMM_ERROR_LOG_LIMIT) {
@@ -754,8 +763,13 @@ int PiBridgeMaster_Run(void)
 				}
 				pr_info("using address %d\n", i32uFWUAddress);
 
+				/* continue as soon as the module answers */
+				if (i32sRetVal == 0)
+					i32sRetVal = fwu_wait_ready(i32uFWUAddress);
+
 				ret = 0;	// do not return errors here
 				bEntering_s = bFALSE;
+				complete(&fwu_done);
 			}
 		} else if (eRunStatus_s == enPiBridgeMasterStatus_ProgramSerialNum) {
 			if (bEntering_s) {
@@ -764,6 +778,7 @@ int PiBridgeMaster_Run(void)
 
 				ret = 0;	// do not return errors here
 				bEntering_s = bFALSE;
+				complete(&fwu_done);
 			}
 		} else if (eRunStatus_s == enPiBridgeMasterStatus_FWUFlashErase) {
 			if (bEntering_s) {
@@ -772,6 +787,7 @@ int PiBridgeMaster_Run(void)
 
 				ret = 0;	// do not return errors here
 				bEntering_s = bFALSE;
+				complete(&fwu_done);
 			}
 		} else if (eRunStatus_s == enPiBridgeMasterStatus_FWUFlashWrite) {
 			if (bEntering_s) {
@@ -781,6 +797,7 @@ int PiBridgeMaster_Run(void)
 							    i32uFWUlength);
 				ret = 0;	// do not return errors here
 				bEntering_s = bFALSE;
+				complete(&fwu_done);
 			}
 		} else if (eRunStatus_s == enPiBridgeMasterStatus_FWUReset) {
 			if (bEntering_s) {
@@ -789,6 +806,7 @@ int PiBridgeMaster_Run(void)
 
 				ret = 0;	// do not return errors here
 				bEntering_s = bFALSE;
+				complete(&fwu_done);
 			}
 		}
 
@@ -835,9 +853,9 @@ int PiBridgeMaster_Run(void)
 
 	if (piDev_g.machine_type == REVPI_CONNECT_4 ||
 	    piDev_g.machine_type == REVPI_CONNECT_5) {
-		revpi_rgb_led_trigger_event(last_led, piCore_g.image.usr.rgb_leds);
+		revpi_leds_set(piCore_g.image.usr.rgb_leds);
 	} else {
-		revpi_led_trigger_event(last_led, piCore_g.image.usr.leds);
+		revpi_leds_set(piCore_g.image.usr.leds);
 	}
 	if (piDev_g.machine_type == REVPI_CONNECT ||
 	    piDev_g.machine_type == REVPI_CONNECT_SE) {
@@ -861,67 +879,56 @@ int PiBridgeMaster_Run(void)
 		last_led = piCore_g.image.usr.leds;
 	}
 
-	// update every 1 sec
-	if ((kbUT_getCurrentMs() - last_update) > 1000) {
-		if (piDev_g.thermal_zone != NULL) {
-			int temp, ret;
-
-			ret = thermal_zone_get_temp(piDev_g.thermal_zone, &temp);
-			if (ret) {
-				pr_err("could not read cpu temperature\n");
-			} else {
-				piCore_g.image.drv.i8uCPUTemperature = temp / 1000;
-			}
-		}
-
-		/*
-		   Get the CPU clock from CPU0 in kHz
-		   and divide it down to fit into 8 bits.
-		*/
-		piCore_g.image.drv.i8uCPUFrequency =
-			cpufreq_quick_get(0) / 10000;
-
+	/* sampled by revpi_housekeeping_work(), never block on it here */
+	piCore_g.image.drv.i8uCPUTemperature =
+		READ_ONCE(piDev_g.cpu_temperature) / 1000;
+	/* CPU clock in kHz divided down to fit into 8 bits */
+	piCore_g.image.drv.i8uCPUFrequency =
+		READ_ONCE(piDev_g.cpu_frequency) / 10000;
 
-		last_update = kbUT_getCurrentMs();
-	}
-
-	if (piCore_g.eBridgeState == piBridgeRun) {
-		//flip_process_image(&piCore_g.image, RevPiDevice_getCoreOffset());
-		if (!test_bit(PICONTROL_DEV_FLAG_STOP_IO, &piDev_g.flags)) {
-			INT8U *p1, *p2;
-			SRevPiProcessImage *pI1, *pI2;
-			p1 = piDev_g.ai8uPI + RevPiDevice_getCoreOffset();
-			p2 = (INT8U *)&piCore_g.image;
-			pI1 = (SRevPiProcessImage *)p1;
-			pI2 = (SRevPiProcessImage *)p2;
-			my_rt_mutex_lock(&piDev_g.lockPI);
-			pI1->drv = pI2->drv;
-			// The size of _SRevPiProcessImage.usr was 5 bytes before the field rgb_leds was introduced
-			// with Connect 4 and the size changed to 7 bytes. In order to maintain compatibility with existing deviecs,
-			// only the number of bytes defined in MODGATECOM_IDResp.i16uFBS_OutputLength is copied with memcpy.
-			memcpy(&pI2->usr, &pI1->usr, RevPiDevice_getDev(0)->sId.i16uFBS_OutputLength);
-			rt_mutex_unlock(&piDev_g.lockPI);
-		}
-	}
+	revpi_core_image_publish(piCore_g.eBridgeState == piBridgeRun &&
+				 !test_bit(PICONTROL_DEV_FLAG_STOP_IO, &piDev_g.flags));
 
 	return ret;
 }
 
 //-------------------------------------------------------------------------------------------------------------------------
 // the following functions are called from the ioctl funtion which is executed in the application task
-// they block using msleep until their task is completed, which is signalled by reseting the flags bEntering_s to bFALSE.
+// they block until their task is completed, which is signalled by reseting the flags bEntering_s to bFALSE and completing fwu_done.
+
+/*
+ * Let the io thread execute a firmware update step and wait for the result.
+ * Writing the flash takes as long as the image and its retries need, so
+ * the step is only given up if the io thread sent no request to the module
+ * for FWU_STEP_TIMEOUT, e.g. because it is no longer running.
+ */
+static INT32S PiBridgeMaster_FWUExecute(EPiBridgeMasterStatus state)
+{
+	unsigned int progress;
+
+	reinit_completion(&fwu_done);
+	eRunStatus_s = state;
+	bEntering_s = bTRUE;
+
+	do {
+		progress = fwu_progress();
+		if (wait_for_completion_timeout(&fwu_done,
+				msecs_to_jiffies(FWU_STEP_TIMEOUT)))
+			return i32sRetVal;
+	} while (fwu_progress() != progress);
+
+	/* do not let a late io thread start the step */
+	bEntering_s = bFALSE;
+	pr_err("firmware update step %d timed out\n", state);
+	return -ETIMEDOUT;
+}
 
 INT32S PiBridgeMaster_FWUModeEnter(INT32U address, INT8U i8uScanned)
 {
 	if (piCore_g.eBridgeState == piBridgeStop) {
 		i32uFWUAddress = address;
 		i8uFWUScanned = i8uScanned;
-		eRunStatus_s = enPiBridgeMasterStatus_FWUMode;
-		bEntering_s = bTRUE;
-		do {
-			msleep(10);
-		} while (bEntering_s);
-		return i32sRetVal;
+		return PiBridgeMaster_FWUExecute(enPiBridgeMasterStatus_FWUMode);
 	}
 	return -1;
 }
@@ -930,26 +937,15 @@ INT32S PiBridgeMaster_FWUsetSerNum(INT32U serNum)
 {
 	if (piCore_g.eBridgeState == piBridgeStop) {
 		i32uFWUSerialNum = serNum;
-		eRunStatus_s = enPiBridgeMasterStatus_ProgramSerialNum;
-		bEntering_s = bTRUE;
-		do {
-			msleep(10);
-		} while (bEntering_s);
-		return i32sRetVal;
+		return PiBridgeMaster_FWUExecute(enPiBridgeMasterStatus_ProgramSerialNum);
 	}
 	return -1;
 }
 
 INT32S PiBridgeMaster_FWUflashErase(void)
 {
-	if (piCore_g.eBridgeState == piBridgeStop) {
-		eRunStatus_s = enPiBridgeMasterStatus_FWUFlashErase;
-		bEntering_s = bTRUE;
-		do {
-			msleep(10);
-		} while (bEntering_s);
-		return i32sRetVal;
-	}
+	if (piCore_g.eBridgeState == piBridgeStop)
+		return PiBridgeMaster_FWUExecute(enPiBridgeMasterStatus_FWUFlashErase);
 	return -1;
 }
 
@@ -959,25 +955,14 @@ INT32S PiBridgeMaster_FWUflashWrite(INT32U flashAddr, char *data, INT32U length)
 		i32uFWUFlashAddr = flashAddr;
 		pcFWUdata = data;
 		i32uFWUlength = length;
-		eRunStatus_s = enPiBridgeMasterStatus_FWUFlashWrite;
-		bEntering_s = bTRUE;
-		do {
-			msleep(10);
-		} while (bEntering_s);
-		return i32sRetVal;
+		return PiBridgeMaster_FWUExecute(enPiBridgeMasterStatus_FWUFlashWrite);
 	}
 	return -1;
 }
 
 INT32S PiBridgeMaster_FWUReset(void)
 {
-	if (piCore_g.eBridgeState == piBridgeStop) {
-		eRunStatus_s = enPiBridgeMasterStatus_FWUReset;
-		bEntering_s = bTRUE;
-		do {
-			msleep(10);
-		} while (bEntering_s);
-		return i32sRetVal;
-	}
+	if (piCore_g.eBridgeState == piBridgeStop)
+		return PiBridgeMaster_FWUExecute(enPiBridgeMasterStatus_FWUReset);
 	return -1;
 }
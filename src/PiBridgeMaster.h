@@ -37,6 +37,7 @@ extern EPiBridgeMasterStatus eRunStatus_s;
 void PiBridgeMaster_Reset(void);
 int PiBridgeMaster_Adjust(void);
 void PiBridgeMaster_setDefaults(void);
+void PiBridgeMaster_Configure(void);
 int PiBridgeMaster_Run(void);
 void PiBridgeMaster_Stop(void);
 void PiBridgeMaster_Continue(void);
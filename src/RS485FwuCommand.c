@@ -4,6 +4,8 @@
 // Firmware update of RevPi modules using gateway protocol over RS-485
 
 #include <linux/delay.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
 #include <linux/pibridge_comm.h>
 
 #include "ModGateRS485.h"
@@ -21,10 +23,39 @@ int fwuEnterFwuMode(u8 address)
 	if (ret)
 		return ret;
 
-	msleep(100);
+	/* the caller waits with fwuWaitReady() until the module answers */
 	return 0;
 }
 
+/*
+ * Ping the module until it answers or the timeout expires. This is used
+ * after entering the firmware update mode instead of a fixed delay.
+ * Returns the number of msecs waited or a negative error code.
+ */
+int fwuWaitReady(u8 address, unsigned int timeout)
+{
+	u8 resp[MAX_TELEGRAM_DATA_SIZE];
+	unsigned long end;
+	ktime_t start;
+	int ret;
+
+	start = ktime_get();
+	end = jiffies + msecs_to_jiffies(timeout);
+
+	do {
+		ret = pibridge_req_gate_tmt(piCore_g.pibridge, address,
+					    eCmdPing, NULL, 0, resp,
+					    sizeof(resp), REV_PI_IO_TIMEOUT);
+		if (ret >= 0)
+			return ktime_to_ms(ktime_sub(ktime_get(), start));
+	} while (time_before(jiffies, end));
+
+	pr_warn("No response in firmware update mode (addr %hhu): %d\n",
+		address, ret);
+
+	return -ETIMEDOUT;
+}
+
 int fwuWriteSerialNum (u8 address, u32 sernum)
 {
 	int ret;
@@ -126,6 +157,40 @@ int fwuWrite(u8 address, u32 flashAddr, char *data, u32 length)
 	return 0;
 }
 
+/*
+ * Read back the flash of the module. The request consists of the flash
+ * address and the length, the response of the flash content. Modules which
+ * do not support reading answer with an error code only.
+ */
+int fwuRead(u8 address, u32 flashAddr, char *data, u16 length)
+{
+	u8 sendbuf[sizeof(flashAddr) + sizeof(length)];
+	int ret;
+
+	if (length == 0 || length > MAX_TELEGRAM_DATA_SIZE)
+		return -EINVAL;
+
+	memcpy(sendbuf, &flashAddr, sizeof(flashAddr));
+	memcpy(sendbuf + sizeof(flashAddr), &length, sizeof(length));
+
+	ret = pibridge_req_gate_tmt(piCore_g.pibridge, address,
+				    eCmdReadFwFlash, sendbuf, sizeof(sendbuf),
+				    data, length, 1000);
+	if (ret < 0)
+		return ret;
+
+	if (ret == sizeof(u16) && length != sizeof(u16))
+		return -EOPNOTSUPP;
+
+	if (ret < length) {
+		pr_warn("Truncated ReadFwFlash response (addr %hhu)\n",
+			address);
+		return -EIO;
+	}
+
+	return 0;
+}
+
 int fwuResetModule (u8 address)
 {
 	int ret;
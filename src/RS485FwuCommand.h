@@ -7,7 +7,9 @@
 #pragma once
 
 int fwuEnterFwuMode(u8 address);
+int fwuWaitReady(u8 address, unsigned int timeout);
 int fwuWriteSerialNum(u8 address, u32 i32uSerNum_p);
 int fwuEraseFlash (u8 address);
 int fwuWrite(u8 address, u32 flashAddr, char *data, u32 length);
+int fwuRead(u8 address, u32 flashAddr, char *data, u16 length);
 int fwuResetModule(u8 address);
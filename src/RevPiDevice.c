@@ -8,12 +8,37 @@
 #include "piAIOComm.h"
 #include "piDIOComm.h"
 #include "revpi_core.h"
+#include "revpi_recorder.h"
+#include "revpi_replay.h"
 #include "revpi_mio.h"
 #include "revpi_ro.h"
 #include "picontrol_trace.h"
 
 static SDeviceConfig RevPiDevices_s;
 
+/*
+ * State of the cycle deadline budget per device index. The cost is an
+ * estimate of the exchange duration in usecs which follows increases
+ * immediately and decreases slowly. Internal telegrams of the user and of
+ * the gateway have a budget of their own. Their deferrals are accounted to
+ * the addressed module, or to the RevPi itself (index 0) if the address is
+ * not configured.
+ */
+static struct revpi_dev_budget {
+	unsigned int cost[REV_PI_DEV_CNT_MAX + 1];
+	unsigned int deferred[REV_PI_DEV_CNT_MAX + 1];
+	u64 deferrals[REV_PI_DEV_CNT_MAX + 1];
+	unsigned int user_tel_cost;
+	unsigned int user_tel_deferred;
+	u64 user_tel_deferrals[REV_PI_DEV_CNT_MAX + 1];
+	unsigned int gate_tel_cost;
+	unsigned int gate_tel_deferred;
+	u64 gate_tel_deferrals[REV_PI_DEV_CNT_MAX + 1];
+	seqlock_t lock;
+} RevPiDevices_budget = {
+	.lock = __SEQLOCK_UNLOCKED(RevPiDevices_budget.lock),
+};
+
 const MODGATECOM_IDResp RevPiCore_ID_g = {
 	.i32uSerialnumber = REV_PI_DEV_DEFAULT_SERIAL,
 	.i16uModulType = KUNBUS_FW_DESCR_TYP_PI_CORE,
@@ -98,17 +123,103 @@ const MODGATECOM_IDResp RevPiGeneric_ID_g = {
 	.i16uFeatureDescriptor = 0
 };
 
+static void revpi_dev_update_cost(unsigned int *cost, ktime_t start)
+{
+	unsigned int t = ktime_us_delta(ktime_get(), start);
+
+	if (t >= *cost)
+		*cost = t;
+	else
+		*cost -= (*cost - t) >> 3;
+}
+
+/*
+ * Check if an exchange with the given cost still fits into the current cycle.
+ * If not, the exchange is deferred to the next cycle unless it has already
+ * been deferred REV_PI_DEV_MAX_DEFERRALS times in a row.
+ */
+static bool revpi_dev_defer(INT8U i8uDevice, unsigned int cost,
+			    unsigned int *deferred, u64 *deferrals)
+{
+	struct revpi_dev_budget *budget = &RevPiDevices_budget;
+
+	if (!piCore_g.cycle_deadline ||
+	    ktime_before(ktime_add_us(ktime_get(), cost),
+			 piCore_g.cycle_deadline)) {
+		*deferred = 0;
+		return false;
+	}
+
+	if (*deferred >= REV_PI_DEV_MAX_DEFERRALS) {
+		*deferred = 0;
+		return false;
+	}
+
+	(*deferred)++;
+
+	write_seqlock(&budget->lock);
+	deferrals[i8uDevice]++;
+	write_sequnlock(&budget->lock);
+
+	trace_picontrol_cyclic_device_data_deferred(RevPiDevice_getDev(i8uDevice)->i8uAddress);
+
+	return true;
+}
+
+/* index of the module with the given address, the RevPi itself if none */
+static INT8U revpi_dev_index(INT8U address)
+{
+	INT8U i;
+
+	for (i = 0; i < RevPiDevice_getDevCnt(); i++) {
+		if (RevPiDevice_getDev(i)->i8uAddress == address)
+			return i;
+	}
+
+	return 0;
+}
+
 void RevPiDevice_handle_internal_telegrams(void)
 {
+	struct revpi_dev_budget *budget = &RevPiDevices_budget;
+	ktime_t start;
 	int ret = 0;
 
+	/*
+	 * A replay runs without the modules, telegrams of the user must not
+	 * reach the PiBridge while it runs.
+	 */
+	if (revpi_replay_active()) {
+		rt_mutex_lock(&piCore_g.lockUserTel);
+		if (piCore_g.pendingUserTel == true) {
+			piCore_g.statusUserTel = -EBUSY;
+			piCore_g.pendingUserTel = false;
+			up(&piCore_g.semUserTel);
+		}
+		rt_mutex_unlock(&piCore_g.lockUserTel);
+
+		rt_mutex_lock(&piCore_g.lockGateTel);
+		if (piCore_g.pendingGateTel == true) {
+			piCore_g.statusGateTel = -EBUSY;
+			piCore_g.pendingGateTel = false;
+			up(&piCore_g.semGateTel);
+		}
+		rt_mutex_unlock(&piCore_g.lockGateTel);
+		return;
+	}
+
 	/* If requested by user, send internal io/gate telegram(s) */
 	rt_mutex_lock(&piCore_g.lockUserTel);
-	if (piCore_g.pendingUserTel == true) {
+	if (piCore_g.pendingUserTel == true &&
+	    !revpi_dev_defer(revpi_dev_index(piCore_g.requestUserTel.uHeader.sHeaderTyp1.bitAddress),
+			     budget->user_tel_cost, &budget->user_tel_deferred,
+			     budget->user_tel_deferrals)) {
 		SIOGeneric *req = &piCore_g.requestUserTel;
 		SIOGeneric *resp = &piCore_g.responseUserTel;
 		UIoProtocolHeader *hdr = &req->uHeader;
 
+		start = ktime_get();
+
 		/* avoid leaking response of previous telegram to user space */
 		memset(resp, 0, sizeof(*resp));
 
@@ -127,17 +238,23 @@ void RevPiDevice_handle_internal_telegrams(void)
 		}
 		piCore_g.pendingUserTel = false;
 		up(&piCore_g.semUserTel);
+		revpi_dev_update_cost(&budget->user_tel_cost, start);
 	}
 	rt_mutex_unlock(&piCore_g.lockUserTel);
 
 	rt_mutex_lock(&piCore_g.lockGateTel);
-	if (piCore_g.pendingGateTel == true) {
+	if (piCore_g.pendingGateTel == true &&
+	    !revpi_dev_defer(revpi_dev_index(piCore_g.gate_req_dgram.hdr.dst),
+			     budget->gate_tel_cost, &budget->gate_tel_deferred,
+			     budget->gate_tel_deferrals)) {
+		start = ktime_get();
 		piCore_g.statusGateTel =
 			pibridge_req_gate_datagram(piCore_g.pibridge,
 						   &piCore_g.gate_req_dgram,
 						   &piCore_g.gate_resp_dgram);
 		piCore_g.pendingGateTel = false;
 		up(&piCore_g.semGateTel);
+		revpi_dev_update_cost(&budget->gate_tel_cost, start);
 	}
 	rt_mutex_unlock(&piCore_g.lockGateTel);
 }
@@ -184,6 +301,7 @@ void RevPiDevice_init(void)
 	RevPiDevices_s.i8uAddressLeft = REV_PI_DEV_FIRST_RIGHT - 1;	// first address of a left side module
 	RevPiDevice_resetDevCnt();	// counter for detected devices
 	RevPiDevices_s.i16uErrorCnt = 0;
+	RevPiDevice_resetBudget();
 
 	// RevPi as first entry to device list
 	RevPiDevice_getDev(RevPiDevice_getDevCnt())->i8uAddress = 0;
@@ -247,20 +365,30 @@ void RevPiDevice_init(void)
 
 void revpi_dev_update_state(INT8U i8uDevice, INT32U r, int *retval)
 {
+	SDevice *dev = RevPiDevice_getDev(i8uDevice);
+
 	if (r) {
-		if (RevPiDevice_getDev(i8uDevice)->i16uErrorCnt < 255) {
-			RevPiDevice_getDev(i8uDevice)->i16uErrorCnt++;
+		if (dev->i16uErrorCnt < 255) {
+			dev->i16uErrorCnt++;
+		} else if (dev->i8uModuleState != IOSTATE_OFFLINE) {
+			dev->i8uModuleState = IOSTATE_OFFLINE;
+			piControl_queue_event(KB_EVENT_MODULE_LOST |
+					      dev->i8uAddress << 8);
+			revpi_recorder_trigger(PICONTROL_RECORDER_TRIGGER_MODULE_LOST);
 		}
-		else
-			RevPiDevice_getDev(i8uDevice)->i8uModuleState = IOSTATE_OFFLINE;
 		*retval -= 1;	// tell calling function that an error occured
-		if (RevPiDevice_getDev(i8uDevice)->i16uErrorCnt > 1) {
+		if (dev->i16uErrorCnt > 1) {
 			// the first error is ignored
-			RevPiDevices_s.i16uErrorCnt += RevPiDevice_getDev(i8uDevice)->i16uErrorCnt;
+			RevPiDevices_s.i16uErrorCnt += dev->i16uErrorCnt;
 		}
 	} else {
-		RevPiDevice_getDev(i8uDevice)->i16uErrorCnt = 0;
-		RevPiDevice_getDev(i8uDevice)->i8uModuleState = IOSTATE_CYCLIC_IO;
+		/* only modules which were lost before are reported as recovered */
+		if (dev->i8uModuleState == IOSTATE_OFFLINE &&
+		    dev->i16uErrorCnt >= 255)
+			piControl_queue_event(KB_EVENT_MODULE_RECOVERED |
+					      dev->i8uAddress << 8);
+		dev->i16uErrorCnt = 0;
+		dev->i8uModuleState = IOSTATE_CYCLIC_IO;
 	}
 }
 
@@ -277,7 +405,10 @@ void revpi_dev_update_state(INT8U i8uDevice, INT32U r, int *retval)
 //-------------------------------------------------------------------------------------------------
 int RevPiDevice_run(void)
 {
+	struct revpi_dev_budget *budget = &RevPiDevices_budget;
 	INT8U i8uDevice = 0;
+	ktime_t start;
+	bool defer;
 	INT32U r;
 	int retval = 0;
 	SDevice *dev;
@@ -289,26 +420,49 @@ int RevPiDevice_run(void)
 
 		if (dev->i8uActive) {
 			trace_picontrol_cyclic_device_data_start(dev->i8uAddress);
+			start = ktime_get();
 
+			/*
+			 * Digital IOs are always served. Analog and relay
+			 * modules are deferred to the next cycle if their
+			 * exchange does not fit into the cycle budget.
+			 */
 			switch (dev->sId.i16uModulType) {
 			case KUNBUS_FW_DESCR_TYP_PI_DIO_14:
 			case KUNBUS_FW_DESCR_TYP_PI_DI_16:
 			case KUNBUS_FW_DESCR_TYP_PI_DO_16:
 				r = piDIOComm_sendCyclicTelegram(i8uDevice);
 				revpi_dev_update_state(i8uDevice, r, &retval);
+				revpi_dev_update_cost(&budget->cost[i8uDevice], start);
 				break;
 
 			case KUNBUS_FW_DESCR_TYP_PI_AIO:
+				if (revpi_dev_defer(i8uDevice, budget->cost[i8uDevice],
+						    &budget->deferred[i8uDevice],
+						    budget->deferrals))
+					break;
 				r = piAIOComm_sendCyclicTelegram(i8uDevice);
 				revpi_dev_update_state(i8uDevice, r, &retval);
+				revpi_dev_update_cost(&budget->cost[i8uDevice], start);
 				break;
 			case KUNBUS_FW_DESCR_TYP_PI_MIO:
-				r = revpi_mio_cycle(i8uDevice);
+				/* only the analog part of the MIO is deferred */
+				defer = revpi_dev_defer(i8uDevice, budget->cost[i8uDevice],
+							&budget->deferred[i8uDevice],
+							budget->deferrals);
+				r = revpi_mio_cycle(i8uDevice, !defer);
 				revpi_dev_update_state(i8uDevice, r, &retval);
+				if (!defer)
+					revpi_dev_update_cost(&budget->cost[i8uDevice], start);
 				break;
 			case KUNBUS_FW_DESCR_TYP_PI_RO:
+				if (revpi_dev_defer(i8uDevice, budget->cost[i8uDevice],
+						    &budget->deferred[i8uDevice],
+						    budget->deferrals))
+					break;
 				r = revpi_ro_cycle(i8uDevice);
 				revpi_dev_update_state(i8uDevice, r, &retval);
+				revpi_dev_update_cost(&budget->cost[i8uDevice], start);
 				break;
 
 			case KUNBUS_FW_DESCR_TYP_MG_CAN_OPEN:
@@ -560,3 +714,75 @@ unsigned int RevPiDevice_getCoreOffset(void)
 {
 	return RevPiDevices_s.offset;
 }
+
+void RevPiDevice_resetBudget(void)
+{
+	struct revpi_dev_budget *budget = &RevPiDevices_budget;
+
+	write_seqlock(&budget->lock);
+	memset(budget->cost, 0, sizeof(budget->cost));
+	memset(budget->deferred, 0, sizeof(budget->deferred));
+	memset(budget->deferrals, 0, sizeof(budget->deferrals));
+	budget->user_tel_cost = 0;
+	budget->user_tel_deferred = 0;
+	memset(budget->user_tel_deferrals, 0,
+	       sizeof(budget->user_tel_deferrals));
+	budget->gate_tel_cost = 0;
+	budget->gate_tel_deferred = 0;
+	memset(budget->gate_tel_deferrals, 0,
+	       sizeof(budget->gate_tel_deferrals));
+	write_sequnlock(&budget->lock);
+}
+
+void RevPiDevice_resetDeferrals(void)
+{
+	struct revpi_dev_budget *budget = &RevPiDevices_budget;
+
+	write_seqlock(&budget->lock);
+	memset(budget->deferrals, 0, sizeof(budget->deferrals));
+	memset(budget->user_tel_deferrals, 0,
+	       sizeof(budget->user_tel_deferrals));
+	memset(budget->gate_tel_deferrals, 0,
+	       sizeof(budget->gate_tel_deferrals));
+	write_sequnlock(&budget->lock);
+}
+
+/**
+ * RevPiDevice_showDeferrals() - print deferred exchanges per module
+ * @buf: sysfs buffer of PAGE_SIZE
+ *
+ * One line per module consisting of address, module type and the number of
+ * cyclic exchanges, user telegrams and gateway telegrams deferred because
+ * of an exhausted cycle budget.
+ */
+ssize_t RevPiDevice_showDeferrals(char *buf)
+{
+	struct revpi_dev_budget *budget = &RevPiDevices_budget;
+	u64 deferrals[REV_PI_DEV_CNT_MAX + 1];
+	u64 user_tel_deferrals[REV_PI_DEV_CNT_MAX + 1];
+	u64 gate_tel_deferrals[REV_PI_DEV_CNT_MAX + 1];
+	unsigned int seq;
+	ssize_t len = 0;
+	SDevice *dev;
+	INT8U i;
+
+	do {
+		seq = read_seqbegin(&budget->lock);
+		memcpy(deferrals, budget->deferrals, sizeof(deferrals));
+		memcpy(user_tel_deferrals, budget->user_tel_deferrals,
+		       sizeof(user_tel_deferrals));
+		memcpy(gate_tel_deferrals, budget->gate_tel_deferrals,
+		       sizeof(gate_tel_deferrals));
+	} while (read_seqretry(&budget->lock, seq));
+
+	for (i = 0; i < RevPiDevice_getDevCnt(); i++) {
+		dev = RevPiDevice_getDev(i);
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%u %u %llu %llu %llu\n",
+				 dev->i8uAddress, dev->sId.i16uModulType,
+				 deferrals[i], user_tel_deferrals[i],
+				 gate_tel_deferrals[i]);
+	}
+
+	return len;
+}
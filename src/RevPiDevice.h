@@ -14,6 +14,8 @@ typedef struct _SRevPiProcessImage SRevPiProcessImage;
 #define REV_PI_DEV_FIRST_RIGHT      32
 #define REV_PI_DEV_CNT_MAX          64
 #define REV_PI_DEV_DEFAULT_SERIAL   1
+/* max number of consecutive cycles an exchange may be deferred */
+#define REV_PI_DEV_MAX_DEFERRALS    1
 
 typedef struct _SDevice
 {
@@ -74,3 +76,6 @@ unsigned int RevPiDevice_getCoreOffset(void);
 int RevPiDevice_hat_serial(void);
 void revpi_dev_update_state(INT8U i8uDevice, INT32U r, int *retval);
 void RevPiDevice_handle_internal_telegrams(void);
+void RevPiDevice_resetBudget(void);
+void RevPiDevice_resetDeferrals(void);
+ssize_t RevPiDevice_showDeferrals(char *buf);
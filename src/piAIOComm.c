@@ -2,12 +2,12 @@
 // SPDX-FileCopyrightText: 2016-2023 KUNBUS GmbH
 
 #include <linux/types.h>
-#include <linux/pibridge_comm.h>
 
 #include "piAIOComm.h"
 #include "piControlMain.h"
 #include "revpi_common.h"
 #include "revpi_core.h"
+#include "revpi_replay.h"
 #include "RevPiDevice.h"
 
 #define AIO_MAX_DEVS			10
@@ -231,24 +231,24 @@ u32 piAIOComm_Init(u8 devnum)
 	snd_buf = &aioIn1Config_s[dev_idx];
 
 	pr_info_aio("piAIOComm_Init send configIn1\n");
-	ret = pibridge_req_io(piCore_g.pibridge, addr, IOP_TYP1_CMD_DATA2,
-			      snd_buf, AIO_CONFIG_DATA2_LEN, NULL, 0);
+	ret = revpi_replay_req_io(addr, IOP_TYP1_CMD_DATA2,
+				  snd_buf, AIO_CONFIG_DATA2_LEN, NULL, 0);
 	if (ret)
 		return 3;
 
 	snd_buf = &aioIn2Config_s[dev_idx];
 
 	pr_info_aio("piAIOComm_Init send configIn2\n");
-	ret = pibridge_req_io(piCore_g.pibridge, addr, IOP_TYP1_CMD_DATA3,
-			      snd_buf, AIO_CONFIG_DATA3_LEN, NULL, 0);
+	ret = revpi_replay_req_io(addr, IOP_TYP1_CMD_DATA3,
+				  snd_buf, AIO_CONFIG_DATA3_LEN, NULL, 0);
 	if (ret)
 		return 3;
 
 	snd_buf = &aioConfig_s[dev_idx];
 
 	pr_info_aio("piAIOComm_Init send config\n");
-	ret = pibridge_req_io(piCore_g.pibridge, addr, IOP_TYP1_CMD_CFG,
-			      snd_buf, AIO_CONFIG_DATA1_LEN, NULL, 0);
+	ret = revpi_replay_req_io(addr, IOP_TYP1_CMD_CFG,
+				  snd_buf, AIO_CONFIG_DATA1_LEN, NULL, 0);
 	if (ret)
 		return 3;
 
@@ -273,17 +273,15 @@ u32 piAIOComm_sendCyclicTelegram(u8 devnum)
 	addr = revpi_dev->i8uAddress;
 
 	if (!test_bit(PICONTROL_DEV_FLAG_STOP_IO, &piDev_g.flags)) {
-		my_rt_mutex_lock(&piDev_g.lockPI);
-		memcpy(snd_buf, piDev_g.ai8uPI + revpi_dev->i16uOutputOffset,
+		memcpy(snd_buf, piCore_g.cycle_image + revpi_dev->i16uOutputOffset,
 		       AIO_OUTPUT_DATA_LEN);
-		rt_mutex_unlock(&piDev_g.lockPI);
 	} else {
 		memset(snd_buf, 0, AIO_OUTPUT_DATA_LEN);
 	}
 
-	ret = pibridge_req_io(piCore_g.pibridge, addr, IOP_TYP1_CMD_DATA,
-			      snd_buf, AIO_OUTPUT_DATA_LEN, rcv_buf,
-			      AIO_INPUT_DATA_LEN);
+	ret = revpi_replay_req_io(addr, IOP_TYP1_CMD_DATA,
+				  snd_buf, AIO_OUTPUT_DATA_LEN, rcv_buf,
+				  AIO_INPUT_DATA_LEN);
 	if (ret != AIO_INPUT_DATA_LEN) {
 		pr_debug("AIO addr %2d: communication failed (req:%zu,ret:%d)\n",
 			addr, AIO_INPUT_DATA_LEN, ret);
@@ -295,10 +293,9 @@ u32 piAIOComm_sendCyclicTelegram(u8 devnum)
 	}
 
 	if (!test_bit(PICONTROL_DEV_FLAG_STOP_IO, &piDev_g.flags)) {
-		my_rt_mutex_lock(&piDev_g.lockPI);
-		memcpy(piDev_g.ai8uPI + revpi_dev->i16uInputOffset, rcv_buf,
-		       AIO_INPUT_DATA_LEN);
-		rt_mutex_unlock(&piDev_g.lockPI);
+		memcpy(piCore_g.cycle_image + revpi_dev->i16uInputOffset,
+		       rcv_buf, AIO_INPUT_DATA_LEN);
+		revpi_core_inputs_updated(devnum);
 	}
 
 	return 0;
@@ -49,6 +49,117 @@ struct picontrol_firmware_upload {
 	__u8 padding[15];
 };
 
+/* result of one module of a PICONTROL_UPLOAD_FIRMWARE_ALL request */
+struct picontrol_firmware_result {
+	__u8 addr;
+	__u8 pad;
+	__u16 module_type;
+	/* 0 updated, 1 already up to date, < 0 negative errno */
+	__s32 result;
+	__u32 duration; /* msecs to check and update the module */
+};
+
+struct picontrol_firmware_batch {
+	/* PICONTROL_FIRMWARE_FORCE_UPLOAD, rescue mode is not supported */
+	__u32 flags;
+	/* set by the driver: number of valid entries in results */
+	__u32 count;
+	/* set by the driver: duration of the whole request in msecs */
+	__u32 duration;
+	/* set by the driver: number of distinct firmware images loaded */
+	__u32 images;
+	struct picontrol_firmware_result results[REV_PI_DEV_CNT_MAX];
+	__u8 padding[16];
+};
+
+#define PICONTROL_SAFE_STATE_LEN		256
+
+/*
+ * Safe state of the outputs in a range of the process image. It is applied
+ * when the output watchdog or the logiRTS timeout expires: bits set in force
+ * are set to the corresponding bits of value, bits set in hold keep their
+ * last value and all other bits are set to 0.
+ */
+struct picontrol_safe_state {
+	/* offset of the range in the process image */
+	__u16 offset;
+	/* number of bytes of the range, max PICONTROL_SAFE_STATE_LEN */
+	__u16 length;
+	__u8 force[PICONTROL_SAFE_STATE_LEN];
+	__u8 hold[PICONTROL_SAFE_STATE_LEN];
+	__u8 value[PICONTROL_SAFE_STATE_LEN];
+};
+
+/*
+ * Dump format of the flight recorder in
+ * /sys/class/piControl/piControl0/recorder_data: a header followed by
+ * num_records records of record_len bytes, oldest first. The data of a record contains the regions in the
+ * order of the header.
+ */
+#define PICONTROL_RECORDER_MAGIC		0x52465049 /* "IPFR" */
+#define PICONTROL_RECORDER_MAX_REGIONS		8
+
+/* events which freeze the recorder */
+#define PICONTROL_RECORDER_TRIGGER_WATCHDOG	0x0001
+#define PICONTROL_RECORDER_TRIGGER_LOGIRTS	0x0002
+#define PICONTROL_RECORDER_TRIGGER_MODULE_LOST	0x0004
+
+struct picontrol_recorder_header {
+	__u32 magic;
+	__u16 num_regions;
+	__u16 record_len;
+	__u32 num_records;
+	/* trigger which froze the recorder, 0 if frozen on demand */
+	__u32 trigger;
+	struct {
+		__u16 offset;
+		__u16 length;
+	} regions[PICONTROL_RECORDER_MAX_REGIONS];
+};
+
+struct picontrol_recorder_record {
+	__u64 cycle;
+	/* CLOCK_MONOTONIC in nsecs */
+	__u64 timestamp;
+	__u8 data[];
+};
+
+/*
+ * Capture format of /sys/class/piControl/piControl0/replay_data: a header,
+ * num_devices entries of the driver's internal device table (device_len
+ * bytes each, only valid for the same driver version), pi_len bytes of the
+ * process image at the start of the capture and a sequence of records.
+ * Each cycle consists of the WRITE records of the outputs changed by the
+ * user since the previous cycle, the IO records of the requests to the
+ * modules and a CYCLE record with the crc32 of the module data.
+ */
+#define PICONTROL_CAPTURE_MAGIC			0x43504950 /* "PIPC" */
+#define PICONTROL_CAPTURE_VERSION		1
+
+#define PICONTROL_CAPTURE_WRITE			1 /* arg: offset in the image */
+#define PICONTROL_CAPTURE_IO			2 /* arg: command, ret: result */
+#define PICONTROL_CAPTURE_CYCLE			3 /* data: __u32 crc32 */
+
+struct picontrol_capture_header {
+	__u32 magic;
+	__u16 version;
+	__u16 device_len;
+	/* crc32 of the configuration the capture was taken with */
+	__u32 config_crc;
+	__u16 num_devices;
+	__u16 pi_len;
+};
+
+struct picontrol_capture_record {
+	__u8 type;
+	/* address of the module for IO records */
+	__u8 addr;
+	/* length of the data following the record */
+	__u16 len;
+	__u16 arg;
+	__s16 ret;
+};
+
 typedef struct SDeviceInfoStr {
 	/* Address of module in current configuration */
 	__u8 i8uAddress;
@@ -157,9 +268,26 @@ typedef struct SPIVariableStr {
 #define  KB_WAIT_FOR_EVENT			_IO(KB_IOC_MAGIC, 50 )
 /* piControl was reset, reload configuration */
 #define  KB_EVENT_RESET				1
+/* a module stopped responding, the address is in bits 8..15 */
+#define  KB_EVENT_MODULE_LOST			2
+/* a lost module is responding again, the address is in bits 8..15 */
+#define  KB_EVENT_MODULE_RECOVERED		3
+/* the io-cycle exceeded its max deviation for the configured number of cycles */
+#define  KB_EVENT_CYCLE_OVERRUN			4
+/* the configuration was reloaded and differs from the previous one */
+#define  KB_EVENT_CONFIG_CHANGED		5
+/* events were dropped because the client did not fetch them in time */
+#define  KB_EVENT_OVERFLOW			6
+
+#define  KB_EVENT_TYPE(ev)			((ev) & 0xff)
+#define  KB_EVENT_MODULE(ev)			(((ev) >> 8) & 0xff)
 
 /* new ioctl to upload firmware */
 #define PICONTROL_UPLOAD_FIRMWARE		_IOW(KB_IOC_MAGIC, 200, struct picontrol_firmware_upload )
+/* set the safe state of outputs, cleared on reset */
+#define PICONTROL_SET_SAFE_STATE		_IOW(KB_IOC_MAGIC, 201, struct picontrol_safe_state )
+/* upload firmware to all modules with outdated firmware */
+#define PICONTROL_UPLOAD_FIRMWARE_ALL		_IOWR(KB_IOC_MAGIC, 202, struct picontrol_firmware_batch )
 
 typedef struct SDIOResetCounterStr {
 	/* Address of module in current configuration */
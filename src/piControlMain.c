@@ -7,7 +7,10 @@
 //#define DEBUG
 
 
+#include <linux/crc32.h>
 #include <linux/fs.h>
+#include <linux/if.h>
+#include <linux/kfifo.h>
 #include <linux/list.h>
 #include <linux/semaphore.h>
 #include <linux/thermal.h>
@@ -26,6 +29,9 @@
 #include "revpi_compact.h"
 #include "revpi_common.h"
 #include "revpi_core.h"
+#include "revpi_gate.h"
+#include "revpi_recorder.h"
+#include "revpi_replay.h"
 #include "RevPiDevice.h"
 
 #define FIRMWARE_FILENAME_LEN			32
@@ -49,6 +55,9 @@ MODULE_SOFTDEP("pre: bcm2835-thermal "	/* cpu temp in process image */
 
 static unsigned int picontrol_max_cycle_deviation;
 static unsigned int picontrol_cycle_duration;
+static char *picontrol_cycle_clock;
+static unsigned int picontrol_cycle_phase;
+static bool picontrol_cycle_budget;
 
 module_param(picontrol_max_cycle_deviation, uint, S_IRUSR);
 MODULE_PARM_DESC(picontrol_max_cycle_deviation,
@@ -57,6 +66,18 @@ MODULE_PARM_DESC(picontrol_max_cycle_deviation,
 module_param(picontrol_cycle_duration, uint, S_IRUSR);
 MODULE_PARM_DESC(picontrol_cycle_duration, "Specify a fixed io-cycle duration in usecs. "
 					   "Use 0 to use the fastest possible io-cycle duration.");
+
+module_param(picontrol_cycle_clock, charp, S_IRUSR);
+MODULE_PARM_DESC(picontrol_cycle_clock, "Align the start of the io-cycle to this clock "
+					"(\"monotonic\" (default, no alignment), \"realtime\" or \"tai\").");
+
+module_param(picontrol_cycle_phase, uint, S_IRUSR);
+MODULE_PARM_DESC(picontrol_cycle_phase, "Specify the phase offset in usecs of the io-cycle start "
+					"relative to a multiple of the cycle duration on the cycle clock.");
+
+module_param(picontrol_cycle_budget, bool, S_IRUSR);
+MODULE_PARM_DESC(picontrol_cycle_budget, "Defer analog, relay and internal exchanges to the next "
+					 "io-cycle if they do not fit into a fixed io-cycle duration.");
 /******************************************************************************/
 /******************************  Prototypes  **********************************/
 /******************************************************************************/
@@ -336,22 +357,465 @@ static ssize_t cycles_missed_show(struct device *dev,
 	return sprintf(buf, "%llu\n", missed);
 }
 
-static ssize_t cycles_missed_store(struct device *dev,
-				   struct device_attribute *attr,
-				   const char *buf, size_t count)
+static ssize_t cycles_missed_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned long val;
+
+	if (kstrtoul(buf, 10, &val))
+		return -EINVAL;
+
+	if (val != 0)
+		return -EINVAL;
+
+	write_seqlock(&cycle->lock);
+	cycle->missed = 0;
+	write_sequnlock(&cycle->lock);
+
+	return count;
+}
+
+static ssize_t cycle_phase_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned int phase;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&cycle->lock);
+		phase = cycle->phase;
+	} while (read_seqretry(&cycle->lock, seq));
+
+	return sprintf(buf, "%u\n", phase);
+}
+
+static ssize_t cycle_phase_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned long val;
+
+	if (kstrtoul(buf, 10, &val))
+		return -EINVAL;
+
+	if (val >= PICONTROL_CYCLE_MAX_DURATION)
+		return -EINVAL;
+
+	write_seqlock(&cycle->lock);
+	cycle->phase = val;
+	write_sequnlock(&cycle->lock);
+
+	return count;
+}
+
+static ssize_t last_phase_error_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned int last;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&cycle->lock);
+		last = cycle->last_phase_error;
+	} while (read_seqretry(&cycle->lock, seq));
+
+	return sprintf(buf, "%u\n", last);
+}
+
+static ssize_t max_phase_error_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned int max;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&cycle->lock);
+		max = cycle->max_phase_error;
+	} while (read_seqretry(&cycle->lock, seq));
+
+	return sprintf(buf, "%u\n", max);
+}
+
+static ssize_t max_phase_error_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned long val;
+
+	if (kstrtoul(buf, 10, &val))
+		return -EINVAL;
+
+	if (val != 0)
+		return -EINVAL;
+
+	write_seqlock(&cycle->lock);
+	cycle->max_phase_error = 0;
+	write_sequnlock(&cycle->lock);
+
+	return count;
+}
+
+static ssize_t cycle_budget_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned int seq;
+	bool budget;
+
+	do {
+		seq = read_seqbegin(&cycle->lock);
+		budget = cycle->budget;
+	} while (read_seqretry(&cycle->lock, seq));
+
+	return sprintf(buf, "%u\n", budget);
+}
+
+static ssize_t cycle_budget_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	bool val;
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	write_seqlock(&cycle->lock);
+	cycle->budget = val;
+	write_sequnlock(&cycle->lock);
+
+	return count;
+}
+
+static ssize_t cycle_deferrals_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	return RevPiDevice_showDeferrals(buf);
+}
+
+static ssize_t cycle_deferrals_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	unsigned long val;
+
+	if (kstrtoul(buf, 10, &val))
+		return -EINVAL;
+
+	if (val != 0)
+		return -EINVAL;
+
+	RevPiDevice_resetDeferrals();
+
+	return count;
+}
+
+static ssize_t cycle_overrun_threshold_show(struct device *dev,
+					    struct device_attribute *attr,
+					    char *buf)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned int threshold;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&cycle->lock);
+		threshold = cycle->overrun_threshold;
+	} while (read_seqretry(&cycle->lock, seq));
+
+	return sprintf(buf, "%u\n", threshold);
+}
+
+static ssize_t cycle_overrun_threshold_store(struct device *dev,
+					     struct device_attribute *attr,
+					     const char *buf, size_t count)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned int val;
+
+	if (kstrtouint(buf, 10, &val))
+		return -EINVAL;
+
+	write_seqlock(&cycle->lock);
+	cycle->overrun_threshold = val;
+	write_sequnlock(&cycle->lock);
+
+	return count;
+}
+
+static ssize_t events_lost_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	u64 lost;
+
+	my_rt_mutex_lock(&piDev_g.lockListCon);
+	lost = piDev_g.events_lost;
+	rt_mutex_unlock(&piDev_g.lockListCon);
+
+	return sprintf(buf, "%llu\n", lost);
+}
+
+static ssize_t events_lost_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	unsigned long val;
+
+	if (kstrtoul(buf, 10, &val))
+		return -EINVAL;
+
+	if (val != 0)
+		return -EINVAL;
+
+	my_rt_mutex_lock(&piDev_g.lockListCon);
+	piDev_g.events_lost = 0;
+	rt_mutex_unlock(&piDev_g.lockListCon);
+
+	return count;
+}
+
+static ssize_t last_safe_state_latency_show(struct device *dev,
+					    struct device_attribute *attr,
+					    char *buf)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned int last;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&cycle->lock);
+		last = cycle->last_safe_state_latency;
+	} while (read_seqretry(&cycle->lock, seq));
+
+	return sprintf(buf, "%u\n", last);
+}
+
+static ssize_t max_safe_state_latency_show(struct device *dev,
+					   struct device_attribute *attr,
+					   char *buf)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned int max;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&cycle->lock);
+		max = cycle->max_safe_state_latency;
+	} while (read_seqretry(&cycle->lock, seq));
+
+	return sprintf(buf, "%u\n", max);
+}
+
+static ssize_t max_safe_state_latency_store(struct device *dev,
+					    struct device_attribute *attr,
+					    const char *buf, size_t count)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned long val;
+
+	if (kstrtoul(buf, 10, &val))
+		return -EINVAL;
+
+	if (val != 0)
+		return -EINVAL;
+
+	write_seqlock(&cycle->lock);
+	cycle->max_safe_state_latency = 0;
+	write_sequnlock(&cycle->lock);
+
+	return count;
+}
+
+static ssize_t last_cycle_locks_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned int last;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&cycle->lock);
+		last = cycle->last_locks;
+	} while (read_seqretry(&cycle->lock, seq));
+
+	return sprintf(buf, "%u\n", last);
+}
+
+static ssize_t last_cycle_lock_time_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned int last;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&cycle->lock);
+		last = cycle->last_lock_time;
+	} while (read_seqretry(&cycle->lock, seq));
+
+	return sprintf(buf, "%u\n", last);
+}
+
+static ssize_t max_cycle_lock_time_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned int max;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&cycle->lock);
+		max = cycle->max_lock_time;
+	} while (read_seqretry(&cycle->lock, seq));
+
+	return sprintf(buf, "%u\n", max);
+}
+
+static ssize_t max_cycle_lock_time_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned long val;
+
+	if (kstrtoul(buf, 10, &val))
+		return -EINVAL;
+
+	if (val != 0)
+		return -EINVAL;
+
+	write_seqlock(&cycle->lock);
+	cycle->max_lock_time = 0;
+	write_sequnlock(&cycle->lock);
+
+	return count;
+}
+
+static ssize_t lock_stats_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	return revpi_lock_stats_show(buf);
+}
+
+static ssize_t lock_stats_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	unsigned long val;
+
+	if (kstrtoul(buf, 10, &val))
+		return -EINVAL;
+
+	if (val != 0)
+		return -EINVAL;
+
+	revpi_lock_stats_reset();
+
+	return count;
+}
+
+static ssize_t lock_stats_enable_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", revpi_lock_stats_enabled());
+}
+
+static ssize_t lock_stats_enable_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	bool enable;
+
+	if (kstrtobool(buf, &enable))
+		return -EINVAL;
+
+	revpi_lock_stats_enable(enable);
+
+	return count;
+}
+
+static ssize_t firmware_updates_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	return fwu_show_stats(buf);
+}
+
+static ssize_t gate_latency_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	return revpi_gate_show_latency(buf);
+}
+
+static ssize_t gate_latency_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	unsigned long val;
+
+	if (kstrtoul(buf, 10, &val))
+		return -EINVAL;
+
+	if (val != 0)
+		return -EINVAL;
+
+	revpi_gate_reset_latency();
+
+	return count;
+}
+
+static ssize_t gate_stats_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	return revpi_gate_show_stats(buf);
+}
+
+static ssize_t gate_stats_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	unsigned long val;
+
+	if (kstrtoul(buf, 10, &val))
+		return -EINVAL;
+
+	if (val != 0)
+		return -EINVAL;
+
+	revpi_gate_reset_stats();
+
+	return count;
+}
+
+static ssize_t gate_timing_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return revpi_gate_show_timing(buf);
+}
+
+static ssize_t gate_timing_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
 {
-	struct picontrol_cycle *cycle = &piDev_g.cycle;
-	unsigned long val;
-
-	if (kstrtoul(buf, 10, &val))
-		return -EINVAL;
+	unsigned int send_interval;
+	unsigned int timeout;
+	char name[IFNAMSIZ];
+	int ret;
 
-	if (val != 0)
+	if (sscanf(buf, "%15s %u %u", name, &send_interval, &timeout) != 3)
 		return -EINVAL;
 
-	write_seqlock(&cycle->lock);
-	cycle->missed = 0;
-	write_sequnlock(&cycle->lock);
+	ret = revpi_gate_set_timing(name, send_interval, timeout);
+	if (ret)
+		return ret;
 
 	return count;
 }
@@ -363,6 +827,24 @@ static DEVICE_ATTR_RO(last_cycle);
 static DEVICE_ATTR_RW(max_cycle_deviation);
 static DEVICE_ATTR_RW(cycles_exceeded);
 static DEVICE_ATTR_RW(cycles_missed);
+static DEVICE_ATTR_RW(cycle_phase);
+static DEVICE_ATTR_RO(last_phase_error);
+static DEVICE_ATTR_RW(max_phase_error);
+static DEVICE_ATTR_RW(cycle_budget);
+static DEVICE_ATTR_RW(cycle_deferrals);
+static DEVICE_ATTR_RW(cycle_overrun_threshold);
+static DEVICE_ATTR_RW(events_lost);
+static DEVICE_ATTR_RO(last_safe_state_latency);
+static DEVICE_ATTR_RW(max_safe_state_latency);
+static DEVICE_ATTR_RO(firmware_updates);
+static DEVICE_ATTR_RW(gate_latency);
+static DEVICE_ATTR_RW(gate_stats);
+static DEVICE_ATTR_RW(gate_timing);
+static DEVICE_ATTR_RO(last_cycle_locks);
+static DEVICE_ATTR_RO(last_cycle_lock_time);
+static DEVICE_ATTR_RW(max_cycle_lock_time);
+static DEVICE_ATTR_RW(lock_stats);
+static DEVICE_ATTR_RW(lock_stats_enable);
 
 static int piControl_init_sysfs(void)
 {
@@ -396,8 +878,131 @@ static int piControl_init_sysfs(void)
 	if (ret)
 		goto remove_exceeded_cycles_file;
 
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_cycle_phase.attr);
+	if (ret)
+		goto remove_missed_cycles_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_last_phase_error.attr);
+	if (ret)
+		goto remove_cycle_phase_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_max_phase_error.attr);
+	if (ret)
+		goto remove_last_phase_error_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_cycle_budget.attr);
+	if (ret)
+		goto remove_max_phase_error_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_cycle_deferrals.attr);
+	if (ret)
+		goto remove_cycle_budget_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_cycle_overrun_threshold.attr);
+	if (ret)
+		goto remove_cycle_deferrals_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_events_lost.attr);
+	if (ret)
+		goto remove_cycle_overrun_threshold_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_last_safe_state_latency.attr);
+	if (ret)
+		goto remove_events_lost_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_max_safe_state_latency.attr);
+	if (ret)
+		goto remove_last_safe_state_latency_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_firmware_updates.attr);
+	if (ret)
+		goto remove_max_safe_state_latency_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_gate_latency.attr);
+	if (ret)
+		goto remove_firmware_updates_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_gate_stats.attr);
+	if (ret)
+		goto remove_gate_latency_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_gate_timing.attr);
+	if (ret)
+		goto remove_gate_stats_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_last_cycle_locks.attr);
+	if (ret)
+		goto remove_gate_timing_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_last_cycle_lock_time.attr);
+	if (ret)
+		goto remove_last_cycle_locks_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_max_cycle_lock_time.attr);
+	if (ret)
+		goto remove_last_cycle_lock_time_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_lock_stats.attr);
+	if (ret)
+		goto remove_max_cycle_lock_time_file;
+
+	ret = sysfs_create_file(&piDev_g.dev->kobj, &dev_attr_lock_stats_enable.attr);
+	if (ret)
+		goto remove_lock_stats_file;
+
+	ret = revpi_recorder_init(piDev_g.dev);
+	if (ret)
+		goto remove_lock_stats_enable_file;
+
+	ret = revpi_replay_init(piDev_g.dev);
+	if (ret)
+		goto remove_recorder_files;
+
 	return 0;
 
+remove_recorder_files:
+	revpi_recorder_fini(piDev_g.dev);
+remove_lock_stats_enable_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_lock_stats_enable.attr);
+remove_lock_stats_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_lock_stats.attr);
+remove_max_cycle_lock_time_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_max_cycle_lock_time.attr);
+remove_last_cycle_lock_time_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_last_cycle_lock_time.attr);
+remove_last_cycle_locks_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_last_cycle_locks.attr);
+remove_gate_timing_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_gate_timing.attr);
+remove_gate_stats_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_gate_stats.attr);
+remove_gate_latency_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_gate_latency.attr);
+remove_firmware_updates_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_firmware_updates.attr);
+remove_max_safe_state_latency_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_max_safe_state_latency.attr);
+remove_last_safe_state_latency_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_last_safe_state_latency.attr);
+remove_events_lost_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_events_lost.attr);
+
+remove_cycle_overrun_threshold_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_cycle_overrun_threshold.attr);
+remove_cycle_deferrals_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_cycle_deferrals.attr);
+
+remove_cycle_budget_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_cycle_budget.attr);
+remove_max_phase_error_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_max_phase_error.attr);
+
+remove_last_phase_error_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_last_phase_error.attr);
+remove_cycle_phase_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_cycle_phase.attr);
+remove_missed_cycles_file:
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_cycles_missed.attr);
 remove_exceeded_cycles_file:
 	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_cycles_exceeded.attr);
 remove_max_cycle_deviation_file:
@@ -416,6 +1021,26 @@ remove_cycle_duration_file:
 
 static void piControl_deinit_sysfs(void)
 {
+	revpi_replay_fini(piDev_g.dev);
+	revpi_recorder_fini(piDev_g.dev);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_lock_stats_enable.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_lock_stats.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_max_cycle_lock_time.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_last_cycle_lock_time.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_last_cycle_locks.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_gate_timing.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_gate_stats.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_gate_latency.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_firmware_updates.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_max_safe_state_latency.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_last_safe_state_latency.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_events_lost.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_cycle_overrun_threshold.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_cycle_deferrals.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_cycle_budget.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_max_phase_error.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_last_phase_error.attr);
+	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_cycle_phase.attr);
 	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_cycles_missed.attr);
 	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_cycles_exceeded.attr);
 	sysfs_remove_file(&piDev_g.dev->kobj, &dev_attr_max_cycle_deviation.attr);
@@ -504,6 +1129,35 @@ static int pibridge_probe(struct platform_device *pdev)
 			piDev_g.cycle.max_deviation);
 	}
 
+	piDev_g.cycle.budget = picontrol_cycle_budget;
+	if (piDev_g.cycle.budget)
+		pr_info("Using cycle budget\n");
+
+	piDev_g.cycle.clock = CLOCK_MONOTONIC;
+	if (picontrol_cycle_clock) {
+		if (!strcmp(picontrol_cycle_clock, "realtime"))
+			piDev_g.cycle.clock = CLOCK_REALTIME;
+		else if (!strcmp(picontrol_cycle_clock, "tai"))
+			piDev_g.cycle.clock = CLOCK_TAI;
+		else if (strcmp(picontrol_cycle_clock, "monotonic"))
+			pr_warn("Invalid cycle clock %s specified\n",
+				picontrol_cycle_clock);
+
+		if (piDev_g.cycle.clock != CLOCK_MONOTONIC)
+			pr_info("Aligning cycle to %s clock\n",
+				picontrol_cycle_clock);
+	}
+
+	if (picontrol_cycle_phase) {
+		if (picontrol_cycle_phase >= PICONTROL_CYCLE_MAX_DURATION) {
+			pr_warn("Invalid cycle phase %u specified (max=%u)\n",
+				picontrol_cycle_phase, PICONTROL_CYCLE_MAX_DURATION - 1);
+		} else {
+			piDev_g.cycle.phase = picontrol_cycle_phase;
+			pr_info("Using cycle phase %u\n", piDev_g.cycle.phase);
+		}
+	}
+
 	piDev_g.cycle.last = 0;
 	piDev_g.cycle.max = 0;
 	/*
@@ -601,6 +1255,14 @@ static int pibridge_probe(struct platform_device *pdev)
 	piDev_g.tLastOutput1 = ktime_set(0, 0);
 	piDev_g.tLastOutput2 = ktime_set(0, 0);
 
+	piDev_g.thermal_zone = thermal_zone_get_zone_by_name("cpu-thermal");
+	if (IS_ERR(piDev_g.thermal_zone)) {
+		pr_err("cannot find thermal zone\n");
+		piDev_g.thermal_zone = NULL;
+	}
+
+	revpi_housekeeping_start();
+
 	/* start application */
 	piConfigParse(PICONFIG_FILE, &piDev_g.devs, &piDev_g.ent, &piDev_g.cl,
 		      &piDev_g.connl);
@@ -617,12 +1279,6 @@ static int pibridge_probe(struct platform_device *pdev)
 	if (res)
 		goto err_free_config;
 
-	piDev_g.thermal_zone = thermal_zone_get_zone_by_name("cpu-thermal");
-	if (IS_ERR(piDev_g.thermal_zone)) {
-		pr_err("cannot find thermal zone\n");
-		piDev_g.thermal_zone = NULL;
-	}
-
 	res = cdev_add(&piDev_g.cdev, curdev, 1);
 	if (res) {
 		pr_err("cannot add cdev\n");
@@ -644,6 +1300,8 @@ err_revpi_fini:
 			revpi_flat_remove(pdev);
 	}
 err_free_config:
+	cancel_work_sync(&piControl_event_work);
+	revpi_housekeeping_stop();
 	kfree(piDev_g.ent);
 	kfree(piDev_g.devs);
 err_sysfs_remove:
@@ -660,10 +1318,159 @@ err_unreg_chrdev_region:
 /*****************************************************************************/
 /*       C L E A N U P                                                       */
 /*****************************************************************************/
+/*
+ * Checksum over the devices and entries of the configuration to detect
+ * whether a reset actually changed the configuration.
+ */
+u32 piControl_config_crc(void)
+{
+	u32 crc = 0;
+
+	if (piDev_g.devs)
+		crc = crc32(crc, piDev_g.devs, sizeof(*piDev_g.devs) +
+			    piDev_g.devs->i16uNumDevices * sizeof(SDeviceInfo));
+	if (piDev_g.ent)
+		crc = crc32(crc, piDev_g.ent, sizeof(*piDev_g.ent) +
+			    piDev_g.ent->i16uNumEntries * sizeof(SEntryInfo));
+
+	return crc;
+}
+
+/**
+ * piControl_post_event() - queue an event for the open instances
+ * @event: KB_EVENT_* value, possibly combined with a module address
+ * @skip: instance which shall not receive the event, may be NULL
+ *
+ * The event is stored in the preallocated ring of each instance. An event
+ * which is still pending in a ring is not queued a second time. If a ring
+ * is full, the event is dropped and the instance receives KB_EVENT_OVERFLOW
+ * once it has fetched the pending events. KB_EVENT_RESET is never dropped,
+ * it is noted separately and fetched before KB_EVENT_OVERFLOW.
+ *
+ * Walks all instances and may sleep, the io threads use
+ * piControl_queue_event() instead.
+ */
+void piControl_post_event(u32 event, tpiControlInst *skip)
+{
+	tpiControlInst *inst;
+	unsigned int i;
+	bool found;
+
+	my_rt_mutex_lock(&piDev_g.lockListCon);
+	list_for_each_entry(inst, &piDev_g.listCon, list) {
+		if (inst == skip)
+			continue;
+
+		found = false;
+
+		my_rt_mutex_lock(&inst->lockEventList);
+		for (i = inst->event_tail; i != inst->event_head; i++) {
+			if (inst->events[i & (PICONTROL_EVENT_RING_SIZE - 1)] == event) {
+				found = true;
+				break;
+			}
+		}
+
+		if (found) {
+			rt_mutex_unlock(&inst->lockEventList);
+			continue;
+		}
+
+		if (inst->event_head - inst->event_tail < PICONTROL_EVENT_RING_SIZE) {
+			inst->events[inst->event_head & (PICONTROL_EVENT_RING_SIZE - 1)] = event;
+			inst->event_head++;
+		} else if (event == KB_EVENT_RESET) {
+			inst->event_reset = true;
+		} else {
+			inst->event_overflow = true;
+			piDev_g.events_lost++;
+		}
+		rt_mutex_unlock(&inst->lockEventList);
+
+		wake_up(&inst->wq);
+	}
+	rt_mutex_unlock(&piDev_g.lockListCon);
+}
+
+/* events of the io threads which were not yet posted to the instances */
+#define PICONTROL_EVENT_FIFO_SIZE	64
+
+static DEFINE_KFIFO(piControl_event_fifo, u32, PICONTROL_EVENT_FIFO_SIZE);
+static DEFINE_SPINLOCK(piControl_event_fifo_lock);
+/* events dropped because of a full fifo, protected by the fifo lock */
+static unsigned int piControl_event_fifo_lost;
+
+static void piControl_event_work_fn(struct work_struct *work)
+{
+	tpiControlInst *inst;
+	unsigned int lost;
+	u32 event;
+
+	/* the worker is the only reader of the fifo */
+	while (kfifo_get(&piControl_event_fifo, &event))
+		piControl_post_event(event, NULL);
+
+	spin_lock(&piControl_event_fifo_lock);
+	lost = piControl_event_fifo_lost;
+	piControl_event_fifo_lost = 0;
+	spin_unlock(&piControl_event_fifo_lock);
+
+	if (!lost)
+		return;
+
+	my_rt_mutex_lock(&piDev_g.lockListCon);
+	piDev_g.events_lost += lost;
+	list_for_each_entry(inst, &piDev_g.listCon, list) {
+		my_rt_mutex_lock(&inst->lockEventList);
+		inst->event_overflow = true;
+		rt_mutex_unlock(&inst->lockEventList);
+		wake_up(&inst->wq);
+	}
+	rt_mutex_unlock(&piDev_g.lockListCon);
+}
+
+static DECLARE_WORK(piControl_event_work, piControl_event_work_fn);
+
+/**
+ * piControl_queue_event() - queue an event of an io thread
+ * @event: KB_EVENT_* value, possibly combined with a module address
+ *
+ * The io threads must not walk the instances, so the event is handed over
+ * to a worker which posts it with piControl_post_event(). If the worker
+ * falls behind, the event is dropped and all instances receive
+ * KB_EVENT_OVERFLOW.
+ */
+void piControl_queue_event(u32 event)
+{
+	spin_lock(&piControl_event_fifo_lock);
+	if (!kfifo_put(&piControl_event_fifo, event))
+		piControl_event_fifo_lost++;
+	spin_unlock(&piControl_event_fifo_lock);
+
+	queue_work(system_wq, &piControl_event_work);
+}
+
+static bool piControl_event_pending(tpiControlInst *priv)
+{
+	return READ_ONCE(priv->event_head) != READ_ONCE(priv->event_tail) ||
+	       READ_ONCE(priv->event_reset) ||
+	       READ_ONCE(priv->event_overflow);
+}
+
 static int piControlReset(tpiControlInst * priv)
 {
 	int status = -EFAULT;
 	int timeout = 10000;	// ms
+	u32 crc;
+
+	crc = piControl_config_crc();
+
+	/* the safe state belongs to the configuration */
+	revpi_lock_pi(PICONTROL_LOCK_USER);
+	memset(piDev_g.ai8uPISafeForce, 0, sizeof(piDev_g.ai8uPISafeForce));
+	memset(piDev_g.ai8uPISafeHold, 0, sizeof(piDev_g.ai8uPISafeHold));
+	memset(piDev_g.ai8uPISafeValue, 0, sizeof(piDev_g.ai8uPISafeValue));
+	revpi_unlock_pi();
 
 	kfree(piDev_g.ent);
 	piDev_g.ent = NULL;
@@ -689,39 +1496,9 @@ static int piControlReset(tpiControlInst * priv)
 	if (!waitRunning(timeout)) {
 		status = -ETIMEDOUT;
 	} else {
-		struct list_head *pCon;
-
-		my_rt_mutex_lock(&piDev_g.lockListCon);
-		list_for_each(pCon, &piDev_g.listCon) {
-			tpiControlInst *pos_inst;
-			pos_inst = list_entry(pCon, tpiControlInst, list);
-			if (pos_inst != priv) {
-				struct list_head *pEv;
-				tpiEventEntry *pEntry;
-				bool found = false;
-
-				// add the event to the list only, if it not already there
-				my_rt_mutex_lock(&pos_inst->lockEventList);
-				list_for_each(pEv, &pos_inst->piEventList) {
-					pEntry = list_entry(pEv, tpiEventEntry, list);
-					if (pEntry->event == piEvReset) {
-						found = true;
-						break;
-					}
-				}
-
-				if (!found) {
-					pEntry = kmalloc(sizeof(tpiEventEntry), GFP_KERNEL);
-					pEntry->event = piEvReset;
-					list_add_tail(&pEntry->list, &pos_inst->piEventList);
-					rt_mutex_unlock(&pos_inst->lockEventList);
-					wake_up(&pos_inst->wq);
-				} else {
-					rt_mutex_unlock(&pos_inst->lockEventList);
-				}
-			}
-		}
-		rt_mutex_unlock(&piDev_g.lockListCon);
+		piControl_post_event(KB_EVENT_RESET, priv);
+		if (crc != piControl_config_crc())
+			piControl_post_event(KB_EVENT_CONFIG_CHANGED, NULL);
 
 		status = 0;
 	}
@@ -751,6 +1528,8 @@ static int pibridge_remove(struct platform_device *pdev)
 			revpi_flat_remove(pdev);
 	}
 
+	cancel_work_sync(&piControl_event_work);
+	revpi_housekeeping_stop();
 	kfree(piDev_g.ent);
 	kfree(piDev_g.devs);
 	piControl_deinit_sysfs();
@@ -810,6 +1589,36 @@ void printUserMsg(tpiControlInst *priv, const char *s, ...)
 	pr_info("%s", priv->pcErrorMessage);
 }
 
+/*
+ * The watchdog of an instance only flags the expiry, the outputs are reset by
+ * the next io cycle. While the client stays silent, the outputs are reset
+ * again after every timeout period.
+ */
+static enum hrtimer_restart piControl_watchdog_expired(struct hrtimer *timer)
+{
+	tpiControlInst *priv = container_of(timer, tpiControlInst, watchdog);
+
+	set_bit(PICONTROL_DEV_FLAG_WATCHDOG_EXPIRED, &piDev_g.flags);
+	hrtimer_forward_now(timer, ms_to_ktime(READ_ONCE(priv->tTimeoutDurationMs)));
+
+	return HRTIMER_RESTART;
+}
+
+static void piControl_watchdog_refresh(tpiControlInst *priv)
+{
+	if (priv->tTimeoutDurationMs > 0)
+		hrtimer_start(&priv->watchdog,
+			      ms_to_ktime(priv->tTimeoutDurationMs),
+			      HRTIMER_MODE_REL);
+}
+
+/* Machines without a cyclic io thread only pick up outputs on demand */
+static void piControl_outputs_written(void)
+{
+	if (piDev_g.machine_type == REVPI_FLAT)
+		revpi_flat_outputs_written();
+}
+
 /*****************************************************************************/
 /*              O P E N                                                      */
 /*****************************************************************************/
@@ -825,8 +1634,14 @@ static int piControlOpen(struct inode *inode, struct file *file)
 
 	/* initalize instance variables */
 	priv->dev = piDev_g.dev;
-	INIT_LIST_HEAD(&priv->piEventList);
 	rt_mutex_init(&priv->lockEventList);
+#if KERNEL_VERSION(6, 13, 0) > LINUX_VERSION_CODE
+	hrtimer_init(&priv->watchdog, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	priv->watchdog.function = piControl_watchdog_expired;
+#else
+	hrtimer_setup(&priv->watchdog, piControl_watchdog_expired,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#endif
 
 	init_waitqueue_head(&priv->wq);
 
@@ -843,33 +1658,28 @@ static int piControlOpen(struct inode *inode, struct file *file)
 static int piControlRelease(struct inode *inode, struct file *file)
 {
 	tpiControlInst *priv;
-	struct list_head *pos, *n;
 
 	priv = (tpiControlInst *) file->private_data;
 
+	hrtimer_cancel(&priv->watchdog);
+
 	if (priv->tTimeoutDurationMs > 0) {
-		// if the watchdog is active, set all outputs to 0
+		// if the watchdog is active, set all outputs to their safe state
 		int i;
-		my_rt_mutex_lock(&piDev_g.lockPI);
+		revpi_lock_pi(PICONTROL_LOCK_USER);
 		for (i = 0; i < RevPiDevice_getDevCnt(); i++) {
 			if (RevPiDevice_getDev(i)->i8uActive) {
-				memset(piDev_g.ai8uPI + RevPiDevice_getDev(i)->i16uOutputOffset, 0, RevPiDevice_getDev(i)->sId.i16uFBS_OutputLength);
+				revpi_safe_state_apply(RevPiDevice_getDev(i)->i16uOutputOffset, RevPiDevice_getDev(i)->sId.i16uFBS_OutputLength);
 			}
 		}
-		rt_mutex_unlock(&piDev_g.lockPI);
+		revpi_unlock_pi();
+		piControl_outputs_written();
 	}
 
 	my_rt_mutex_lock(&piDev_g.lockListCon);
 	list_del(&priv->list);
 	rt_mutex_unlock(&piDev_g.lockListCon);
 
-	list_for_each_safe(pos, n, &priv->piEventList) {
-		tpiEventEntry *pos_inst;
-		pos_inst = list_entry(pos, tpiEventEntry, list);
-		list_del(pos);
-		kfree(pos_inst);
-	}
-
 	kfree(priv);
 
 	return 0;
@@ -901,13 +1711,13 @@ static ssize_t piControlRead(struct file *file, char __user * pBuf, size_t count
 
 	pPd = piDev_g.ai8uPI + *ppos;
 
-	my_rt_mutex_lock(&piDev_g.lockPI);
+	revpi_lock_pi(PICONTROL_LOCK_USER);
 	if (copy_to_user(pBuf, pPd, nread) != 0) {
-		rt_mutex_unlock(&piDev_g.lockPI);
+		revpi_unlock_pi();
 		pr_err("piControlRead: copy_to_user failed");
 		return -EFAULT;
 	}
-	rt_mutex_unlock(&piDev_g.lockPI);
+	revpi_unlock_pi();
 
 	*ppos += nread;
 
@@ -940,18 +1750,17 @@ static ssize_t piControlWrite(struct file *file, const char __user * pBuf, size_
 
 	pPd = piDev_g.ai8uPI + *ppos;
 
-	my_rt_mutex_lock(&piDev_g.lockPI);
+	revpi_lock_pi(PICONTROL_LOCK_USER);
 	if (copy_from_user(pPd, pBuf, nwrite) != 0) {
-		rt_mutex_unlock(&piDev_g.lockPI);
+		revpi_unlock_pi();
 		pr_err("piControlWrite: copy_from_user failed");
 		return -EFAULT;
 	}
-	rt_mutex_unlock(&piDev_g.lockPI);
+	revpi_unlock_pi();
 	*ppos += nwrite;
 
-	if (priv->tTimeoutDurationMs > 0) {
-		priv->tTimeoutTS = ktime_add_ms(ktime_get(), priv->tTimeoutDurationMs);
-	}
+	piControl_outputs_written();
+	piControl_watchdog_refresh(priv);
 
 	return nwrite;		// length written
 }
@@ -1067,6 +1876,191 @@ static int picontrol_upload_firmware(struct picontrol_firmware_upload *fwu,
 	return ret;
 }
 
+struct picontrol_firmware_image {
+	unsigned int module_type;
+	unsigned int hw_rev;
+	const struct firmware *fw;
+	int err;
+};
+
+static const struct firmware *
+picontrol_get_firmware_image(struct picontrol_firmware_image *images,
+			     unsigned int *num, unsigned int module_type,
+			     unsigned int hw_rev, int *err)
+{
+	char fw_filename[FIRMWARE_FILENAME_LEN];
+	struct picontrol_firmware_image *img;
+	unsigned int i;
+
+	for (i = 0; i < *num; i++) {
+		img = &images[i];
+		if (img->module_type == module_type && img->hw_rev == hw_rev) {
+			*err = img->err;
+			return img->fw;
+		}
+	}
+
+	img = &images[(*num)++];
+	img->module_type = module_type;
+	img->hw_rev = hw_rev;
+
+	snprintf(fw_filename, sizeof(fw_filename), "revpi/fw_%05d_%03d.fwu",
+		 module_type, hw_rev);
+
+	if (request_firmware(&img->fw, fw_filename, piDev_g.dev)) {
+		pr_err("Failed to load firmware %s\n", fw_filename);
+		img->fw = NULL;
+		img->err = -EIO;
+	}
+
+	*err = img->err;
+	return img->fw;
+}
+
+/* module of a batch update which is actually updated */
+struct picontrol_firmware_update {
+	struct picontrol_firmware_result *res;
+	SDevice *sdev;
+	const struct firmware *fw;
+	unsigned int module_type;
+	unsigned int hw_rev;
+};
+
+/*
+ * Update all modules with outdated firmware. Every distinct firmware image
+ * is loaded only once. The outdated modules are determined first. Then the
+ * PiBridge is stopped once, all of them are updated and piControl is reset
+ * once at the end, which enumerates the updated modules again. The device
+ * list is only rebuilt by the reset, so it stays valid during the updates.
+ */
+static int picontrol_upload_firmware_all(struct picontrol_firmware_batch *batch,
+					 tpiControlInst *priv)
+{
+	struct picontrol_firmware_update *updates, *upd;
+	struct picontrol_firmware_image *images;
+	struct picontrol_firmware_result *res;
+	const struct firmware *fw;
+	unsigned int num_updates = 0;
+	unsigned int num_images = 0;
+	unsigned int module_type;
+	unsigned int hw_rev;
+	unsigned int cnt;
+	ktime_t start, mod_start;
+	SDevice *sdev;
+	unsigned int n;
+	int ret;
+	int i;
+
+	start = ktime_get();
+
+	if (!isRunning()) {
+		pr_err("PiBridge communication halted, not updating firmware\n");
+		return -EAGAIN;
+	}
+
+	cnt = min_t(unsigned int, RevPiDevice_getDevCnt(),
+		    ARRAY_SIZE(batch->results));
+
+	images = kcalloc(cnt, sizeof(*images), GFP_KERNEL);
+	if (!images)
+		return -ENOMEM;
+
+	updates = kcalloc(cnt, sizeof(*updates), GFP_KERNEL);
+	if (!updates) {
+		kfree(images);
+		return -ENOMEM;
+	}
+
+	batch->count = 0;
+
+	for (i = 0; i < cnt; i++) {
+		sdev = RevPiDevice_getDev(i);
+		if (!sdev->i8uAddress)
+			continue;
+
+		mod_start = ktime_get();
+		res = &batch->results[batch->count++];
+		res->addr = sdev->i8uAddress;
+
+		module_type = sdev->sId.i16uModulType;
+		hw_rev = sdev->sId.i16uHW_Revision;
+		res->module_type = module_type;
+
+		if (module_type & PICONTROL_NOT_CONNECTED) {
+			ret = -ENODEV;
+			goto done;
+		}
+
+		if (module_type >= PICONTROL_SW_OFFSET) {
+			ret = -EOPNOTSUPP;
+			goto done;
+		}
+
+		fw = picontrol_get_firmware_image(images, &num_images,
+						  module_type, hw_rev, &ret);
+		if (!fw)
+			goto done;
+
+		ret = firmware_check(sdev, fw, batch->flags, module_type, hw_rev);
+		if (!ret) {
+			upd = &updates[num_updates++];
+			upd->res = res;
+			upd->sdev = sdev;
+			upd->fw = fw;
+			upd->module_type = module_type;
+			upd->hw_rev = hw_rev;
+		}
+done:
+		res->result = ret;
+		res->duration = ktime_to_ms(ktime_sub(ktime_get(), mod_start));
+	}
+
+	if (num_updates && !isRunning()) {
+		for (n = 0; n < num_updates; n++)
+			updates[n].res->result = -EAGAIN;
+		num_updates = 0;
+	}
+
+	if (num_updates) {
+		PiBridgeMaster_Stop();
+		msleep(50);
+
+		for (n = 0; n < num_updates; n++) {
+			upd = &updates[n];
+			mod_start = ktime_get();
+
+			pr_info("Uploading firmware to module %u\n",
+				upd->sdev->i8uAddress);
+			ret = upload_firmware(upd->sdev, upd->fw, batch->flags,
+					      upd->module_type, upd->hw_rev);
+			if (ret < 0)
+				pr_err("Errors during firmware upload to module %u\n",
+				       upd->sdev->i8uAddress);
+
+			upd->res->result = ret;
+			upd->res->duration +=
+				ktime_to_ms(ktime_sub(ktime_get(), mod_start));
+		}
+
+		if (piControlReset(priv) < 0)
+			pr_err("Failed to reset piControl\n");
+	}
+	kfree(updates);
+
+	batch->images = 0;
+	for (i = 0; i < num_images; i++) {
+		if (images[i].fw) {
+			release_firmware(images[i].fw);
+			batch->images++;
+		}
+	}
+	kfree(images);
+
+	batch->duration = ktime_to_ms(ktime_sub(ktime_get(), start));
+
+	return 0;
+}
+
 static void picontrol_set_device_info(SDeviceInfo *out, SDevice *dev)
 {
 	out->i8uAddress = dev->i8uAddress;
@@ -1136,7 +2130,8 @@ static int send_internal_gate_telegram(struct modgate_telegram *req_tel,
 		rt_mutex_unlock(&piCore_g.lockGateTel);
 		if (ret) {
 			pr_err("Error sending internal IO message: %i\n", ret);
-			return -EIO;
+			/* the PiBridge is busy with a replay */
+			return ret == -EBUSY ? ret : -EIO;
 		}
 		return 0;
 	}
@@ -1269,7 +2264,7 @@ static int send_internal_io_telegram(void *req, unsigned int reqlen,
 	if (ret) {
 		rt_mutex_unlock(&piCore_g.lockUserTel);
 		pr_err("Error sending internal IO message: %i\n", ret);
-		return -EIO;
+		return ret == -EBUSY ? ret : -EIO;
 	}
 	if (resp)
 		memcpy(resp, &piCore_g.responseUserTel, sizeof(*resp));
@@ -1590,9 +2585,9 @@ static long piControlIoctl(struct file *file, unsigned int prg_nr, unsigned long
 			if (spi_val.i16uAddress >= KB_PI_LEN) {
 				status = -EINVAL;
 			} else {
-				rt_mutex_lock(&piDev_g.lockPI);
+				revpi_lock_pi(PICONTROL_LOCK_USER);
 				val = piDev_g.ai8uPI[spi_val.i16uAddress];
-				rt_mutex_unlock(&piDev_g.lockPI);
+				revpi_unlock_pi();
 
 				if (spi_val.i8uBit >= 8) {
 					spi_val.i8uValue = val;
@@ -1629,7 +2624,7 @@ static long piControlIoctl(struct file *file, unsigned int prg_nr, unsigned long
 				status = -EINVAL;
 			} else {
 				INT8U i8uValue_l;
-				my_rt_mutex_lock(&piDev_g.lockPI);
+				revpi_lock_pi(PICONTROL_LOCK_USER);
 				i8uValue_l = piDev_g.ai8uPI[spi_val.i16uAddress];
 
 				if (spi_val.i8uBit >= 8) {
@@ -1642,11 +2637,10 @@ static long piControlIoctl(struct file *file, unsigned int prg_nr, unsigned long
 				}
 
 				piDev_g.ai8uPI[spi_val.i16uAddress] = i8uValue_l;
-				rt_mutex_unlock(&piDev_g.lockPI);
+				revpi_unlock_pi();
 
-				if (priv->tTimeoutDurationMs > 0) {
-					priv->tTimeoutTS = ktime_add_ms(ktime_get(), priv->tTimeoutDurationMs);
-				}
+				piControl_outputs_written();
+				piControl_watchdog_refresh(priv);
 
 				status = 0;
 			}
@@ -1720,7 +2714,7 @@ static long piControlIoctl(struct file *file, unsigned int prg_nr, unsigned long
 			status = 0;
 			now = ktime_get();
 
-			my_rt_mutex_lock(&piDev_g.lockPI);
+			revpi_lock_pi(PICONTROL_LOCK_USER);
 			piDev_g.tLastOutput2 = piDev_g.tLastOutput1;
 			piDev_g.tLastOutput1 = now;
 
@@ -1752,11 +2746,10 @@ static long piControlIoctl(struct file *file, unsigned int prg_nr, unsigned long
 					piDev_g.ai8uPI[addr] = val2;
 				}
 			}
-			rt_mutex_unlock(&piDev_g.lockPI);
+			revpi_unlock_pi();
 
-			if (priv->tTimeoutDurationMs > 0) {
-				priv->tTimeoutTS = ktime_add_ms(ktime_get(), priv->tTimeoutDurationMs);
-			}
+			piControl_outputs_written();
+			piControl_watchdog_refresh(priv);
 		}
 		break;
 
@@ -1887,6 +2880,37 @@ static long piControlIoctl(struct file *file, unsigned int prg_nr, unsigned long
 		}
 		break;
 
+	case PICONTROL_SET_SAFE_STATE:
+		{
+			struct picontrol_safe_state *safe;
+
+			safe = memdup_user((const void __user *) usr_addr,
+					   sizeof(*safe));
+			if (IS_ERR(safe)) {
+				pr_err("failed to copy safe state from user\n");
+				return PTR_ERR(safe);
+			}
+
+			if (safe->length > PICONTROL_SAFE_STATE_LEN ||
+			    safe->offset + safe->length > KB_PI_LEN) {
+				kfree(safe);
+				return -EINVAL;
+			}
+
+			revpi_lock_pi(PICONTROL_LOCK_USER);
+			memcpy(piDev_g.ai8uPISafeForce + safe->offset,
+			       safe->force, safe->length);
+			memcpy(piDev_g.ai8uPISafeHold + safe->offset,
+			       safe->hold, safe->length);
+			memcpy(piDev_g.ai8uPISafeValue + safe->offset,
+			       safe->value, safe->length);
+			revpi_unlock_pi();
+
+			kfree(safe);
+			status = 0;
+		}
+		break;
+
 	case PICONTROL_UPLOAD_FIRMWARE:
 		{
 			struct picontrol_firmware_upload fwu;
@@ -1911,6 +2935,37 @@ static long piControlIoctl(struct file *file, unsigned int prg_nr, unsigned long
 		}
 		break;
 
+	case PICONTROL_UPLOAD_FIRMWARE_ALL:
+		{
+			struct picontrol_firmware_batch *batch;
+
+			if (!piDev_g.pibridge_supported)
+				return -EOPNOTSUPP;
+
+			batch = memdup_user((const void __user *) usr_addr,
+					    sizeof(*batch));
+			if (IS_ERR(batch)) {
+				pr_err("failed to copy firmware upload request from user\n");
+				return PTR_ERR(batch);
+			}
+
+			if (batch->flags & ~PICONTROL_FIRMWARE_FORCE_UPLOAD) {
+				kfree(batch);
+				return -EINVAL;
+			}
+
+			rt_mutex_lock(&piDev_g.lockIoctl);
+			status = picontrol_upload_firmware_all(batch, priv);
+			rt_mutex_unlock(&piDev_g.lockIoctl);
+
+			if (!status && copy_to_user((void __user *) usr_addr,
+						    batch, sizeof(*batch)))
+				status = -EFAULT;
+
+			kfree(batch);
+		}
+		break;
+
 	case KB_INTERN_IO_MSG:
 		my_rt_mutex_lock(&piDev_g.lockIoctl);
 		status = send_internal_io_msg(usr_addr);
@@ -1925,22 +2980,29 @@ static long piControlIoctl(struct file *file, unsigned int prg_nr, unsigned long
 
 	case KB_WAIT_FOR_EVENT:
 		{
-			tpiEventEntry *pEntry;
+			u32 event;
 
-			if (wait_event_interruptible(priv->wq, !list_empty(&priv->piEventList)) == 0) {
+			if (wait_event_interruptible(priv->wq, piControl_event_pending(priv)) == 0) {
 				my_rt_mutex_lock(&priv->lockEventList);
-				pEntry = list_first_entry(&priv->piEventList, tpiEventEntry, list);
-
-				list_del(&pEntry->list);
+				if (priv->event_head != priv->event_tail) {
+					event = priv->events[priv->event_tail & (PICONTROL_EVENT_RING_SIZE - 1)];
+					priv->event_tail++;
+				} else if (priv->event_reset) {
+					/* a reset which did not fit into the ring */
+					event = KB_EVENT_RESET;
+					priv->event_reset = false;
+				} else {
+					/* report dropped events after the queued ones */
+					event = KB_EVENT_OVERFLOW;
+					priv->event_overflow = false;
+				}
 				rt_mutex_unlock(&priv->lockEventList);
 
-				if (put_user(pEntry->event, (u32 __user *) usr_addr)) {
+				if (put_user(event, (u32 __user *) usr_addr)) {
 					status = -EFAULT;
 				} else {
 					status = 0;
 				}
-
-				kfree(pEntry);
 			}
 		}
 		break;
@@ -2033,7 +3095,10 @@ static long piControlIoctl(struct file *file, unsigned int prg_nr, unsigned long
 				return -EFAULT;
 			}
 
-			priv->tTimeoutTS = ktime_add_ms(ktime_get(), priv->tTimeoutDurationMs);
+			if (priv->tTimeoutDurationMs > 0)
+				piControl_watchdog_refresh(priv);
+			else
+				hrtimer_cancel(&priv->watchdog);
 			status = 0;
 		}
 		break;
@@ -9,6 +9,7 @@
 /******************************************************************************/
 #include <linux/cdev.h>
 #include <linux/leds.h>
+#include <linux/workqueue.h>
 
 #include "common_define.h"
 #include "piConfig.h"
@@ -16,10 +17,6 @@
 /******************************************************************************/
 /*********************************  Types  ************************************/
 /******************************************************************************/
-typedef enum piEvent {
-	piEvReset = 1,
-} enPiEvent;
-
 enum revpi_machine {
 	REVPI_CORE = 1,
 	REVPI_COMPACT = 2,
@@ -47,9 +44,52 @@ struct picontrol_cycle {
 	unsigned int last;
 	unsigned int max;
 	unsigned int min;
+	/*
+	 * Clock the cycle start is aligned to. CLOCK_MONOTONIC means no
+	 * alignment, the cycle starts whenever the previous one ended.
+	 */
+	clockid_t clock;
+	unsigned int phase; /* usecs */
+	unsigned int last_phase_error; /* nsecs */
+	unsigned int max_phase_error; /* nsecs */
+	/* Consecutive exceeded cycles which raise KB_EVENT_CYCLE_OVERRUN */
+	unsigned int overrun_threshold;
+	/* Time from timeout detection until the safe state was sent */
+	unsigned int last_safe_state_latency; /* usecs */
+	unsigned int max_safe_state_latency; /* usecs */
+	/* Process image locks of the io thread, see revpi_io_lock_pi() */
+	unsigned int locks;		/* current cycle, io thread only */
+	u64 lock_time;			/* nsecs, current cycle, io thread only */
+	ktime_t lock_start;		/* io thread only */
+	unsigned int last_locks;
+	unsigned int last_lock_time;	/* nsecs */
+	unsigned int max_lock_time;	/* nsecs */
+	/* Defer low priority exchanges if the cycle duration would be exceeded */
+	bool budget;
 	seqlock_t lock;
 };
 
+/* callers of revpi_lock_pi() which are accounted separately */
+enum picontrol_lock_user {
+	PICONTROL_LOCK_IO = 0,	/* io threads and workers of the driver */
+	PICONTROL_LOCK_USER,	/* read(), write() and ioctls */
+	PICONTROL_LOCK_USERS,
+};
+
+/*
+ * Bucket 0 counts waits below 1 usec, bucket n waits from 2^(n-1) up to
+ * 2^n usecs and the last bucket all longer waits.
+ */
+#define PICONTROL_LOCK_WAIT_BUCKETS	16
+
+struct picontrol_lock_stats {
+	u64 acquisitions;
+	u64 contended;
+	u64 wait[PICONTROL_LOCK_WAIT_BUCKETS];
+	unsigned int max_wait; /* nsecs */
+	unsigned int max_hold; /* nsecs */
+};
+
 typedef struct spiControlDev {
 	// device driver stuff
 	enum revpi_machine machine_type;
@@ -57,6 +97,11 @@ typedef struct spiControlDev {
 	struct cdev cdev;	// Char device structure
 	struct device *dev;
 	struct thermal_zone_device *thermal_zone;
+	/* sampled every REVPI_HOUSEKEEPING_INTERVAL outside of the io threads */
+#define REVPI_HOUSEKEEPING_INTERVAL	1000	/* msecs */
+	struct delayed_work housekeeping_work;
+	int cpu_temperature;		/* m°C */
+	unsigned int cpu_frequency;	/* kHz */
 
 	// supports extension modules with RS485 based communication (eg. DIO or AIO)
 	unsigned int pibridge_supported:1;
@@ -68,9 +113,20 @@ typedef struct spiControlDev {
 	// process image stuff
 	INT8U ai8uPI[KB_PI_LEN];
 	INT8U ai8uPIDefault[KB_PI_LEN];
+	// safe state of the outputs, see struct picontrol_safe_state
+	INT8U ai8uPISafeForce[KB_PI_LEN];
+	INT8U ai8uPISafeHold[KB_PI_LEN];
+	INT8U ai8uPISafeValue[KB_PI_LEN];
+	ktime_t tSafeStateDetected;	// 0 if no safe state is pending
 	struct rt_mutex lockPI;
+	/* statistics of lockPI if enabled, protected by lockPI itself */
+	struct picontrol_lock_stats lock_stats[PICONTROL_LOCK_USERS];
+	ktime_t lock_acquired;		// 0 if the holder is not accounted
+	enum picontrol_lock_user lock_user;
 #define PICONTROL_DEV_FLAG_STOP_IO		(1 << 0)
 #define PICONTROL_DEV_FLAG_RUNNING		(2 << 0)
+/* set by the watchdog timer of an instance, handled by the io cycle */
+#define PICONTROL_DEV_FLAG_WATCHDOG_EXPIRED	(3 << 0)
 	unsigned long flags;
 	piDevices *devs;
 	piEntries *ent;
@@ -84,6 +140,8 @@ typedef struct spiControlDev {
 	// handle open connections and notification
 	struct list_head listCon;
 	struct rt_mutex lockListCon;
+	/* Events dropped because of full event rings, protected by lockListCon */
+	u64 events_lost;
 
 	struct led_trigger power_red;
 	struct led_trigger a1_green;
@@ -110,18 +168,21 @@ typedef struct spiControlDev {
 	struct picontrol_cycle cycle;
 } tpiControlDev;
 
-typedef struct spiEventEntry {
-	enum piEvent event;
-	struct list_head list;
-} tpiEventEntry;
+/* must be a power of 2 */
+#define PICONTROL_EVENT_RING_SIZE	16
 
 typedef struct spiControlInst {
 	struct device *dev;
 	wait_queue_head_t wq;
-	struct list_head piEventList;	// head of the event list for this instance
+	/* preallocated ring of pending KB_EVENT_* values for this instance */
+	u32 events[PICONTROL_EVENT_RING_SIZE];
+	unsigned int event_head;	// free running index of the next event to post
+	unsigned int event_tail;	// free running index of the next event to fetch
+	bool event_overflow;		// events were dropped since the last fetch
+	bool event_reset;		// KB_EVENT_RESET did not fit into the ring
 	struct rt_mutex lockEventList;
 	struct list_head list;	// list of all instances
-	ktime_t tTimeoutTS;	// time stamp when the output must be set to 0
+	struct hrtimer watchdog;	// expires when the outputs must be set to 0
 	unsigned long tTimeoutDurationMs;	// length of the timeout in ms, 0 if not active
 	char pcErrorMessage[REV_PI_ERROR_MSG_LEN];	// error message of last ioctl call
 } tpiControlInst;
@@ -135,5 +196,8 @@ extern tpiControlDev piDev_g;
 bool isRunning(void);
 void printUserMsg(tpiControlInst *priv, const char *s, ...);
 unsigned int piControl_get_cycle_duration(void);
+void piControl_post_event(u32 event, tpiControlInst *skip);
+void piControl_queue_event(u32 event);
+u32 piControl_config_crc(void);
 
 #endif /* PRODUCTS_PIBASE_PIKERNELMOD_PICONTROLINTERN_H_ */
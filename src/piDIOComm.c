@@ -1,11 +1,10 @@
 // SPDX-License-Identifier: GPL-2.0-only
 // SPDX-FileCopyrightText: 2016-2023 KUNBUS GmbH
 
-#include <linux/pibridge_comm.h>
-
 #include "piDIOComm.h"
 #include "common_define.h"
 #include "revpi_core.h"
+#include "revpi_replay.h"
 
 #define DIO_OUTPUT_DATA_LEN		18
 #define DIO_MAX_COUNTERS		6
@@ -102,9 +101,9 @@ INT32U piDIOComm_Init(INT8U i8uDevice_p)
 		if (dioConfig_s[i].i8uAddr == addr) {
 			snd_buf = (u8 *) &dioConfig_s[i].i16uOutputPushPull;
 
-			ret = pibridge_req_io(piCore_g.pibridge, addr,
-					      IOP_TYP1_CMD_CFG, snd_buf,
-					      snd_len, NULL, 0);
+			ret = revpi_replay_req_io(addr,
+						  IOP_TYP1_CMD_CFG, snd_buf,
+						  snd_len, NULL, 0);
 			break;
 		}
 	}
@@ -137,10 +136,8 @@ INT32U piDIOComm_sendCyclicTelegram(u8 devnum)
 	addr = revpi_dev->i8uAddress;
 
 	if (!test_bit(PICONTROL_DEV_FLAG_STOP_IO, &piDev_g.flags)) {
-		rt_mutex_lock(&piDev_g.lockPI);
-		memcpy(out_buf, piDev_g.ai8uPI + revpi_dev->i16uOutputOffset,
+		memcpy(out_buf, piCore_g.cycle_image + revpi_dev->i16uOutputOffset,
 		       DIO_OUTPUT_DATA_LEN);
-		rt_mutex_unlock(&piDev_g.lockPI);
 	} else {
 		memset(out_buf, 0, sizeof(out_buf));
 	}
@@ -173,8 +170,8 @@ INT32U piDIOComm_sendCyclicTelegram(u8 devnum)
 
 	rcv_len = 3 * sizeof(u16) + i8uNumCounter[addr] * sizeof(u32);
 
-	ret = pibridge_req_io(piCore_g.pibridge, addr, cmd, snd_buf, snd_len,
-			      in_buf, rcv_len);
+	ret = revpi_replay_req_io(addr, cmd, snd_buf, snd_len,
+				  in_buf, rcv_len);
 	if (ret != rcv_len) {
 		pr_debug("DIO addr %2d: communication failed (req:%u,ret:%d)\n",
 			addr, rcv_len, ret);
@@ -198,10 +195,9 @@ INT32U piDIOComm_sendCyclicTelegram(u8 devnum)
 		}
 	}
 
-	rt_mutex_lock(&piDev_g.lockPI);
-	memcpy(piDev_g.ai8uPI + revpi_dev->i16uInputOffset, data_in,
+	memcpy(piCore_g.cycle_image + revpi_dev->i16uInputOffset, data_in,
 	       sizeof(data_in));
-	rt_mutex_unlock(&piDev_g.lockPI);
+	revpi_core_inputs_updated(devnum);
 
 	return 0;
 }
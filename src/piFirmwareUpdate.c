@@ -1,7 +1,12 @@
 // SPDX-License-Identifier: GPL-2.0-only
 // SPDX-FileCopyrightText: 2017-2024 KUNBUS GmbH
 
+#include <linux/crc32.h>
 #include <linux/firmware.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
 #include "fwuFlashFileMain.h"
 #include "piFirmwareUpdate.h"
 #include "RS485FwuCommand.h"
@@ -10,6 +15,134 @@
 #define TFPGA_HEAD_DATA_OFFSET			6
 #define	CHUNK_TRANSMISSION_ATTEMPTS		100
 #define	FLASH_ERASE_ATTEMPTS			5
+/* max time for a module to answer after entering the update mode (msecs) */
+#define FWU_READY_TIMEOUT			1000
+/* chunks which are written and verified together */
+#define FWU_REGION_CHUNKS			16
+/* transfers of a region, resumed at the failed chunk */
+#define FWU_REGION_ATTEMPTS			3
+/* uploads started over after a failed verification */
+#define FWU_RESTART_ATTEMPTS			1
+/* reads of a chunk during the verification */
+#define FWU_READ_ATTEMPTS			3
+
+/* statistics of the last firmware update per module address */
+struct fwu_stats {
+	bool valid;
+	int result;
+	unsigned int duration;		/* msecs */
+	unsigned int ready_time;	/* msecs */
+	unsigned int erase_retries;
+	unsigned int write_retries;
+	unsigned int rate;		/* bytes per sec written to flash */
+	unsigned int max_chunk_time;	/* usecs */
+	unsigned int resumed;		/* transfers resumed after an error */
+	unsigned int verify_time;	/* usecs spent reading back */
+	unsigned int wasted_time;	/* usecs spent in failed writes */
+	unsigned int restarts;		/* uploads started over */
+};
+
+static DEFINE_MUTEX(fwu_stats_lock);
+static struct fwu_stats fwu_stats[REV_PI_DEV_CNT_MAX];
+/* update in progress, updates are serialized by the ioctl lock */
+static struct fwu_stats fwu_current;
+static ktime_t fwu_start;
+/* bytes of the update in progress which were sent to the module */
+static unsigned int fwu_written;
+/* requests sent to the module in update mode, see fwu_progress() */
+static unsigned int fwu_requests;
+
+static void fwu_stats_begin(void)
+{
+	memset(&fwu_current, 0, sizeof(fwu_current));
+	fwu_start = ktime_get();
+	fwu_written = 0;
+}
+
+static void fwu_stats_end(unsigned int addr, int result)
+{
+	fwu_current.valid = true;
+	fwu_current.result = result;
+	fwu_current.duration = ktime_to_ms(ktime_sub(ktime_get(), fwu_start));
+
+	pr_info("Firmware update of module %u: %d after %u msecs (ready after %u msecs, %u erase and %u write retries, %u bytes/sec, max %u usecs per chunk)\n",
+		addr, result, fwu_current.duration, fwu_current.ready_time,
+		fwu_current.erase_retries, fwu_current.write_retries,
+		fwu_current.rate, fwu_current.max_chunk_time);
+	pr_info("Firmware update of module %u: %u transfers resumed, %u usecs verifying, %u usecs wasted, %u restarts\n",
+		addr, fwu_current.resumed, fwu_current.verify_time,
+		fwu_current.wasted_time, fwu_current.restarts);
+
+	if (addr >= ARRAY_SIZE(fwu_stats))
+		return;
+
+	mutex_lock(&fwu_stats_lock);
+	fwu_stats[addr] = fwu_current;
+	mutex_unlock(&fwu_stats_lock);
+}
+
+/**
+ * fwu_wait_ready() - wait for a module in firmware update mode
+ * @dev_addr: address of the module in update mode
+ */
+int fwu_wait_ready(unsigned int dev_addr)
+{
+	int ret;
+
+	ret = fwuWaitReady(dev_addr, FWU_READY_TIMEOUT);
+	if (ret < 0)
+		return ret;
+
+	fwu_current.ready_time = ret;
+	return 0;
+}
+
+/**
+ * fwu_progress() - count the requests sent to a module in update mode
+ *
+ * Each request is answered or times out within seconds, while a whole
+ * update step may take much longer. A changing count tells a long step
+ * from a hung one.
+ */
+unsigned int fwu_progress(void)
+{
+	return READ_ONCE(fwu_requests);
+}
+
+/**
+ * fwu_show_stats() - print the statistics of the last firmware updates
+ * @buf: sysfs buffer of PAGE_SIZE
+ *
+ * One line per updated module consisting of address, result, duration and
+ * time until the module answered in update mode in msecs, the number of
+ * erase and write retries, the write rate in bytes per sec, the max time
+ * per chunk in usecs, the number of resumed transfers, the time spent verifying and in failed writes in usecs and the
+ * number of uploads started over.
+ */
+ssize_t fwu_show_stats(char *buf)
+{
+	struct fwu_stats *stats;
+	ssize_t len = 0;
+	unsigned int i;
+
+	mutex_lock(&fwu_stats_lock);
+	for (i = 0; i < ARRAY_SIZE(fwu_stats); i++) {
+		stats = &fwu_stats[i];
+		if (!stats->valid)
+			continue;
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%u %d %u %u %u %u %u %u %u %u %u %u\n", i,
+				 stats->result, stats->duration,
+				 stats->ready_time, stats->erase_retries,
+				 stats->write_retries, stats->rate,
+				 stats->max_chunk_time,
+				 stats->resumed, stats->verify_time,
+				 stats->wasted_time, stats->restarts);
+	}
+	mutex_unlock(&fwu_stats_lock);
+
+	return len;
+}
 
 // ret < 0: error
 // ret == 0: no update needed
@@ -115,24 +248,32 @@ int FWU_update(tpiControlInst *priv, SDevice *pDev_p)
 		pDev_p->sId.i16uSW_Major, pDev_p->sId.i16uSW_Minor,
 		pApplDesc->i8uSwMajor, pApplDesc->i16uSwMinor);
 
-	if (PiBridgeMaster_FWUModeEnter(pDev_p->i8uAddress, pDev_p->i8uScan) == 0) {
-		msleep(500);
+	fwu_stats_begin();
 
-		ret = PiBridgeMaster_FWUflashErase();
-		if (ret) {
-			goto laError;
-		}
+	/* the bridge master waits until the module answers in update mode */
+	if (PiBridgeMaster_FWUModeEnter(pDev_p->i8uAddress, pDev_p->i8uScan)) {
+		ret = -EIO;
+		fwu_stats_end(pDev_p->i8uAddress, ret);
+		goto laError;
+	}
 
-		ret = PiBridgeMaster_FWUflashWrite(header.dat.ulFlashStart, data, length);
-		if (ret) {
-			goto laError;
-		}
+	ret = PiBridgeMaster_FWUflashErase();
+	if (ret) {
+		fwu_stats_end(pDev_p->i8uAddress, ret);
+		goto laError;
+	}
 
-		PiBridgeMaster_FWUReset();
-		printUserMsg(priv,"update firmware success");
-		ret = 1;	// success
+	ret = PiBridgeMaster_FWUflashWrite(header.dat.ulFlashStart, data, length);
+	if (ret) {
+		fwu_stats_end(pDev_p->i8uAddress, ret);
+		goto laError;
 	}
 
+	PiBridgeMaster_FWUReset();
+	printUserMsg(priv,"update firmware success");
+	ret = 1;	// success
+	fwu_stats_end(pDev_p->i8uAddress, 0);
+
 laError:
 	if (data)
 		kfree(data);
@@ -161,17 +302,22 @@ static int flash_chunk(unsigned int dev_addr, unsigned int chunk_addr,
 
 {
 	unsigned int attempts = CHUNK_TRANSMISSION_ATTEMPTS;
+	ktime_t start;
 	int ret;
 
 	do {
+		start = ktime_get();
+		WRITE_ONCE(fwu_requests, fwu_requests + 1);
 		ret = fwuWrite(dev_addr, chunk_addr, chunk_data, chunk_len);
 		if (ret) {
 			/*
 			 * A failure may result from a protocol communication
 			 * error. Retry to submit the chunk a if attempts are
-			 * left.
+			 * left. fwuWrite() already waited for the response,
+			 * so the retry is sent immediately.
 			 */
-			usleep_range(1000, 2000);
+			fwu_current.wasted_time += ktime_us_delta(ktime_get(),
+								  start);
 			attempts--;
 			pr_debug("Error transmitting firmware for flash addr 0x%08x, len %u: %i (left attempts: %u)\n",
 				chunk_addr, chunk_len, ret, attempts);
@@ -183,35 +329,223 @@ static int flash_chunk(unsigned int dev_addr, unsigned int chunk_addr,
 	return ret;
 }
 
-int flash_firmware(unsigned int dev_addr, unsigned int flash_addr,
-		   unsigned char *upload_data, unsigned int upload_len)
+/*
+ * Write the chunks of a region starting at *offset. On error *offset is
+ * the offset of the failed chunk, so the transfer can be resumed there.
+ */
+static int flash_region(unsigned int dev_addr, unsigned int flash_addr,
+			unsigned char *data, unsigned int len,
+			unsigned int *offset)
 {
-	unsigned int upload_offset = 0;
-	unsigned int total_retrans = 0;
+	unsigned int chunk_time;
 	unsigned int chunk_len;
 	unsigned int retrans;
+	ktime_t start;
 	int ret = 0;
 
-	while (upload_len) {
-		if (upload_len > MAX_FWU_DATA_SIZE)
-			chunk_len = MAX_FWU_DATA_SIZE;
-		else
-			chunk_len = upload_len;
+	while (*offset < len) {
+		chunk_len = min_t(unsigned int, len - *offset,
+				  MAX_FWU_DATA_SIZE);
+
+		start = ktime_get();
+		ret = flash_chunk(dev_addr, flash_addr + *offset,
+				  data + *offset, chunk_len, &retrans);
+		if (ret) {
+			/* the last failed attempt was not retried */
+			fwu_current.write_retries += retrans - 1;
+			break;
+		}
+		fwu_current.write_retries += retrans;
+		fwu_written += chunk_len;
+
+		chunk_time = ktime_us_delta(ktime_get(), start);
+		if (fwu_current.max_chunk_time < chunk_time)
+			fwu_current.max_chunk_time = chunk_time;
+
+		*offset += chunk_len;
+	}
+
+	return ret;
+}
+
+/*
+ * Check once before the upload whether the module can read back its flash.
+ * Older bootloaders answer ReadFwFlash with an error code only or not at
+ * all, both mean that the upload cannot be verified.
+ */
+static bool can_read_back(unsigned int dev_addr, unsigned int flash_addr)
+{
+	unsigned char buf[4];
+	int ret;
+
+	ret = fwuRead(dev_addr, flash_addr, buf, sizeof(buf));
+	if (ret) {
+		pr_warn("Module cannot read back its flash (%d), not verifying\n",
+			ret);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Read a chunk of the flash. A failed read is a communication error like a
+ * failed write, so it is retried.
+ */
+static int read_chunk(unsigned int dev_addr, unsigned int chunk_addr,
+		      unsigned char *buf, unsigned int chunk_len)
+{
+	unsigned int attempts = FWU_READ_ATTEMPTS;
+	int ret;
+
+	do {
+		WRITE_ONCE(fwu_requests, fwu_requests + 1);
+		ret = fwuRead(dev_addr, chunk_addr, buf, chunk_len);
+		if (ret) {
+			attempts--;
+			pr_debug("Error reading flash addr 0x%08x, len %u: %i (left attempts: %u)\n",
+				chunk_addr, chunk_len, ret, attempts);
+		}
+	} while (ret && attempts);
+
+	return ret;
+}
+
+/* Read back a region and compare its checksum with the one of the source */
+static int verify_region(unsigned int dev_addr, unsigned int flash_addr,
+			 unsigned char *data, unsigned int len)
+{
+	unsigned char buf[MAX_FWU_DATA_SIZE];
+	unsigned int chunk_len;
+	unsigned int offset = 0;
+	u32 crc = 0;
+	int ret;
+
+	while (offset < len) {
+		chunk_len = min_t(unsigned int, len - offset, sizeof(buf));
+
+		ret = read_chunk(dev_addr, flash_addr + offset, buf, chunk_len);
+		if (ret) {
+			pr_err("Reading back flash addr 0x%08x failed: %d\n",
+			       flash_addr + offset, ret);
+			return ret;
+		}
+
+		crc = crc32(crc, buf, chunk_len);
+		offset += chunk_len;
+	}
+
+	if (crc != crc32(0, data, len)) {
+		pr_warn("Verification of flash region 0x%08x, len %u failed\n",
+			flash_addr, len);
+		return -EBADMSG;
+	}
+
+	return 0;
+}
+
+/*
+ * The image is written in regions of FWU_REGION_CHUNKS chunks. Each region
+ * is read back and verified if the module supports reading its flash.
+ *
+ * A chunk which still fails after its retransmissions was not programmed,
+ * so the transfer is resumed at that chunk. A region which fails the
+ * verification cannot be fixed by programming it again, since programming
+ * only clears bits. The module can only erase its whole flash, so in that
+ * case the flash is erased and the upload starts over.
+ */
+int flash_firmware(unsigned int dev_addr, unsigned int flash_addr,
+		   unsigned char *upload_data, unsigned int upload_len)
+{
+	unsigned int restarts = FWU_RESTART_ATTEMPTS;
+	unsigned int pass_wasted = fwu_current.wasted_time;
+	unsigned int region_offset;
+	unsigned int region_len;
+	unsigned int offset = 0;
+	unsigned int attempts;
+	ktime_t start, pass_start, verify_start;
+	bool verify;
+	s64 duration;
+	int ret = 0;
+
+	start = ktime_get();
+	pass_start = start;
+
+	verify_start = start;
+	verify = can_read_back(dev_addr, flash_addr);
+	fwu_current.verify_time += ktime_us_delta(ktime_get(), verify_start);
+
+	/*
+	 * The gateway protocol allows only one outstanding request and
+	 * MAX_FWU_DATA_SIZE is already the largest payload of a telegram. So
+	 * the transfer is bound by the turnaround per chunk, which is
+	 * measured here.
+	 */
+	while (offset < upload_len) {
+		region_len = min_t(unsigned int, upload_len - offset,
+				   FWU_REGION_CHUNKS * MAX_FWU_DATA_SIZE);
+		region_offset = 0;
+		attempts = FWU_REGION_ATTEMPTS;
+
+		do {
+			ret = flash_region(dev_addr, flash_addr + offset,
+					   upload_data + offset, region_len,
+					   &region_offset);
+			if (ret) {
+				attempts--;
+				if (attempts) {
+					fwu_current.resumed++;
+					pr_warn("Resuming flash write at 0x%08x (left attempts: %u)\n",
+						flash_addr + offset + region_offset,
+						attempts);
+				}
+			}
+		} while (ret && attempts);
 
-		ret = flash_chunk(dev_addr, flash_addr + upload_offset,
-				  upload_data + upload_offset, chunk_len,
-				  &retrans);
-		total_retrans += retrans;
 		if (ret)
 			break;
 
-		upload_offset += chunk_len;
-		upload_len -= chunk_len;
+		if (verify) {
+			verify_start = ktime_get();
+			ret = verify_region(dev_addr, flash_addr + offset,
+					    upload_data + offset, region_len);
+			fwu_current.verify_time +=
+				ktime_us_delta(ktime_get(), verify_start);
+
+			if (ret == -EBADMSG && restarts) {
+				restarts--;
+				fwu_current.restarts++;
+				/* everything written so far has to be written again */
+				fwu_current.wasted_time = pass_wasted +
+					ktime_us_delta(ktime_get(), pass_start);
+				pr_warn("Erasing flash and writing firmware again\n");
+
+				ret = erase_flash(dev_addr);
+				if (ret)
+					break;
+
+				pass_start = ktime_get();
+				pass_wasted = fwu_current.wasted_time;
+				offset = 0;
+				continue;
+			}
+
+			if (ret)
+				break;
+		}
+
+		offset += region_len;
 	}
 
-	if (total_retrans)
+	/* the rate of all chunks sent to the module, rewritten ones included */
+	duration = ktime_us_delta(ktime_get(), start);
+	if (!ret && duration > 0)
+		fwu_current.rate = div64_s64((s64) fwu_written * USEC_PER_SEC,
+					     duration);
+
+	if (fwu_current.write_retries)
 		pr_warn("%u retransmissions during firmware update required\n",
-			total_retrans);
+			fwu_current.write_retries);
 
 	return ret;
 }
@@ -222,19 +556,25 @@ int erase_flash(unsigned int dev_addr)
 	int ret;
 
 	do {
+		WRITE_ONCE(fwu_requests, fwu_requests + 1);
 		ret = fwuEraseFlash(dev_addr);
 		if (ret) {
 			/*
 			 * A failure may result from a protocol communication
-			 * error. Retry to erase flash if attempts are left.
+			 * error. Retry to erase flash immediately if attempts
+			 * are left.
 			 */
-			usleep_range(1000, 2000);
 			attempts--;
 			pr_debug("Error erasing flash: %i (left attempts: %u)\n",
 				ret, attempts);
 		}
 	} while (ret && attempts);
 
+	/* every failed attempt but the last one was retried */
+	fwu_current.erase_retries += FLASH_ERASE_ATTEMPTS - attempts;
+	if (ret)
+		fwu_current.erase_retries--;
+
 	/* failure */
 	if (ret)
 		return ret;
@@ -245,17 +585,19 @@ int erase_flash(unsigned int dev_addr)
 	return 0;
 }
 
-int upload_firmware(SDevice *sdev, const struct firmware *fw, u32 mask,
-		    unsigned int module_type, unsigned int hw_rev)
+/*
+ * Check if the firmware matches the module and is newer than the firmware
+ * of the module. Returns 0 if the module should be updated, 1 if it is
+ * already up to date and < 0 if the firmware does not fit the module.
+ */
+int firmware_check(SDevice *sdev, const struct firmware *fw, u32 mask,
+		   unsigned int module_type, unsigned int hw_rev)
 {
 	T_KUNBUS_APPL_DESCR *desc;
 	unsigned int flash_offset;
-	unsigned int upload_len;
-	unsigned int dev_addr;
 	bool force_upload;
 	TFileHead *hdr;
 	bool update;
-	int ret = 0;
 
 	force_upload  = !!(mask & PICONTROL_FIRMWARE_FORCE_UPLOAD);
 
@@ -302,11 +644,35 @@ int upload_firmware(SDevice *sdev, const struct firmware *fw, u32 mask,
 		return 1;
 	}
 
+	return 0;
+}
+
+int upload_firmware(SDevice *sdev, const struct firmware *fw, u32 mask,
+		    unsigned int module_type, unsigned int hw_rev)
+{
+	T_KUNBUS_APPL_DESCR *desc;
+	unsigned int flash_offset;
+	unsigned int upload_len;
+	unsigned int dev_addr;
+	TFileHead *hdr;
+	int ret;
+
+	ret = firmware_check(sdev, fw, mask, module_type, hw_rev);
+	if (ret)
+		return ret;
+
+	hdr = (TFileHead *) &fw->data[0];
+	flash_offset = hdr->ulLength + TFPGA_HEAD_DATA_OFFSET;
+	desc = (T_KUNBUS_APPL_DESCR *) &fw->data[flash_offset];
+
 	upload_len = fw->size - flash_offset;
 	dev_addr = sdev->i8uAddress;
 
+	fwu_stats_begin();
+
 	if (fwuEnterFwuMode(dev_addr) < 0) {
 		pr_err("error entering firmware update mode\n");
+		fwu_stats_end(sdev->i8uAddress, -EIO);
 		return -EIO;
 	}
 
@@ -322,7 +688,10 @@ int upload_firmware(SDevice *sdev, const struct firmware *fw, u32 mask,
 			dev_addr = 1;
 	}
 
-	msleep(500);
+	if (fwu_wait_ready(dev_addr)) {
+		ret = -EIO;
+		goto reset;
+	}
 
 	if (erase_flash(dev_addr)) {
 		pr_err("failed to erase flash\n");
@@ -343,5 +712,7 @@ reset:
 		ret = -EIO;
 	}
 
+	fwu_stats_end(sdev->i8uAddress, ret);
+
 	return ret;
 }
@@ -16,6 +16,11 @@ int FWU_update(tpiControlInst *priv, SDevice *pDev_p);
 int flash_firmware(unsigned int dev_addr, unsigned int flash_addr,
 		   unsigned char *upload_data, unsigned int upload_len);
 int erase_flash(unsigned int dev_addr);
+int fwu_wait_ready(unsigned int dev_addr);
+unsigned int fwu_progress(void);
+ssize_t fwu_show_stats(char *buf);
+int firmware_check(SDevice *sdev, const struct firmware *fw, u32 mask,
+		   unsigned int module_type, unsigned int hw_rev);
 int upload_firmware(SDevice *sdev, const struct firmware *fw, u32 mask,
 		    unsigned int module_type, unsigned int hw_rev);
 
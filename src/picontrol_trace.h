@@ -85,6 +85,75 @@ TRACE_EVENT(picontrol_cycle_exceeded,
 	)
 );
 
+/*
+ * picontrol_cycle_phase_error
+ *
+ * Info: The deviation of the cycle start from the aligned start time.
+ * cycle: The current cycle.
+ * error: The phase error in nsecs.
+ * Time: At the beginning of a cycle which is aligned to the cycle clock.
+ */
+TRACE_EVENT(picontrol_cycle_phase_error,
+	TP_PROTO(u64 cycle, unsigned int error),
+	TP_ARGS(cycle, error),
+	TP_STRUCT__entry(
+		__field(u64, cycle)
+		__field(unsigned int, error)
+	),
+	TP_fast_assign(
+		__entry->cycle = cycle;
+		__entry->error = error;
+	),
+	TP_printk(
+		"cycle=%llu, phase error=%u nsecs",
+		__entry->cycle,
+		__entry->error
+	)
+);
+
+/*
+ * picontrol_compact_cycle
+ *
+ * Info: The time spent in the stages of a RevPi Compact io cycle.
+ * cycle: The current cycle.
+ * din: Reading the digital inputs and their status in nsecs.
+ * image: Exchanging the process image in nsecs.
+ * dout: Reading the fault pin and writing the digital outputs in nsecs.
+ * aout: Writing the analog outputs in nsecs.
+ * transfers: The number of bus transfers of the cycle.
+ * Time: At the end of every io cycle of the RevPi Compact.
+ */
+TRACE_EVENT(picontrol_compact_cycle,
+	TP_PROTO(u64 cycle, unsigned int din, unsigned int image,
+		 unsigned int dout, unsigned int aout, unsigned int transfers),
+	TP_ARGS(cycle, din, image, dout, aout, transfers),
+	TP_STRUCT__entry(
+		__field(u64, cycle)
+		__field(unsigned int, din)
+		__field(unsigned int, image)
+		__field(unsigned int, dout)
+		__field(unsigned int, aout)
+		__field(unsigned int, transfers)
+	),
+	TP_fast_assign(
+		__entry->cycle = cycle;
+		__entry->din = din;
+		__entry->image = image;
+		__entry->dout = dout;
+		__entry->aout = aout;
+		__entry->transfers = transfers;
+	),
+	TP_printk(
+		"cycle=%llu, din=%u, image=%u, dout=%u, aout=%u nsecs, transfers=%u",
+		__entry->cycle,
+		__entry->din,
+		__entry->image,
+		__entry->dout,
+		__entry->aout,
+		__entry->transfers
+	)
+);
+
 /*
  * picontrol_cyclic_device_data_class
  *
@@ -129,6 +198,17 @@ DEFINE_EVENT(picontrol_cyclic_device_data_class, picontrol_cyclic_device_data_st
 	TP_ARGS(addr)
 );
 
+/*
+ * picontrol_cyclic_device_data_deferred
+ *
+ * Info: The device exchange is deferred to the next cycle.
+ * Time: Instead of the data exchange if the cycle budget is exhausted.
+ */
+DEFINE_EVENT(picontrol_cyclic_device_data_class, picontrol_cyclic_device_data_deferred,
+	TP_PROTO(unsigned int addr),
+	TP_ARGS(addr)
+);
+
 DECLARE_EVENT_CLASS(picontrol_sniffpin_value_class,
 	TP_PROTO(unsigned int value),
 	TP_ARGS(value),
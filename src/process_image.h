@@ -52,6 +52,15 @@ static inline void cycletimer_sleep(struct cycletimer *ct,
 	wait_for_completion(&ct->timer_expired);
 }
 
+/* Sleep until an absolute point in time instead of the next cycle */
+static inline void cycletimer_sleep_until(struct cycletimer *ct,
+					  ktime_t expires)
+{
+	reinit_completion(&ct->timer_expired);
+	hrtimer_start(&ct->timer, expires, HRTIMER_MODE_ABS_HARD);
+	wait_for_completion(&ct->timer_expired);
+}
+
 static inline void cycletimer_change(struct cycletimer *ct, u32 cycletime)
 {
 	struct hrtimer *timer = &ct->timer;
@@ -100,10 +109,10 @@ static __always_inline int test_bit_in_byte(u8 nr, u8 * addr)
 	if (!test_bit(PICONTROL_DEV_FLAG_STOP_IO, &piDev_g.flags)) {			\
 		if (((typeof(shadow))(piDev_g.ai8uPI + (offset))) == 0 || (shadow) == 0) \
 			pr_err("NULL pointer: %p %p\n", ((typeof(shadow))(piDev_g.ai8uPI + (offset))), (shadow)); \
-		my_rt_mutex_lock(&piDev_g.lockPI);					\
+		revpi_io_lock_pi();							\
 		((typeof(shadow))(piDev_g.ai8uPI + (offset)))->drv = (shadow)->drv;	\
 		(shadow)->usr = ((typeof(shadow))(piDev_g.ai8uPI + (offset)))->usr;	\
-		rt_mutex_unlock(&piDev_g.lockPI);					\
+		revpi_io_unlock_pi();							\
 	}										\
 }
 #endif /* _PROCESS_IMAGE_H */
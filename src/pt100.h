@@ -1,6 +1,11 @@
 /* SPDX-License-Identifier: GPL-2.0-only
- * SPDX-FileCopyrightText: 2017 KUNBUS GmbH
+ * SPDX-FileCopyrightText: 2017-2024 KUNBUS GmbH
  */
 
-int GetPt100Temperature(unsigned int i16uResistance_p,
-			signed int *pi16sTemperature_p);
+/*
+ * Convert the resistance of a PT100 in mOhm to a temperature in 0.1 °C.
+ * Resistances outside of -200 … 850 °C are clamped to these limits and
+ * return -1 respectively 1, otherwise 0 is returned. The resistance of a
+ * PT1000 must be divided by 10.
+ */
+int GetPt100Temperature(unsigned int resistance, signed int *temperature);
@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+
+// Oversampling and filtering of analog inputs
+//
+// The filters work on the raw value of the ADC before it is converted and
+// published to the process image. The window of the average and median
+// filter and the time constant of the low-pass filter are limited, so the
+// time spent per sample is bounded. It is measured nevertheless and can be
+// read from sysfs together with the configuration.
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+
+#include "revpi_ain_filter.h"
+
+static const char * const revpi_ain_filter_names[] = {
+	[REVPI_AIN_FILTER_NONE]		= "none",
+	[REVPI_AIN_FILTER_AVERAGE]	= "average",
+	[REVPI_AIN_FILTER_LOWPASS]	= "lowpass",
+	[REVPI_AIN_FILTER_MEDIAN]	= "median",
+};
+
+void revpi_ain_filter_init(struct revpi_ain_filter *filter,
+			   const struct revpi_ain_filter_config *config)
+{
+	memset(filter, 0, sizeof(*filter));
+	filter->config = *config;
+}
+
+static int revpi_ain_filter_average(struct revpi_ain_filter *filter, int value)
+{
+	unsigned int len = filter->config.len;
+
+	if (filter->count == len)
+		filter->sum -= filter->window[filter->pos];
+	else
+		filter->count++;
+
+	filter->window[filter->pos] = value;
+	filter->sum += value;
+	filter->pos = (filter->pos + 1) % len;
+
+	return (int)div_s64(filter->sum, filter->count);
+}
+
+static int revpi_ain_filter_lowpass(struct revpi_ain_filter *filter, int value)
+{
+	unsigned int shift = filter->config.len;
+
+	if (!filter->count) {
+		/* start at the first sample instead of settling from 0 */
+		filter->state = (s64)value << shift;
+		filter->count = 1;
+	} else {
+		filter->state += value - (filter->state >> shift);
+	}
+
+	return (int)(filter->state >> shift);
+}
+
+static int revpi_ain_filter_median(struct revpi_ain_filter *filter, int value)
+{
+	int sorted[REVPI_AIN_FILTER_MAX_LEN];
+	unsigned int i, j;
+
+	filter->window[filter->pos] = value;
+	filter->pos = (filter->pos + 1) % filter->config.len;
+	if (filter->count < filter->config.len)
+		filter->count++;
+
+	/* insertion sort, the window is small */
+	for (i = 0; i < filter->count; i++) {
+		int tmp = filter->window[i];
+
+		for (j = i; j > 0 && sorted[j - 1] > tmp; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = tmp;
+	}
+
+	if (filter->count & 1)
+		return sorted[filter->count / 2];
+
+	return (int)(((s64)sorted[filter->count / 2 - 1] +
+		      sorted[filter->count / 2]) / 2);
+}
+
+/*
+ * Feed a new sample into the filter and return the filtered value.
+ * Must only be called by the thread which owns the filter.
+ */
+int revpi_ain_filter_apply(struct revpi_ain_filter *filter, int value)
+{
+	ktime_t start = ktime_get();
+	unsigned int cost;
+
+	switch (filter->config.type) {
+	case REVPI_AIN_FILTER_AVERAGE:
+		value = revpi_ain_filter_average(filter, value);
+		break;
+	case REVPI_AIN_FILTER_LOWPASS:
+		value = revpi_ain_filter_lowpass(filter, value);
+		break;
+	case REVPI_AIN_FILTER_MEDIAN:
+		value = revpi_ain_filter_median(filter, value);
+		break;
+	default:
+		return value;
+	}
+
+	cost = ktime_to_ns(ktime_sub(ktime_get(), start));
+	WRITE_ONCE(filter->last_cost, cost);
+	if (cost > filter->max_cost)
+		WRITE_ONCE(filter->max_cost, cost);
+
+	return value;
+}
+
+/*
+ * Parse "<chan> <oversampling> <type> <len>" as written to sysfs. The channel
+ * is not checked against the number of channels of the device.
+ */
+int revpi_ain_filter_parse(const char *buf, unsigned int *chan,
+			   struct revpi_ain_filter_config *config)
+{
+	unsigned int oversampling, len;
+	char name[16];
+	int type;
+
+	if (sscanf(buf, "%u %u %15s %u", chan, &oversampling, name, &len) != 4)
+		return -EINVAL;
+
+	type = sysfs_match_string(revpi_ain_filter_names, name);
+	if (type < 0)
+		return type;
+
+	if (!oversampling || oversampling > REVPI_AIN_MAX_OVERSAMPLING)
+		return -EINVAL;
+
+	switch (type) {
+	case REVPI_AIN_FILTER_NONE:
+		len = 0;
+		break;
+	case REVPI_AIN_FILTER_LOWPASS:
+		if (!len || len > REVPI_AIN_FILTER_MAX_SHIFT)
+			return -EINVAL;
+		break;
+	default:
+		if (!len || len > REVPI_AIN_FILTER_MAX_LEN)
+			return -EINVAL;
+		break;
+	}
+
+	config->type = type;
+	config->len = len;
+	config->oversampling = oversampling;
+
+	return 0;
+}
+
+/*
+ * Append "<chan> <oversampling> <type> <len> <last cost> <max cost>" to a
+ * sysfs buffer. The cost is taken from the running filter.
+ */
+int revpi_ain_filter_show(char *buf, int len, unsigned int chan,
+			  const struct revpi_ain_filter_config *config,
+			  const struct revpi_ain_filter *filter)
+{
+	return sysfs_emit_at(buf, len, "%u %u %s %u %u %u\n", chan,
+			     config->oversampling,
+			     revpi_ain_filter_names[config->type], config->len,
+			     READ_ONCE(filter->last_cost),
+			     READ_ONCE(filter->max_cost));
+}
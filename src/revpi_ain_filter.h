@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: GPL-2.0-only
+ * SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+ *
+ * Oversampling and filtering of analog inputs
+ */
+
+#ifndef _REVPI_AIN_FILTER_H
+#define _REVPI_AIN_FILTER_H
+
+#include <linux/types.h>
+
+/* max conversions which are averaged into one sample */
+#define REVPI_AIN_MAX_OVERSAMPLING		16
+/* max window of the average and median filter */
+#define REVPI_AIN_FILTER_MAX_LEN		15
+/* max time constant of the low-pass filter as power of 2 samples */
+#define REVPI_AIN_FILTER_MAX_SHIFT		8
+
+enum revpi_ain_filter_type {
+	REVPI_AIN_FILTER_NONE = 0,
+	REVPI_AIN_FILTER_AVERAGE,	/* moving average of len samples */
+	REVPI_AIN_FILTER_LOWPASS,	/* first order, time constant 2^len */
+	REVPI_AIN_FILTER_MEDIAN,	/* median of len samples */
+};
+
+struct revpi_ain_filter_config {
+	enum revpi_ain_filter_type type;
+	unsigned int len;
+	unsigned int oversampling;
+};
+
+struct revpi_ain_filter {
+	struct revpi_ain_filter_config config;
+	int window[REVPI_AIN_FILTER_MAX_LEN];
+	unsigned int pos;
+	unsigned int count;
+	s64 sum;		/* average: sum of the window */
+	s64 state;		/* low-pass: output scaled by 2^len */
+	/* time spent in the filter per sample */
+	unsigned int last_cost;	/* nsecs */
+	unsigned int max_cost;	/* nsecs */
+};
+
+void revpi_ain_filter_init(struct revpi_ain_filter *filter,
+			   const struct revpi_ain_filter_config *config);
+int revpi_ain_filter_apply(struct revpi_ain_filter *filter, int value);
+int revpi_ain_filter_parse(const char *buf, unsigned int *chan,
+			   struct revpi_ain_filter_config *config);
+int revpi_ain_filter_show(char *buf, int len, unsigned int chan,
+			  const struct revpi_ain_filter_config *config,
+			  const struct revpi_ain_filter *filter);
+
+#endif /* _REVPI_AIN_FILTER_H */
@@ -3,18 +3,45 @@
 
 // revpi_common.c - common routines for RevPi machines
 
+#include <linux/jump_label.h>
 #include <linux/kthread.h>
 #include <linux/leds.h>
+#include <linux/cpufreq.h>
 #include <linux/sched.h>
+#include <linux/thermal.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 #include "piControlMain.h"
 #include "revpi_common.h"
+#include "revpi_recorder.h"
 #include "RevPiDevice.h"
 
 #define VCMSG_ID_ARM_CLOCK 0x000000003	/* Clock/Voltage ID's */
 
-void revpi_rgb_led_trigger_event(u16 led_prev, u16 led)
+/* lockPI statistics are only gathered if enabled via sysfs */
+static DEFINE_STATIC_KEY_FALSE(revpi_lock_stats_key);
+
+static void revpi_leds_work(struct work_struct *work);
+
+/*
+ * LED triggers may end up on slow hardware (e.g. gpio expanders on i2c), so
+ * the io threads only note the requested state and a worker applies it.
+ */
+static struct revpi_leds {
+	struct work_struct work;
+	/* requested by the io threads */
+	u16 leds;
+	bool power_red;
+	/* applied by the worker */
+	u16 leds_applied;
+	int power_red_applied;		// -1 if not applied yet
+} revpi_leds = {
+	.work = __WORK_INITIALIZER(revpi_leds.work, revpi_leds_work),
+	.power_red_applied = -1,
+};
+
+static void revpi_rgb_led_trigger_event(u16 led_prev, u16 led)
 {
 	u16 changed = led_prev ^ led;
 	if (changed == 0)
@@ -72,7 +99,7 @@ void revpi_rgb_led_trigger_event(u16 led_prev, u16 led)
 	}
 }
 
-void revpi_led_trigger_event(u16 led_prev, u16 led)
+static void revpi_led_trigger_event(u16 led_prev, u16 led)
 {
 	u16 changed = led_prev ^ led;
 	if (changed == 0)
@@ -118,6 +145,46 @@ void revpi_led_trigger_event(u16 led_prev, u16 led)
 	}
 }
 
+static void revpi_leds_work(struct work_struct *work)
+{
+	u16 leds = READ_ONCE(revpi_leds.leds);
+	bool power_red = READ_ONCE(revpi_leds.power_red);
+
+	if (piDev_g.machine_type == REVPI_CONNECT_4 ||
+	    piDev_g.machine_type == REVPI_CONNECT_5)
+		revpi_rgb_led_trigger_event(revpi_leds.leds_applied, leds);
+	else
+		revpi_led_trigger_event(revpi_leds.leds_applied, leds);
+	revpi_leds.leds_applied = leds;
+
+	if (revpi_leds.power_red_applied != power_red) {
+		led_trigger_event(&piDev_g.power_red,
+				  power_red ? LED_FULL : LED_OFF);
+		revpi_leds.power_red_applied = power_red;
+	}
+}
+
+/**
+ * revpi_leds_set() - set the user LEDs
+ * @leds: LED bits of the process image, rgb LEDs on the Connect 4 and 5
+ *
+ * The LEDs are updated asynchronously, this never blocks.
+ */
+void revpi_leds_set(u16 leds)
+{
+	if (READ_ONCE(revpi_leds.leds) == leds)
+		return;
+
+	WRITE_ONCE(revpi_leds.leds, leds);
+	queue_work(system_wq, &revpi_leds.work);
+}
+
+static void revpi_power_led_red(bool on)
+{
+	WRITE_ONCE(revpi_leds.power_red, on);
+	queue_work(system_wq, &revpi_leds.work);
+}
+
 static enum revpi_power_led_mode power_led_mode_s = 255;
 static unsigned long power_led_timer_s;
 static bool power_led_red_state_s;
@@ -133,14 +200,14 @@ void revpi_power_led_red_set(enum revpi_power_led_mode mode)
 			|| power_led_mode_s == REVPI_POWER_LED_ON_1000MS)
 			return; // nothing to do
 		power_led_red_state_s = false;
-		led_trigger_event(&piDev_g.power_red, LED_OFF);
+		revpi_power_led_red(false);
 		break;
 	default:
 	case REVPI_POWER_LED_ON:
 		if (power_led_mode_s == REVPI_POWER_LED_ON)
 			return; // nothing to do
 		power_led_red_state_s = true;
-		led_trigger_event(&piDev_g.power_red, LED_FULL);
+		revpi_power_led_red(true);
 		break;
 	case REVPI_POWER_LED_FLICKR:
 		// just set the mode variable, anything else is done in the run function
@@ -152,7 +219,7 @@ void revpi_power_led_red_set(enum revpi_power_led_mode mode)
 	case REVPI_POWER_LED_ON_500MS:
 	case REVPI_POWER_LED_ON_1000MS:
 		power_led_red_state_s = true;
-		led_trigger_event(&piDev_g.power_red, LED_FULL);
+		revpi_power_led_red(true);
 		power_led_timer_s = jiffies;
 		break;
 	}
@@ -160,36 +227,225 @@ void revpi_power_led_red_set(enum revpi_power_led_mode mode)
 }
 
 
+/**
+ * revpi_safe_state_byte() - get the safe state of a byte in the process image
+ * @addr: offset in the process image
+ *
+ * Must be called with lockPI held.
+ */
+u8 revpi_safe_state_byte(unsigned int addr)
+{
+	u8 force = piDev_g.ai8uPISafeForce[addr];
+	u8 hold = piDev_g.ai8uPISafeHold[addr] & ~force;
+
+	return (piDev_g.ai8uPISafeValue[addr] & force) |
+	       (piDev_g.ai8uPI[addr] & hold);
+}
+
+/**
+ * revpi_safe_state_apply() - bring a range of outputs into the safe state
+ * @addr: offset in the process image
+ * @len: length of the range in bytes
+ *
+ * Must be called with lockPI held.
+ */
+void revpi_safe_state_apply(unsigned int addr, unsigned int len)
+{
+	unsigned int end = min_t(unsigned int, addr + len, KB_PI_LEN);
+
+	for (; addr < end; addr++)
+		piDev_g.ai8uPI[addr] = revpi_safe_state_byte(addr);
+}
+
+/* Remember when a timeout was detected to report the safe state latency */
+void revpi_safe_state_detected(void)
+{
+	if (!piDev_g.tSafeStateDetected)
+		piDev_g.tSafeStateDetected = ktime_get();
+}
+
+/* Called by the io thread after the outputs were sent to the modules */
+void revpi_safe_state_sent(void)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned int latency;
+
+	if (!piDev_g.tSafeStateDetected)
+		return;
+
+	latency = ktime_us_delta(ktime_get(), piDev_g.tSafeStateDetected);
+	piDev_g.tSafeStateDetected = 0;
+
+	write_seqlock(&cycle->lock);
+	cycle->last_safe_state_latency = latency;
+	if (cycle->max_safe_state_latency < latency)
+		cycle->max_safe_state_latency = latency;
+	write_sequnlock(&cycle->lock);
+}
+
+/**
+ * revpi_lock_pi() - lock the process image
+ * @user: kind of caller the statistics are accounted to
+ *
+ * If the statistics are disabled this is a plain rt_mutex_lock().
+ */
+void revpi_lock_pi(enum picontrol_lock_user user)
+{
+	struct picontrol_lock_stats *stats;
+	unsigned int wait = 0;
+	ktime_t start, now;
+
+	if (!static_branch_unlikely(&revpi_lock_stats_key)) {
+		my_rt_mutex_lock(&piDev_g.lockPI);
+		return;
+	}
+
+	stats = &piDev_g.lock_stats[user];
+	start = ktime_get();
+	if (!rt_mutex_trylock(&piDev_g.lockPI)) {
+		rt_mutex_lock(&piDev_g.lockPI);
+		now = ktime_get();
+		wait = min_t(s64, ktime_to_ns(ktime_sub(now, start)), UINT_MAX);
+		start = now;
+		stats->contended++;
+	}
+
+	stats->acquisitions++;
+	stats->wait[min_t(unsigned int, fls(wait / NSEC_PER_USEC),
+			  PICONTROL_LOCK_WAIT_BUCKETS - 1)]++;
+	if (stats->max_wait < wait)
+		stats->max_wait = wait;
+
+	piDev_g.lock_acquired = start;
+	piDev_g.lock_user = user;
+}
+
+void revpi_unlock_pi(void)
+{
+	struct picontrol_lock_stats *stats;
+	unsigned int hold;
+
+	if (unlikely(piDev_g.lock_acquired)) {
+		stats = &piDev_g.lock_stats[piDev_g.lock_user];
+		hold = min_t(s64, ktime_to_ns(ktime_sub(ktime_get(),
+							piDev_g.lock_acquired)),
+			     UINT_MAX);
+		if (stats->max_hold < hold)
+			stats->max_hold = hold;
+		piDev_g.lock_acquired = 0;
+	}
+	rt_mutex_unlock(&piDev_g.lockPI);
+}
+
+void revpi_lock_stats_enable(bool enable)
+{
+	if (enable)
+		static_branch_enable(&revpi_lock_stats_key);
+	else
+		static_branch_disable(&revpi_lock_stats_key);
+}
+
+bool revpi_lock_stats_enabled(void)
+{
+	return static_key_enabled(&revpi_lock_stats_key);
+}
+
+ssize_t revpi_lock_stats_show(char *buf)
+{
+	static const char * const names[PICONTROL_LOCK_USERS] = {
+		[PICONTROL_LOCK_IO] = "io",
+		[PICONTROL_LOCK_USER] = "user",
+	};
+	struct picontrol_lock_stats stats[PICONTROL_LOCK_USERS];
+	ssize_t len = 0;
+	int i, j;
+
+	rt_mutex_lock(&piDev_g.lockPI);
+	memcpy(stats, piDev_g.lock_stats, sizeof(stats));
+	rt_mutex_unlock(&piDev_g.lockPI);
+
+	for (i = 0; i < PICONTROL_LOCK_USERS; i++) {
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%s %llu %llu %u %u", names[i],
+				 stats[i].acquisitions, stats[i].contended,
+				 stats[i].max_wait, stats[i].max_hold);
+		for (j = 0; j < PICONTROL_LOCK_WAIT_BUCKETS; j++)
+			len += scnprintf(buf + len, PAGE_SIZE - len, " %llu",
+					 stats[i].wait[j]);
+		len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	}
+
+	return len;
+}
+
+void revpi_lock_stats_reset(void)
+{
+	rt_mutex_lock(&piDev_g.lockPI);
+	memset(piDev_g.lock_stats, 0, sizeof(piDev_g.lock_stats));
+	rt_mutex_unlock(&piDev_g.lockPI);
+}
+
+/*
+ * Lock the process image from the io thread. The acquisitions and the time
+ * the lock is held are accounted to the current cycle.
+ */
+void revpi_io_lock_pi(void)
+{
+	revpi_lock_pi(PICONTROL_LOCK_IO);
+	piDev_g.cycle.lock_start = ktime_get();
+	piDev_g.cycle.locks++;
+}
+
+void revpi_io_unlock_pi(void)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+
+	cycle->lock_time += ktime_to_ns(ktime_sub(ktime_get(),
+						  cycle->lock_start));
+	revpi_unlock_pi();
+}
+
+/* Called by the io thread at the end of a cycle to publish the lock usage */
+void revpi_io_lock_stats(void)
+{
+	struct picontrol_cycle *cycle = &piDev_g.cycle;
+	unsigned int lock_time = min_t(u64, cycle->lock_time, UINT_MAX);
+
+	write_seqlock(&cycle->lock);
+	cycle->last_locks = cycle->locks;
+	cycle->last_lock_time = lock_time;
+	if (cycle->max_lock_time < lock_time)
+		cycle->max_lock_time = lock_time;
+	write_sequnlock(&cycle->lock);
+
+	cycle->locks = 0;
+	cycle->lock_time = 0;
+}
+
+/*
+ * Called once per io cycle before the outputs are sent. The watchdog timers
+ * of the instances only set a flag on expiry, so the cost does not depend on
+ * the number of clients.
+ */
 void revpi_check_timeout(void)
 {
-	ktime_t now = ktime_get();
-	struct list_head *pCon;
-
-	my_rt_mutex_lock(&piDev_g.lockListCon);
-	list_for_each(pCon, &piDev_g.listCon) {
-		tpiControlInst *pos_inst;
-		pos_inst = list_entry(pCon, tpiControlInst, list);
-
-		if (pos_inst->tTimeoutDurationMs != 0) {
-			if (ktime_compare(now, pos_inst->tTimeoutTS) > 0) {
-				// set all outputs to 0
-				int i;
-				my_rt_mutex_lock(&piDev_g.lockPI);
-				for (i = 0; i < RevPiDevice_getDevCnt(); i++) {
-					if (RevPiDevice_getDev(i)->i8uActive) {
-						memset(piDev_g.ai8uPI + RevPiDevice_getDev(i)->i16uOutputOffset, 0, RevPiDevice_getDev(i)->sId.i16uFBS_OutputLength);
-					}
-				}
-				rt_mutex_unlock(&piDev_g.lockPI);
-				pos_inst->tTimeoutTS = ktime_add_ms(ktime_get(), pos_inst->tTimeoutDurationMs);
+	int i;
 
-				// this must only be done for one connection
-				rt_mutex_unlock(&piDev_g.lockListCon);
-				return;
-			}
+	if (!test_and_clear_bit(PICONTROL_DEV_FLAG_WATCHDOG_EXPIRED,
+				&piDev_g.flags))
+		return;
+
+	revpi_safe_state_detected();
+	revpi_recorder_trigger(PICONTROL_RECORDER_TRIGGER_WATCHDOG);
+
+	// set all outputs to their safe state
+	revpi_io_lock_pi();
+	for (i = 0; i < RevPiDevice_getDevCnt(); i++) {
+		if (RevPiDevice_getDev(i)->i8uActive) {
+			revpi_safe_state_apply(RevPiDevice_getDev(i)->i16uOutputOffset, RevPiDevice_getDev(i)->sId.i16uFBS_OutputLength);
 		}
 	}
-	rt_mutex_unlock(&piDev_g.lockListCon);
+	revpi_io_unlock_pi();
 }
 
 void revpi_power_led_red_run(void)
@@ -198,25 +454,25 @@ void revpi_power_led_red_run(void)
 	case REVPI_POWER_LED_FLICKR:
 		if (power_led_red_state_s && jiffies_to_msecs(jiffies - power_led_timer_s) > 10) {
 			power_led_red_state_s = false;
-			led_trigger_event(&piDev_g.power_red, LED_OFF);
+			revpi_power_led_red(false);
 			power_led_timer_s = jiffies;
 		} else if (!power_led_red_state_s && jiffies_to_msecs(jiffies - power_led_timer_s) > 90) {
 			power_led_red_state_s = true;
-			led_trigger_event(&piDev_g.power_red, LED_FULL);
+			revpi_power_led_red(true);
 			power_led_timer_s = jiffies;
 		}
 		break;
 	case REVPI_POWER_LED_ON_500MS:
 		if (jiffies_to_msecs(jiffies - power_led_timer_s) > 500) {
 			power_led_red_state_s = false;
-			led_trigger_event(&piDev_g.power_red, LED_OFF);
+			revpi_power_led_red(false);
 			power_led_mode_s = REVPI_POWER_LED_OFF;
 		}
 		break;
 	case REVPI_POWER_LED_ON_1000MS:
 		if (jiffies_to_msecs(jiffies - power_led_timer_s) > 1000) {
 			power_led_red_state_s = false;
-			led_trigger_event(&piDev_g.power_red, LED_OFF);
+			revpi_power_led_red(false);
 			power_led_mode_s = REVPI_POWER_LED_OFF;
 		}
 		break;
@@ -225,6 +481,46 @@ void revpi_power_led_red_run(void)
 	}
 }
 
+/*
+ * Reading the cpu temperature and frequency may sleep or contend on locks
+ * unrelated to io. It is therefore done by a regular worker, the io threads
+ * only pick up the last values.
+ */
+static void revpi_housekeeping_work(struct work_struct *work)
+{
+	int temp, ret;
+
+	if (piDev_g.thermal_zone) {
+		ret = thermal_zone_get_temp(piDev_g.thermal_zone, &temp);
+		if (ret)
+			pr_err("could not read cpu temperature\n");
+		else
+			WRITE_ONCE(piDev_g.cpu_temperature, temp);
+	}
+
+	/* in kHz */
+	WRITE_ONCE(piDev_g.cpu_frequency, cpufreq_quick_get(0));
+
+	queue_delayed_work(system_wq, &piDev_g.housekeeping_work,
+			   msecs_to_jiffies(REVPI_HOUSEKEEPING_INTERVAL));
+}
+
+/*
+ * The first sample is taken right away, so the io threads started later
+ * never see unset values. It also queues the periodic work.
+ */
+void revpi_housekeeping_start(void)
+{
+	INIT_DELAYED_WORK(&piDev_g.housekeeping_work, revpi_housekeeping_work);
+	revpi_housekeeping_work(&piDev_g.housekeeping_work.work);
+}
+
+void revpi_housekeeping_stop(void)
+{
+	cancel_delayed_work_sync(&piDev_g.housekeeping_work);
+	cancel_work_sync(&revpi_leds.work);
+}
+
 int set_rt_priority(struct task_struct *task, int priority)
 {
 	struct sched_attr attr;
@@ -10,6 +10,8 @@
 #include <linux/version.h>
 #include <uapi/linux/sched/types.h>
 
+#include "piControlMain.h"
+
 enum revpi_power_led_mode {
 	REVPI_POWER_LED_OFF = 0,
 	REVPI_POWER_LED_ON = 1,
@@ -18,11 +20,25 @@ enum revpi_power_led_mode {
 	REVPI_POWER_LED_ON_1000MS = 4,
 };
 
-void revpi_rgb_led_trigger_event(u16 led_prev, u16 led);
-void revpi_led_trigger_event(u16 led_prev, u16 led);
+void revpi_leds_set(u16 leds);
 void revpi_power_led_red_set(enum revpi_power_led_mode mode);
 void revpi_power_led_red_run(void);
 void revpi_check_timeout(void);
+u8 revpi_safe_state_byte(unsigned int addr);
+void revpi_safe_state_apply(unsigned int addr, unsigned int len);
+void revpi_safe_state_detected(void);
+void revpi_safe_state_sent(void);
+void revpi_lock_pi(enum picontrol_lock_user user);
+void revpi_unlock_pi(void);
+void revpi_lock_stats_enable(bool enable);
+bool revpi_lock_stats_enabled(void);
+ssize_t revpi_lock_stats_show(char *buf);
+void revpi_lock_stats_reset(void);
+void revpi_io_lock_pi(void);
+void revpi_io_unlock_pi(void);
+void revpi_io_lock_stats(void);
+void revpi_housekeeping_start(void);
+void revpi_housekeeping_stop(void);
 
 extern char *lock_file;
 extern int lock_line;
@@ -3,7 +3,6 @@
 
 // revpi_compact.c - RevPi Compact specific handling
 
-#include <linux/cpufreq.h>
 #include <linux/gpio/consumer.h>
 #include <linux/gpio/machine.h>
 #include <linux/iio/consumer.h>
@@ -11,30 +10,53 @@
 #include <linux/iio/iio.h>
 #include <linux/iio/machine.h>
 #include <linux/ktime.h>
+#include <linux/moduleparam.h>
 #include <linux/spi/max3191x.h>
 #include <linux/spi/spi.h>
-#include <linux/thermal.h>
 #include <linux/platform_device.h>
 
 #include "piControlMain.h"
+#include "picontrol_trace.h"
 #include "process_image.h"
 #include "pt100.h"
+#include "revpi_ain_filter.h"
 #include "revpi_common.h"
 #include "revpi_compact.h"
+#include "revpi_recorder.h"
 #include "RevPiDevice.h"
 
-#define REVPI_COMPACT_IO_CYCLE		( 250 * NSEC_PER_USEC)		// 250 usec
+/* default, min and max period of the io thread */
+#define REVPI_COMPACT_IO_CYCLE		250	/* usecs */
+#define REVPI_COMPACT_IO_MIN_CYCLE	100	/* usecs */
+/* dout is written every cycle to feed the watchdog of the output driver */
+#define REVPI_COMPACT_IO_MAX_CYCLE	1000	/* usecs */
 #define REVPI_COMPACT_AIN_CYCLE		( 125 * NSEC_PER_MSEC)		// 125 msec
+/* default and max sampling period of an analog input */
+#define REVPI_COMPACT_AIN_PERIOD	1000	/* msecs */
+#define REVPI_COMPACT_AIN_MAX_PERIOD	60000	/* msecs */
+/* channels due for longer than this are sampled regardless of priority */
+#define REVPI_COMPACT_AIN_MAX_DELAY	REVPI_COMPACT_AIN_CYCLE
 
 #define IO_THREAD_PRIO	MAX_RT_PRIO/2 + 8
 #define AIN_THREAD_PRIO MAX_RT_PRIO/2 + 6
 
+static unsigned int picontrol_compact_cycle_duration;
+
+module_param(picontrol_compact_cycle_duration, uint, S_IRUSR);
+MODULE_PARM_DESC(picontrol_compact_cycle_duration, "Specify the io-cycle duration of the "
+						   "RevPi Compact in usecs (default 250).");
+
 static const struct kthread_prio revpi_compact_kthread_prios[] = {
 	/* spi pump to I/O chips */
 	{ .comm = "spi2",		.prio = MAX_RT_PRIO/2 + 10 },
 	{ }
 };
 
+struct revpi_compact_ain_sched {
+	unsigned int period;	/* msecs, 0 samples as often as possible */
+	u8 prio;		/* due channels with higher prio are sampled first */
+};
+
 typedef struct _SRevPiCompact {
 	SRevPiCompactImage image;
 	SRevPiCompactConfig config;
@@ -44,11 +66,22 @@ typedef struct _SRevPiCompact {
 	struct gpio_desc *dout_fault;
 	struct gpio_descs *din;
 	struct gpio_descs *dout;
+	unsigned int io_cycle;	/* usecs */
 	struct iio_dev *ain_dev, *aout_dev;
 	struct iio_channel *ain;
 	struct iio_channel *aout[2];
+	/* reset requested by revpi_compact_reset(), completes ain_reset */
 	bool ain_should_reset;
 	struct completion ain_reset;
+	/* sampling schedule and filters of the analog inputs */
+	struct revpi_compact_ain_sched ain_sched[8];
+	struct revpi_ain_filter_config ain_filter_config[8];
+	/* schedule or filters changed by sysfs */
+	bool ain_config_changed;
+	/* protects the schedule, the filter configs and the two flags */
+	spinlock_t ain_config_lock;
+	/* owned by the ain thread */
+	struct revpi_ain_filter ain_filter[8];
 	struct revpi_compact_stats stats;
 } SRevPiCompact;
 
@@ -124,7 +157,6 @@ field##_show(struct device *dev, struct device_attribute *attr,		\
 revpi_compact_descriptor_attr(lost_cycles, "%llu\n");
 
 static DEVICE_ATTR(lost_cycles, S_IRUGO, lost_cycles_show, NULL);
-//#define BENCH
 
 static int revpi_compact_poll_io(void *data)
 {
@@ -132,32 +164,42 @@ static int revpi_compact_poll_io(void *data)
 	SRevPiCompactImage *image = &machine->image;
 	SRevPiCompactImage prev = { };
 	struct cycletimer ct;
+	u64 cycle_num = 0;
+	unsigned int aout_next = 0, transfers, n;
+	unsigned long aout_err = 0;
 	int ret, i;
 	DECLARE_BITMAP(val, 8);
-	bool err;
-#ifdef BENCH
-	ktime_t t[7];
-	s64 d[7];
-	s64 m[7];
-	int loop = 0;
-	memset(m, 0, sizeof(m));
-#define MEASSURE(i)   t[i] = ktime_get()
-#else
-#define MEASSURE(i)
-#endif
-	/* force write of aout channels on first cycle */
+	unsigned int io_cycle;
+	ktime_t start, last_start;
+	bool trace;
+	ktime_t t[6];
+
+	/* force write of aout channels on first cycles */
 	for (i = 0; i < ARRAY_SIZE(prev.usr.aout); i++)
 		prev.usr.aout[i] = -1;
 
-	cycletimer_init_on_stack(&ct, REVPI_COMPACT_IO_CYCLE);
+	io_cycle = READ_ONCE(machine->io_cycle);
+	cycletimer_init_on_stack(&ct, io_cycle * NSEC_PER_USEC);
+	last_start = ktime_get();
 
 	while (!kthread_should_stop()) {
-		MEASSURE(0);
+		start = ktime_get();
+		write_seqlock(&machine->stats.lock);
+		machine->stats.last_io_cycle = ktime_us_delta(start, last_start);
+		write_sequnlock(&machine->stats.lock);
+		last_start = start;
+
+		trace = trace_picontrol_compact_cycle_enabled();
+		if (trace)
+			t[0] = ktime_get();
+		transfers = 0;
+
 		/* poll din */
 		ret = gpiod_get_array_value_cansleep(machine->din->ndescs,
 		                                     machine->din->desc,
 		                                     machine->din->info,
 		                                     val);
+		transfers++;
 		image->drv.din_status = max3191x_get_status(machine->din_dev);
 		image->drv.din = 0;
 		if (ret)
@@ -165,16 +207,20 @@ static int revpi_compact_poll_io(void *data)
 		else
 			image->drv.din = (u8)val[0] & 0xff;
 
-		MEASSURE(1);
+		if (trace)
+			t[1] = ktime_get();
 		/* poll dout fault pin */
 		image->drv.dout_status =
 			!!gpiod_get_value_cansleep(machine->dout_fault) << 5;
 
-		MEASSURE(2);
-		flip_process_image(image, machine->config.offset);
+		if (trace)
+			t[2] = ktime_get();
+		/* apply a safe state before the outputs are fetched */
 		revpi_check_timeout();
+		flip_process_image(image, machine->config.offset);
 
-		MEASSURE(3);
+		if (trace)
+			t[3] = ktime_get();
 		/* write dout on every cycle to feed watchdog */
 		/* FIXME: GPIO core should return non-void for set() */
 		val[0] = image->usr.dout & 0xff;
@@ -182,50 +228,67 @@ static int revpi_compact_poll_io(void *data)
 		                               machine->dout->desc,
 		                               machine->dout->info,
 		                               val);
+		transfers++;
+
+		if (trace)
+			t[4] = ktime_get();
+		/*
+		 * Write aout channels only if changed by user or if their
+		 * last write failed. The failed transfer may have left the
+		 * DAC at any value, so the channel is rewritten even if the
+		 * user restored the previous value. Each channel is a
+		 * transfer of its own, so at most one is written per cycle
+		 * and the channels take turns.
+		 */
+		for (n = 0; n < ARRAY_SIZE(image->usr.aout); n++) {
+			int raw;
+
+			i = (aout_next + n) % ARRAY_SIZE(image->usr.aout);
+			if (image->usr.aout[i] == prev.usr.aout[i] &&
+			    !test_bit(i, &aout_err))
+				continue;
+
+			/*  raw = (value in mV << 8 bit) / 10V */
+			raw = (image->usr.aout[i] << 8) / 10000;
+			ret = iio_write_channel_raw(machine->aout[i],
+						    min(raw, 255));
+			transfers++;
+			/*
+			 * On success save in prev,
+			 * on failure retry during a later cycle.
+			 */
+			__assign_bit(i, &aout_err, ret);
+			if (!ret)
+				prev.usr.aout[i] = image->usr.aout[i];
+			aout_next = i + 1;
+			break;
+		}
+		assign_bit_in_byte(AOUT_TX_ERR, &image->drv.aout_status,
+				   aout_err);
+
+		if (trace) {
+			t[5] = ktime_get();
+			trace_picontrol_compact_cycle(cycle_num,
+				ktime_to_ns(ktime_sub(t[1], t[0])),
+				ktime_to_ns(ktime_sub(t[3], t[2])),
+				ktime_to_ns(ktime_sub(t[2], t[1])) +
+				ktime_to_ns(ktime_sub(t[4], t[3])),
+				ktime_to_ns(ktime_sub(t[5], t[4])),
+				transfers);
+		}
 
-		MEASSURE(4);
-		/* write aout channels only if changed by user */
-		err = false;
-		for (i = 0; i < ARRAY_SIZE(image->usr.aout); i++)
-			if (image->usr.aout[i] != prev.usr.aout[i]) {
-				/*  raw = (value in mV << 8 bit) / 10V */
-				int raw = (image->usr.aout[i] << 8) / 10000;
-				ret = iio_write_channel_raw(machine->aout[i],
-							    min(raw, 255));
-				if (ret)
-					err = true;
-				else
-					/*
-					 * On success save in prev,
-					 * on failure retry during next cycle.
-					 */
-					prev.usr.aout[i] = image->usr.aout[i];
-			}
-		assign_bit_in_byte(AOUT_TX_ERR, &image->drv.aout_status, err);
+		revpi_safe_state_sent();
+		revpi_recorder_record(cycle_num++);
+		revpi_io_lock_stats();
 
-		MEASSURE(5);
 		/* update LEDs if changed by user */
-		revpi_led_trigger_event(prev.usr.led, image->usr.led);
-		prev.usr.led = image->usr.led;
-		MEASSURE(6);
-#ifdef BENCH
-		for (i=0; i<6; i++) {
-			d[i] = ktime_to_us(ktime_sub(t[i+1], t[i]));
-			if (m[i] < d[i])
-				m[i] = d[i];
-		}
-		d[6] = ktime_to_us(ktime_sub(t[6], t[0]));
-		if (m[6] < d[6])
-			m[6] = d[6];
-
-		if ((loop % 4000) == 0) {
-			pr_info("ioThread: d %3d %3d %3d %3d %3d %3d s %3d\n",
-				(int)d[0], (int)d[1], (int)d[2], (int)d[3], (int)d[4], (int)d[5], (int)d[6]);
-			pr_info("ioThread: m %3d %3d %3d %3d %3d %3d s %3d\n",
-				(int)m[0], (int)m[1], (int)m[2], (int)m[3], (int)m[4], (int)m[5], (int)m[6]);
+		revpi_leds_set(image->usr.led);
+
+		/* a new period starts with the next cycle */
+		if (READ_ONCE(machine->io_cycle) != io_cycle) {
+			io_cycle = READ_ONCE(machine->io_cycle);
+			cycletimer_change(&ct, io_cycle * NSEC_PER_USEC);
 		}
-		loop++;
-#endif
 		cycletimer_sleep(&ct, &machine->stats);
 	}
 
@@ -233,36 +296,91 @@ static int revpi_compact_poll_io(void *data)
 	return 0;
 }
 
+/*
+ * Pick the due analog input with the highest priority. Among channels with
+ * the same priority the one which waits longest is sampled first. A channel
+ * which is overdue by more than REVPI_COMPACT_AIN_MAX_DELAY is sampled
+ * first, so channels with period 0 cannot starve those of lower priority.
+ */
+static int revpi_compact_ain_next(const struct revpi_compact_ain_sched *sched,
+				  const ktime_t *next, int numchans, ktime_t now)
+{
+	ktime_t overdue = ktime_sub_ns(now, REVPI_COMPACT_AIN_MAX_DELAY);
+	int best = -1;
+	int i;
+
+	for (i = 0; i < numchans; i++) {
+		if (ktime_after(next[i], overdue))
+			continue;
+		if (best < 0 || ktime_before(next[i], next[best]))
+			best = i;
+	}
+
+	if (best >= 0)
+		return best;
+
+	for (i = 0; i < numchans; i++) {
+		if (ktime_after(next[i], now))
+			continue;
+		if (best < 0 || sched[i].prio > sched[best].prio ||
+		    (sched[i].prio == sched[best].prio &&
+		     ktime_before(next[i], next[best])))
+			best = i;
+	}
+
+	return best;
+}
+
 static int revpi_compact_poll_ain(void *data)
 {
 	SRevPiCompact *machine = (SRevPiCompact *)data;
 	SRevPiCompactImage *image = &machine->image;
+	struct revpi_compact_ain_sched sched[ARRAY_SIZE(machine->config.ain)];
+	unsigned int samples[ARRAY_SIZE(machine->config.ain)];
+	ktime_t next[ARRAY_SIZE(machine->config.ain)];
 	bool  rtd[ARRAY_SIZE(machine->config.ain)];
 	bool pt1k[ARRAY_SIZE(machine->config.ain)];
 	int   mux[ARRAY_SIZE(machine->config.ain)];
 	int  chan[ARRAY_SIZE(machine->config.ain)];
 	int i = 0, numchans = 0, ret, raw;
+	unsigned int n, oversampling;
+	ktime_t now, wake, next_sys, last_sys;
 	struct cycletimer ct;
 
 	cycletimer_init_on_stack(&ct, REVPI_COMPACT_AIN_CYCLE);
+	next_sys = last_sys = ktime_get();
 
 	while (!kthread_should_stop()) {
 		unsigned long long tmp;
+		s64 sum;
+
+		if (READ_ONCE(machine->ain_should_reset) ||
+		    READ_ONCE(machine->ain_config_changed)) {
+			bool reset;
+
+			/*
+			 * Clear the requests before reading the config, so a
+			 * request which comes in meanwhile is not lost.
+			 */
+			spin_lock(&machine->ain_config_lock);
+			reset = machine->ain_should_reset;
+			machine->ain_should_reset = false;
+			machine->ain_config_changed = false;
+			spin_unlock(&machine->ain_config_lock);
 
-		smp_rmb();
-		if (machine->ain_should_reset) {
 			/* determine which channels are enabled */
 			pr_info_aio("AIn Reset: config %d %d %d %d %d %d %d %d\n",
 				machine->config.ain[0], machine->config.ain[1], machine->config.ain[2], machine->config.ain[3],
 				machine->config.ain[4], machine->config.ain[5], machine->config.ain[6], machine->config.ain[7]);
 
+			now = ktime_get();
 			for (i = 0, numchans = 0; i < ARRAY_SIZE(chan); i++) {
 				unsigned long config = machine->config.ain[i];
 
 				if (!test_bit(AIN_ENABLED, &config)) {
-					my_rt_mutex_lock(&piDev_g.lockPI);
+					revpi_lock_pi(PICONTROL_LOCK_IO);
 					image->drv.ain[i] = 0;
-					rt_mutex_unlock(&piDev_g.lockPI);
+					revpi_unlock_pi();
 					continue;
 				}
 
@@ -272,96 +390,269 @@ static int revpi_compact_poll_ain(void *data)
 				mux[numchans]  = i + rtd[numchans] *
 						 ARRAY_SIZE(chan);
 				chan[numchans] = i;
+				spin_lock(&machine->ain_config_lock);
+				sched[numchans] = machine->ain_sched[i];
+				revpi_ain_filter_init(&machine->ain_filter[i],
+						      &machine->ain_filter_config[i]);
+				spin_unlock(&machine->ain_config_lock);
+				next[numchans] = now;
+				samples[numchans] = 0;
 				numchans++;
 			}
 
 			pr_info("ain thread reset to %d chans\n",
 				 numchans);
 
-			/*
-			 * If numchans is 0, still need to wake up once per sec
-			 * to update core frequency and temperature.
-			 */
-			cycletimer_change(&ct, NSEC_PER_SEC / max(numchans, 1));
+			write_seqlock(&machine->stats.lock);
+			memset(machine->stats.ain_rate, 0,
+			       sizeof(machine->stats.ain_rate));
+			write_sequnlock(&machine->stats.lock);
+			last_sys = now;
 
-			i = 0;
-			smp_store_release(&machine->ain_should_reset, false);
-			complete(&machine->ain_reset);
-			pr_info_aio("AIn Reset: ct %dms, %d active: %d %d %d %d %d %d %d %d    %d %d %d %d %d %d %d %d\n",
-				(1000 / numchans), numchans,
+			if (reset)
+				complete(&machine->ain_reset);
+			pr_info_aio("AIn Reset: %d active: %d %d %d %d %d %d %d %d    %d %d %d %d %d %d %d %d\n",
+				numchans,
 				mux[0], mux[1], mux[2], mux[3], mux[4], mux[5], mux[6], mux[7],
 				chan[0], chan[1], chan[2], chan[3], chan[4], chan[5], chan[6], chan[7]
 				);
 		}
 
-		if (!numchans)
-			goto next_chan; /* only update core freq and temp */
+		now = ktime_get();
+
+		// update every 1 sec
+		if (!ktime_before(now, next_sys)) {
+			unsigned int elapsed;
+
+			/* sampled by revpi_housekeeping_work() */
+			revpi_lock_pi(PICONTROL_LOCK_IO);
+			image->drv.i8uCPUTemperature =
+				READ_ONCE(piDev_g.cpu_temperature) / 1000;
+			image->drv.i8uCPUFrequency =
+				READ_ONCE(piDev_g.cpu_frequency) / 10;
+			revpi_unlock_pi();
+
+			elapsed = max_t(s64, ktime_ms_delta(now, last_sys), 1);
+			write_seqlock(&machine->stats.lock);
+			for (i = 0; i < numchans; i++) {
+				machine->stats.ain_rate[chan[i]] =
+					div_u64((u64)samples[i] * 1000000, elapsed);
+				samples[i] = 0;
+			}
+			write_sequnlock(&machine->stats.lock);
+
+			last_sys = now;
+			next_sys = ktime_add_ms(now, MSEC_PER_SEC);
+		}
+
+		i = revpi_compact_ain_next(sched, next, numchans, now);
+		if (i < 0) {
+			/* sleep until the next channel or the update is due */
+			wake = next_sys;
+			for (i = 0; i < numchans; i++)
+				if (ktime_before(next[i], wake))
+					wake = next[i];
+			cycletimer_sleep_until(&ct, wake);
+			continue;
+		}
 
-		/* poll ain */
-		ret = iio_read_channel_raw(&machine->ain[mux[i]], &raw);
+		next[i] = ktime_add_ms(next[i], sched[i].period);
+		if (ktime_before(next[i], now))
+			next[i] = now;
+
+		/* poll ain, averaged over the configured number of conversions */
+		oversampling = machine->ain_filter[chan[i]].config.oversampling;
+		for (n = 0, sum = 0; n < oversampling; n++) {
+			ret = iio_read_channel_raw(&machine->ain[mux[i]], &raw);
+			if (ret < 0)
+				break;
+			sum += raw;
+		}
 
-		my_rt_mutex_lock(&piDev_g.lockPI);
+		revpi_lock_pi(PICONTROL_LOCK_IO);
 		assign_bit_in_byte(AIN_TX_ERR, &image->drv.ain_status, ret < 0);
 		if (ret < 0) {
 			image->drv.ain[chan[i]] = 0;
-			rt_mutex_unlock(&piDev_g.lockPI);
-			goto next_chan;
+			revpi_unlock_pi();
+			/* do not retry a failing channel without a pause */
+			next[i] = ktime_add_ns(now, REVPI_COMPACT_AIN_CYCLE);
+			continue;
 		}
-		rt_mutex_unlock(&piDev_g.lockPI);
+		revpi_unlock_pi();
+		samples[i]++;
+
+		raw = (int)div_s64(sum, oversampling);
+		raw = revpi_ain_filter_apply(&machine->ain_filter[chan[i]], raw);
 
 		/* raw value in mV = ((raw * 12.5V) >> 21 bit) + 6.25V */
 		tmp = shift_right((s64)raw * 12500 * 100000000LL, 21);
-		raw = (int)div_s64(tmp, 100000000LL) + 6250;
 
 		if (rtd[i]) {
 			/*
-			 * resistance in Ohm = raw value in mV / 2.5 mA,
-			 * scaled by 10 for PT1000 or by 100 for PT100
-			 * to match up with values in pt100_table.inc
+			 * resistance in mOhm = voltage in uV / 2.5 mA, divided
+			 * by 10 for PT1000. The voltage is not truncated to
+			 * mV, that would be about 1 °C for a PT100.
 			 */
-			int resistance = pt1k[i] ? raw * 100 / 25
-						 : raw * 1000 / 25;
-			GetPt100Temperature(resistance, &raw);
-		}
-
-		my_rt_mutex_lock(&piDev_g.lockPI);
-		image->drv.ain[chan[i]] = raw;
-		rt_mutex_unlock(&piDev_g.lockPI);
-
-next_chan:
-		if (++i >= numchans) {
-			int ret;
-			int freq;
-			int temp;
-			i = 0;
-
-			// update every 1 sec
-			if (piDev_g.thermal_zone != NULL) {
-				ret = thermal_zone_get_temp(piDev_g.thermal_zone, &temp);
-				if (ret)
-					pr_err("could not read cpu temperature");
-			}
+			s64 uv = div_s64(tmp, 100000LL) + 6250000;
 
-			/*
-			   Get the CPU clock from CPU0 in kHz
-			   and divide it down to MHz.
-			*/
-			freq = cpufreq_quick_get(0);
-
-			my_rt_mutex_lock(&piDev_g.lockPI);
-			if (piDev_g.thermal_zone != NULL && !ret)
-				image->drv.i8uCPUTemperature = temp / 1000;
-			image->drv.i8uCPUFrequency = freq / 10;
-			rt_mutex_unlock(&piDev_g.lockPI);
+			GetPt100Temperature(div_s64(max_t(s64, uv, 0) * 2,
+						    pt1k[i] ? 50 : 5), &raw);
+		} else {
+			raw = (int)div_s64(tmp, 100000000LL) + 6250;
 		}
 
-		cycletimer_sleep(&ct, &machine->stats);
+		revpi_lock_pi(PICONTROL_LOCK_IO);
+		image->drv.ain[chan[i]] = raw;
+		revpi_unlock_pi();
 	}
 
 	cycletimer_destroy(&ct);
 	return 0;
 }
 
+static ssize_t ain_schedule_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	SRevPiCompact *machine = piDev_g.machine;
+	struct revpi_compact_ain_sched sched[ARRAY_SIZE(machine->ain_sched)];
+	unsigned int rate[ARRAY_SIZE(machine->stats.ain_rate)];
+	ssize_t len = 0;
+	unsigned int seq;
+	int i;
+
+	spin_lock(&machine->ain_config_lock);
+	memcpy(sched, machine->ain_sched, sizeof(sched));
+	spin_unlock(&machine->ain_config_lock);
+
+	do {
+		seq = read_seqbegin(&machine->stats.lock);
+		memcpy(rate, machine->stats.ain_rate, sizeof(rate));
+	} while (read_seqretry(&machine->stats.lock, seq));
+
+	for (i = 0; i < ARRAY_SIZE(sched); i++)
+		len += sysfs_emit_at(buf, len, "%d %u %u %u\n", i,
+				     sched[i].period, sched[i].prio, rate[i]);
+
+	return len;
+}
+
+static ssize_t ain_schedule_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	SRevPiCompact *machine = piDev_g.machine;
+	unsigned int chan, period, prio;
+
+	if (sscanf(buf, "%u %u %u", &chan, &period, &prio) != 3)
+		return -EINVAL;
+
+	if (chan >= ARRAY_SIZE(machine->ain_sched) ||
+	    period > REVPI_COMPACT_AIN_MAX_PERIOD || prio > U8_MAX)
+		return -EINVAL;
+
+	/* the ain thread takes the new schedule on its next wakeup */
+	spin_lock(&machine->ain_config_lock);
+	machine->ain_sched[chan].period = period;
+	machine->ain_sched[chan].prio = prio;
+	machine->ain_config_changed = true;
+	spin_unlock(&machine->ain_config_lock);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(ain_schedule);
+
+static ssize_t ain_filter_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	SRevPiCompact *machine = piDev_g.machine;
+	struct revpi_ain_filter_config config[ARRAY_SIZE(machine->ain_filter)];
+	ssize_t len = 0;
+	int i;
+
+	spin_lock(&machine->ain_config_lock);
+	memcpy(config, machine->ain_filter_config, sizeof(config));
+	spin_unlock(&machine->ain_config_lock);
+
+	for (i = 0; i < ARRAY_SIZE(config); i++)
+		len += revpi_ain_filter_show(buf, len, i, &config[i],
+					     &machine->ain_filter[i]);
+
+	return len;
+}
+
+static ssize_t ain_filter_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	SRevPiCompact *machine = piDev_g.machine;
+	struct revpi_ain_filter_config config;
+	unsigned int chan;
+	int ret;
+
+	ret = revpi_ain_filter_parse(buf, &chan, &config);
+	if (ret)
+		return ret;
+
+	if (chan >= ARRAY_SIZE(machine->ain_filter_config))
+		return -EINVAL;
+
+	/* the ain thread restarts the filters on its next wakeup */
+	spin_lock(&machine->ain_config_lock);
+	machine->ain_filter_config[chan] = config;
+	machine->ain_config_changed = true;
+	spin_unlock(&machine->ain_config_lock);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(ain_filter);
+
+static ssize_t io_cycle_duration_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	SRevPiCompact *machine = piDev_g.machine;
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(machine->io_cycle));
+}
+
+static ssize_t io_cycle_duration_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	SRevPiCompact *machine = piDev_g.machine;
+	unsigned int val;
+
+	if (kstrtouint(buf, 10, &val))
+		return -EINVAL;
+
+	if (val < REVPI_COMPACT_IO_MIN_CYCLE || val > REVPI_COMPACT_IO_MAX_CYCLE)
+		return -EINVAL;
+
+	/* the io thread takes the new period at the end of its cycle */
+	WRITE_ONCE(machine->io_cycle, val);
+
+	return count;
+}
+
+static ssize_t last_io_cycle_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	SRevPiCompact *machine = piDev_g.machine;
+	unsigned int last;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&machine->stats.lock);
+		last = machine->stats.last_io_cycle;
+	} while (read_seqretry(&machine->stats.lock, seq));
+
+	return sysfs_emit(buf, "%u\n", last);
+}
+
+static DEVICE_ATTR_RW(io_cycle_duration);
+static DEVICE_ATTR_RO(last_io_cycle);
+
 static int match_name(struct device *dev, const void *data)
 {
 	const char *name = data;
@@ -535,7 +826,7 @@ int revpi_compact_probe(struct platform_device *pdev)
 {
 	SRevPiCompact *machine;
 	struct device *dev;
-	int ret;
+	int ret, i;
 
 	machine = devm_kzalloc(piDev_g.dev, sizeof(*machine), GFP_KERNEL);
 	if (!machine)
@@ -544,8 +835,27 @@ int revpi_compact_probe(struct platform_device *pdev)
 	piDev_g.machine = machine;
 
 	machine->config = revpi_compact_config_g;
+	machine->io_cycle = REVPI_COMPACT_IO_CYCLE;
+	if (picontrol_compact_cycle_duration) {
+		if (picontrol_compact_cycle_duration < REVPI_COMPACT_IO_MIN_CYCLE ||
+		    picontrol_compact_cycle_duration > REVPI_COMPACT_IO_MAX_CYCLE) {
+			pr_warn("Invalid compact cycle duration %u specified (min=%u, max=%u)\n",
+				picontrol_compact_cycle_duration,
+				REVPI_COMPACT_IO_MIN_CYCLE,
+				REVPI_COMPACT_IO_MAX_CYCLE);
+		} else {
+			machine->io_cycle = picontrol_compact_cycle_duration;
+			pr_info("Using compact cycle duration %u\n",
+				machine->io_cycle);
+		}
+	}
 	machine->ain_should_reset = true;
 	init_completion(&machine->ain_reset);
+	spin_lock_init(&machine->ain_config_lock);
+	for (i = 0; i < ARRAY_SIZE(machine->ain_sched); i++) {
+		machine->ain_sched[i].period = REVPI_COMPACT_AIN_PERIOD;
+		machine->ain_filter_config[i].oversampling = 1;
+	}
 	gpiod_add_lookup_table(&revpi_compact_gpios);
 	seqlock_init(&machine->stats.lock);
 
@@ -679,6 +989,30 @@ int revpi_compact_probe(struct platform_device *pdev)
 		goto err_stop_ain_thread;
 	}
 
+	ret = device_create_file(piDev_g.dev, &dev_attr_ain_schedule);
+	if (ret) {
+		pr_err("failed to create device file: %i\n", ret);
+		goto err_remove_lost_cycles;
+	}
+
+	ret = device_create_file(piDev_g.dev, &dev_attr_ain_filter);
+	if (ret) {
+		pr_err("failed to create device file: %i\n", ret);
+		goto err_remove_ain_schedule;
+	}
+
+	ret = device_create_file(piDev_g.dev, &dev_attr_io_cycle_duration);
+	if (ret) {
+		pr_err("failed to create device file: %i\n", ret);
+		goto err_remove_ain_filter;
+	}
+
+	ret = device_create_file(piDev_g.dev, &dev_attr_last_io_cycle);
+	if (ret) {
+		pr_err("failed to create device file: %i\n", ret);
+		goto err_remove_io_cycle_duration;
+	}
+
 	revpi_compact_reset();
 
 	wake_up_process(machine->io_thread);
@@ -686,6 +1020,14 @@ int revpi_compact_probe(struct platform_device *pdev)
 
 	return 0;
 
+err_remove_io_cycle_duration:
+	device_remove_file(piDev_g.dev, &dev_attr_io_cycle_duration);
+err_remove_ain_filter:
+	device_remove_file(piDev_g.dev, &dev_attr_ain_filter);
+err_remove_ain_schedule:
+	device_remove_file(piDev_g.dev, &dev_attr_ain_schedule);
+err_remove_lost_cycles:
+	device_remove_file(piDev_g.dev, &dev_attr_lost_cycles);
 err_stop_ain_thread:
 	kthread_stop(machine->ain_thread);
 err_stop_io_thread:
@@ -721,6 +1063,10 @@ void revpi_compact_remove(struct platform_device *pdev)
 	if (!machine)
 		return;
 
+	device_remove_file(piDev_g.dev, &dev_attr_last_io_cycle);
+	device_remove_file(piDev_g.dev, &dev_attr_io_cycle_duration);
+	device_remove_file(piDev_g.dev, &dev_attr_ain_filter);
+	device_remove_file(piDev_g.dev, &dev_attr_ain_schedule);
 	device_remove_file(piDev_g.dev, &dev_attr_lost_cycles);
 
 	if (!IS_ERR_OR_NULL(machine->ain_thread))
@@ -749,12 +1095,12 @@ int revpi_compact_reset(void)
 	int ret;
 
 	/* disallow access to process image while offsets are changed */
-	my_rt_mutex_lock(&piDev_g.lockPI);
+	revpi_lock_pi(PICONTROL_LOCK_USER);
 	revpi_compact_adjust_config();
 	memset(&image->usr, 0, sizeof(image->usr));
 	if (piDev_g.ent)
 		revpi_set_defaults(piDev_g.ai8uPI, piDev_g.ent);
-	rt_mutex_unlock(&piDev_g.lockPI);
+	revpi_unlock_pi();
 
 	machine->config = revpi_compact_config_g;
 
@@ -763,7 +1109,9 @@ int revpi_compact_reset(void)
 		pr_err("cannot set din debounce\n");
 
 	reinit_completion(&machine->ain_reset);
-	smp_store_release(&machine->ain_should_reset, true);
+	spin_lock(&machine->ain_config_lock);
+	machine->ain_should_reset = true;
+	spin_unlock(&machine->ain_config_lock);
 	wake_up_process(machine->ain_thread);
 	wait_for_completion(&machine->ain_reset);
 
@@ -71,6 +71,10 @@ typedef struct _SRevPiCompactImage {
 
 struct revpi_compact_stats {
 	u64 lost_cycles;
+	/* achieved period of the io thread */
+	unsigned int last_io_cycle; /* usecs */
+	/* achieved sample rate of the analog inputs in mHz */
+	unsigned int ain_rate[8];
 	seqlock_t lock;
 };
 
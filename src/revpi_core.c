@@ -11,6 +11,10 @@
 
 #include "revpi_common.h"
 #include "revpi_core.h"
+#include "revpi_cycle.h"
+#include "revpi_gate.h"
+#include "revpi_recorder.h"
+#include "revpi_replay.h"
 
 #define CREATE_TRACE_POINTS
 #include "picontrol_trace.h"
@@ -103,6 +107,73 @@ void revpi_core_gate_connected(SDevice *revpi_dev, bool connected)
 		RevPiDevice_setStatus(status, 0);
 }
 
+/**
+ * revpi_core_image_fetch() - take the outputs of all modules for this cycle
+ *
+ * Called by the io thread before the data exchange. The process image is
+ * locked once, the modules read their outputs from piCore_g.cycle_image.
+ */
+void revpi_core_image_fetch(void)
+{
+	SDevice *dev;
+	int i;
+
+	bitmap_zero(piCore_g.cycle_inputs, REV_PI_DEV_CNT_MAX);
+
+	revpi_io_lock_pi();
+	for (i = 0; i < RevPiDevice_getDevCnt(); i++) {
+		dev = RevPiDevice_getDev(i);
+		if (!dev->i8uActive)
+			continue;
+		memcpy(piCore_g.cycle_image + dev->i16uOutputOffset,
+		       piDev_g.ai8uPI + dev->i16uOutputOffset,
+		       dev->sId.i16uFBS_OutputLength);
+	}
+	revpi_io_unlock_pi();
+}
+
+/**
+ * revpi_core_image_publish() - store the inputs of this cycle
+ * @core_image: exchange the process image of the RevPi itself as well
+ *
+ * Called by the io thread after the data exchange. The inputs the modules
+ * wrote to piCore_g.cycle_image and the data received by the gateways are
+ * copied to the process image with a single lock.
+ */
+void revpi_core_image_publish(bool core_image)
+{
+	SRevPiProcessImage *img;
+	SDevice *dev;
+	int i;
+
+	revpi_io_lock_pi();
+	for_each_set_bit(i, piCore_g.cycle_inputs, REV_PI_DEV_CNT_MAX) {
+		dev = RevPiDevice_getDev(i);
+		memcpy(piDev_g.ai8uPI + dev->i16uInputOffset,
+		       piCore_g.cycle_image + dev->i16uInputOffset,
+		       dev->sId.i16uFBS_InputLength);
+	}
+	bitmap_zero(piCore_g.cycle_inputs, REV_PI_DEV_CNT_MAX);
+
+	if (core_image) {
+		img = (SRevPiProcessImage *)(piDev_g.ai8uPI +
+					     RevPiDevice_getCoreOffset());
+		img->drv = piCore_g.image.drv;
+		/*
+		 * The size of _SRevPiProcessImage.usr was 5 bytes before the
+		 * field rgb_leds was introduced with Connect 4. In order to
+		 * maintain compatibility with existing devices, only the
+		 * output length of the RevPi is copied.
+		 */
+		memcpy(&piCore_g.image.usr, &img->usr,
+		       RevPiDevice_getDev(0)->sId.i16uFBS_OutputLength);
+	}
+
+	if (piDev_g.revpi_gate_supported)
+		revpi_gate_sync_image();
+	revpi_io_unlock_pi();
+}
+
 static inline enum hrtimer_restart wake_up_sleeper(struct hrtimer *timer)
 {
 	struct picontrol_cycle *cycle;
@@ -116,20 +187,32 @@ static int piIoThread(void *data)
 {
 	struct picontrol_cycle *cycle = &piDev_g.cycle;
 	unsigned int needed_cycles;
+	unsigned int phase_error = 0;
+	unsigned int last_duration = 0;
+	unsigned int last_phase = 0;
+	unsigned int overruns = 0;
+	bool overrun_event;
 	unsigned int last_cycle;
 	unsigned int cycle_ref;
+	unsigned int duration = 0;
+	unsigned int phase;
+	unsigned int seq;
 	ktime_t cycle_duration;
+	bool budget = false;
+	bool aligned;
 	ktime_t time;
 	ktime_t now;
 	s64 tDiff;
 
+	aligned = cycle->clock != CLOCK_MONOTONIC;
+
 	/* Note: we use this timer for both, a fixed cycle interval length and
 	   measurement of the cycle time */
 #if KERNEL_VERSION(6, 13, 0) > LINUX_VERSION_CODE
-	hrtimer_init(&cycle->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	hrtimer_init(&cycle->timer, cycle->clock, HRTIMER_MODE_ABS);
 	cycle->timer.function = wake_up_sleeper;
 #else
-	hrtimer_setup(&cycle->timer, wake_up_sleeper, CLOCK_MONOTONIC,
+	hrtimer_setup(&cycle->timer, wake_up_sleeper, cycle->clock,
 		      HRTIMER_MODE_ABS);
 #endif
 	init_completion(&cycle->timer_expired);
@@ -147,46 +230,53 @@ static int piIoThread(void *data)
 	while (!kthread_should_stop()) {
 		trace_picontrol_cycle_start(piCore_g.cycle_num);
 
-		if (PiBridgeMaster_Run() < 0)
-			break;
-
-		time = now;
-		now = hrtimer_cb_get_time(&cycle->timer);
-
-		last_cycle = ktime_to_us(ktime_sub(now, time));
-
-		/* On process image store cycle time in msec */
-		piCore_g.image.drv.i8uIOCycle = last_cycle / 1000;
+		/*
+		 * A budget only makes sense for a fixed cycle duration. The
+		 * duration is the one the timer was forwarded by at the end
+		 * of the previous cycle.
+		 */
+		if (budget && duration > PICONTROL_CYCLE_MIN_DURATION)
+			piCore_g.cycle_deadline = ktime_add_us(ktime_get(),
+				duration - PICONTROL_CYCLE_BUDGET_RESERVE);
+		else
+			piCore_g.cycle_deadline = 0;
 
+		/*
+		 * Check the timeouts before the data exchange, so that the
+		 * safe state is sent in the same cycle which detects it.
+		 */
 		if (piDev_g.tLastOutput1 != piDev_g.tLastOutput2) {
 			tDiff = ktime_to_ns(ktime_sub(piDev_g.tLastOutput1, piDev_g.tLastOutput2));
 			tDiff = tDiff << 1;	// multiply by 2
-			if (ktime_to_ns(ktime_sub(now, piDev_g.tLastOutput1)) > tDiff && isRunning()) {
+			if (ktime_to_ns(ktime_sub(ktime_get(), piDev_g.tLastOutput1)) > tDiff && isRunning()) {
 				int i;
 				// the outputs were not written by logiCAD for more than twice the normal period
 				// the logiRTS must have been stopped or crashed
-				// -> set all outputs to 0
-				pr_info("logiRTS timeout, set all output to 0\n");
+				// -> set all outputs to their safe state
+				pr_info("logiRTS timeout, set all output to safe state\n");
+				revpi_recorder_trigger(PICONTROL_RECORDER_TRIGGER_LOGIRTS);
 				if (!test_bit(PICONTROL_DEV_FLAG_STOP_IO,
 					&piDev_g.flags)) {
-					my_rt_mutex_lock(&piDev_g.lockPI);
+					revpi_safe_state_detected();
+					revpi_io_lock_pi();
 					for (i = 0; i < piDev_g.cl->i16uNumEntries; i++) {
 						uint16_t len = piDev_g.cl->ent[i].i16uLength;
 						uint16_t addr = piDev_g.cl->ent[i].i16uAddr;
 
 						if (len >= 8) {
 							len /= 8;
-							memset(piDev_g.ai8uPI + addr, 0, len);
+							revpi_safe_state_apply(addr, len);
 						} else {
 							uint8_t val;
 							uint8_t mask = piDev_g.cl->ent[i].i8uBitMask;
 
 							val = piDev_g.ai8uPI[addr];
 							val &= ~mask;
+							val |= revpi_safe_state_byte(addr) & mask;
 							piDev_g.ai8uPI[addr] = val;
 						}
 					}
-					rt_mutex_unlock(&piDev_g.lockPI);
+					revpi_io_unlock_pi();
 				}
 				piDev_g.tLastOutput1 = ktime_set(0, 0);
 				piDev_g.tLastOutput2 = ktime_set(0, 0);
@@ -195,18 +285,64 @@ static int piIoThread(void *data)
 
 		revpi_check_timeout();
 
-		cycle_duration = ns_to_ktime(piControl_get_cycle_duration() *
-					     NSEC_PER_USEC);
+		if (revpi_replay_active())
+			revpi_replay_run();
+		else if (PiBridgeMaster_Run() < 0)
+			break;
+
+		revpi_safe_state_sent();
+		revpi_recorder_record(piCore_g.cycle_num);
+		revpi_io_lock_stats();
+
+		time = now;
+		now = hrtimer_cb_get_time(&cycle->timer);
+
+		last_cycle = ktime_to_us(ktime_sub(now, time));
+
+		/* On process image store cycle time in msec */
+		piCore_g.image.drv.i8uIOCycle = last_cycle / 1000;
+
+		do {
+			seq = read_seqbegin(&cycle->lock);
+			duration = cycle->duration;
+			phase = cycle->phase;
+			budget = cycle->budget;
+		} while (read_seqretry(&cycle->lock, seq));
 
-		needed_cycles = hrtimer_forward_now(&cycle->timer,
-						    cycle_duration);
+		cycle_duration = ns_to_ktime(duration * NSEC_PER_USEC);
+
+		if (aligned && (duration != last_duration ||
+				phase != last_phase)) {
+			/*
+			 * (Re)align the cycle start to the cycle clock. After
+			 * that forwarding the timer by the cycle duration
+			 * keeps the phase.
+			 */
+			hrtimer_set_expires(&cycle->timer,
+				picontrol_cycle_align(hrtimer_cb_get_time(&cycle->timer),
+						      duration, phase));
+			last_duration = duration;
+			last_phase = phase;
+			needed_cycles = 1;
+		} else {
+			needed_cycles = hrtimer_forward_now(&cycle->timer,
+							    cycle_duration);
+		}
 		if (needed_cycles == 0) /* should never happen (TM) */
 			pr_warn("%s: premature cycle\n", current->comm);
 
 		if (piCore_g.data_exchange_running) {
+			overrun_event = false;
+
 			write_seqlock(&cycle->lock);
 			cycle->last = last_cycle;
 
+			if (aligned) {
+				cycle->last_phase_error = phase_error;
+				if (cycle->max_phase_error < phase_error)
+					cycle->max_phase_error = phase_error;
+			}
+
 			if (cycle->min > last_cycle)
 				cycle->min = last_cycle;
 
@@ -228,7 +364,15 @@ static int piIoThread(void *data)
 					cycle->exceeded++;
 					trace_picontrol_cycle_exceeded(last_cycle,
 						cycle_ref);
+					overruns++;
+				} else {
+					overruns = 0;
 				}
+
+				/* notify clients once per series of overruns */
+				if (cycle->overrun_threshold &&
+				    overruns == cycle->overrun_threshold)
+					overrun_event = true;
 			}
 
 			if (needed_cycles > 1 &&
@@ -239,13 +383,49 @@ static int piIoThread(void *data)
 
 			write_sequnlock(&cycle->lock);
 
+			if (overrun_event)
+				piControl_queue_event(KB_EVENT_CYCLE_OVERRUN);
+
 			trace_picontrol_cycle_end(piCore_g.cycle_num, last_cycle);
 			piCore_g.cycle_num++;
 		}
 
+		/* a replay runs as fast as possible, the cycle is realigned after it */
+		if (revpi_replay_active()) {
+			hrtimer_set_expires(&cycle->timer,
+					    hrtimer_cb_get_time(&cycle->timer));
+			last_duration = 0;
+			cond_resched();
+			continue;
+		}
+
 		reinit_completion(&cycle->timer_expired);
 		hrtimer_start_expires(&cycle->timer, HRTIMER_MODE_ABS);
-		wait_for_completion(&cycle->timer_expired);
+
+		if (!aligned) {
+			wait_for_completion(&cycle->timer_expired);
+			continue;
+		}
+
+		/*
+		 * The realtime and TAI clock may be set backwards, which
+		 * would delay the expiry of the timer by the same amount.
+		 * Do not wait longer than two cycles and realign instead.
+		 */
+		if (!wait_for_completion_timeout(&cycle->timer_expired,
+				usecs_to_jiffies(2 * duration) + 1)) {
+			hrtimer_cancel(&cycle->timer);
+			pr_warn("%s: cycle clock was set, realigning\n",
+				current->comm);
+			last_duration = 0;
+			phase_error = 0;
+			continue;
+		}
+
+		phase_error = ktime_to_ns(ktime_sub(hrtimer_cb_get_time(&cycle->timer),
+						    hrtimer_get_expires(&cycle->timer)));
+		trace_picontrol_cycle_phase_error(piCore_g.cycle_num,
+						  phase_error);
 	}
 
 	hrtimer_cancel(&cycle->timer);
@@ -504,5 +684,6 @@ err_deinit_gpios:
 void revpi_core_remove(struct platform_device *pdev)
 {
 	kthread_stop(piCore_g.pIoThread);
+	revpi_gate_exit();
 	deinit_gpios();
 }
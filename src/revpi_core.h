@@ -18,6 +18,8 @@
 #define PICONTROL_CYCLE_MIN_DURATION		500
 #define PICONTROL_DEFAULT_CYCLE_DURATION	PICONTROL_CYCLE_MIN_DURATION /* as fast as possible */
 #define PICONTROL_CYCLE_MAX_DURATION		45000 /* usecs */
+/* time reserved at the end of a budgeted cycle for the non-deferrable work */
+#define PICONTROL_CYCLE_BUDGET_RESERVE		100 /* usecs */
 
 typedef enum {
 	piBridgeStop = 0,
@@ -94,7 +96,17 @@ typedef struct _SRevPiCore {
 	// piIO thread
 	struct task_struct *pIoThread;
 
+	/*
+	 * Copy of the process image the modules exchange their data with,
+	 * io thread only. The outputs are fetched at the start of the cycle,
+	 * the inputs of the modules in cycle_inputs are published at its end.
+	 */
+	u8 cycle_image[KB_PI_LEN];
+	DECLARE_BITMAP(cycle_inputs, REV_PI_DEV_CNT_MAX);
+
 	u64 cycle_num;
+	/* End of the budget for the current cycle, 0 if there is no budget */
+	ktime_t cycle_deadline;
 	/* Number of communication errors */
 	u32 comm_errors;
 	bool data_exchange_running;
@@ -102,6 +114,14 @@ typedef struct _SRevPiCore {
 
 extern SRevPiCore piCore_g;
 
+/* Called by the io thread when a module wrote its inputs to cycle_image */
+static inline void revpi_core_inputs_updated(u8 devno)
+{
+	__set_bit(devno, piCore_g.cycle_inputs);
+}
+
+void revpi_core_image_fetch(void);
+void revpi_core_image_publish(bool core_image);
 u8 revpi_core_find_gate(struct net_device *netdev, u16 module_type);
 void revpi_core_gate_connected(SDevice *revpi_dev, bool connected);
 int revpi_core_probe(struct platform_device *pdev);
@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+
+// revpi_cycle.c - alignment of the io cycle to the cycle clock
+//
+// Kept apart from the io thread so that it can be tested in userspace, see
+// tools/cycle_align_test.c.
+
+#include <linux/math64.h>
+
+#include "revpi_cycle.h"
+
+/**
+ * picontrol_cycle_align() - get the next aligned cycle start
+ * @now: current time on the cycle clock
+ * @duration: cycle duration in usecs
+ * @phase: phase offset in usecs
+ *
+ * Return the first point in time after @now which is a multiple of @duration
+ * plus @phase on the cycle clock. Two systems with synchronized clocks (e.g.
+ * via PTP) and the same settings thus start their cycles at the same time.
+ */
+ktime_t picontrol_cycle_align(ktime_t now, unsigned int duration,
+			      unsigned int phase)
+{
+	s64 period = (s64) duration * NSEC_PER_USEC;
+	s64 offset = (s64) (phase % duration) * NSEC_PER_USEC;
+	s64 n;
+
+	n = div64_s64(ktime_to_ns(now) - offset, period) + 1;
+
+	return ns_to_ktime(n * period + offset);
+}
@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: GPL-2.0-only
+ * SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+ *
+ * Alignment of the io cycle to the cycle clock
+ */
+
+#ifndef _REVPI_CYCLE_H
+#define _REVPI_CYCLE_H
+
+#include <linux/ktime.h>
+
+ktime_t picontrol_cycle_align(ktime_t now, unsigned int duration,
+			      unsigned int phase);
+
+#endif /* _REVPI_CYCLE_H */
@@ -1,19 +1,20 @@
 // SPDX-License-Identifier: GPL-2.0-only
 // SPDX-FileCopyrightText: 2020-2024 KUNBUS GmbH
 
-#include <linux/cpufreq.h>
 #include <linux/delay.h>
 #include <linux/iio/consumer.h>
 #include <linux/iio/iio.h>
+#include <linux/interrupt.h>
 #include <linux/kthread.h>
 #include <linux/sched.h>
-#include <linux/thermal.h>
 #include <linux/types.h>
 #include <linux/version.h>
+#include <linux/wait.h>
 #include <linux/platform_device.h>
 
 #include "piControlMain.h"
 #include "process_image.h"
+#include "revpi_ain_filter.h"
 #include "revpi_common.h"
 #include "revpi_flat.h"
 #include "RevPiDevice.h"
@@ -83,8 +84,49 @@ struct revpi_flat {
 	struct gpio_descs *dout;
 	struct iio_channel ain;
 	struct iio_channel aout;
+	/*
+	 * The dout thread sleeps until the outputs in the process image are
+	 * written or the button changes. Without a button irq it polls.
+	 */
+	wait_queue_head_t dout_wq;
+	bool dout_pending;
+	int button_irq;
+	/* filter of the analog input */
+	struct revpi_ain_filter_config ain_filter_config;
+	bool ain_filter_changed;
+	spinlock_t ain_config_lock;
+	/* owned by the ain thread */
+	struct revpi_ain_filter ain_filter;
 };
 
+/* Copy the inputs to the process image, must be called with lockPI held */
+static void revpi_flat_publish_drv(struct revpi_flat *flat)
+{
+	struct revpi_flat_image *usr_image;
+
+	usr_image = (struct revpi_flat_image *) piDev_g.ai8uPI;
+	usr_image->drv = flat->image.drv;
+}
+
+static void revpi_flat_wake_dout(struct revpi_flat *flat)
+{
+	WRITE_ONCE(flat->dout_pending, true);
+	wake_up(&flat->dout_wq);
+}
+
+/* Called after the outputs in the process image may have been written */
+void revpi_flat_outputs_written(void)
+{
+	revpi_flat_wake_dout(piDev_g.machine);
+}
+
+static irqreturn_t revpi_flat_button_irq(int irq, void *data)
+{
+	revpi_flat_wake_dout(data);
+
+	return IRQ_HANDLED;
+}
+
 static int revpi_flat_poll_dout(void *data)
 {
 	struct revpi_flat *flat = (struct revpi_flat *) data;
@@ -92,13 +134,23 @@ static int revpi_flat_poll_dout(void *data)
 	struct revpi_flat_image *usr_image;
 	int dout_val = -1;
 	int aout_val = -1;
+	u16 leds;
 	int raw_out;
 
 	usr_image = (struct revpi_flat_image *) piDev_g.ai8uPI;
 	while (!kthread_should_stop()) {
-		my_rt_mutex_lock(&piDev_g.lockPI);
+		if (flat->button_irq < 0)
+			usleep_range(100, 150);
+		else
+			wait_event_interruptible(flat->dout_wq,
+						 READ_ONCE(flat->dout_pending) ||
+						 kthread_should_stop());
+		/* a write from now on is picked up by the next wakeup */
+		WRITE_ONCE(flat->dout_pending, false);
+
+		revpi_lock_pi(PICONTROL_LOCK_IO);
 		image->drv.button = gpiod_get_value_cansleep(flat->button_desc);
-		usr_image->drv = image->drv;
+		revpi_flat_publish_drv(flat);
 
 		if (usr_image->usr.dout != image->usr.dout)
 			dout_val = usr_image->usr.dout;
@@ -107,13 +159,16 @@ static int revpi_flat_poll_dout(void *data)
 			aout_val = usr_image->usr.aout;
 
 		image->usr = usr_image->usr;
-		rt_mutex_unlock(&piDev_g.lockPI);
+		leds = image->usr.leds;
+		revpi_unlock_pi();
 
 		if (dout_val != -1) {
 			gpiod_set_value_cansleep(flat->digout, !!dout_val);
 			dout_val = -1;
 		}
 
+		revpi_leds_set(leds);
+
 		if (aout_val != -1) {
 			int ret;
 
@@ -125,26 +180,52 @@ static int revpi_flat_poll_dout(void *data)
 				dev_err(piDev_g.dev, "failed to write value to "
 					"analog ouput: %i\n", ret);
 
+			revpi_lock_pi(PICONTROL_LOCK_IO);
 			assign_bit_in_byte(REVPI_FLAT_AOUT_TX_ERR,
 					   &image->drv.aout_status, ret < 0);
+			revpi_flat_publish_drv(flat);
+			revpi_unlock_pi();
 			aout_val = -1;
 		}
-
-		usleep_range(100, 150);
 	}
 
 	return 0;
 }
 
+static void revpi_flat_reset_ain_filter(struct revpi_flat *flat)
+{
+	struct revpi_ain_filter_config config;
+
+	spin_lock(&flat->ain_config_lock);
+	config = flat->ain_filter_config;
+	flat->ain_filter_changed = false;
+	spin_unlock(&flat->ain_config_lock);
+
+	revpi_ain_filter_init(&flat->ain_filter, &config);
+}
+
 static int revpi_flat_handle_ain(struct revpi_flat *flat, bool mode_current)
 {
 	struct revpi_flat_image *image = &flat->image;
+	unsigned int oversampling = flat->ain_filter.config.oversampling;
 	unsigned long long ain_val;
+	unsigned int n;
 	int raw_val;
-	int ret;
-
+	s64 sum = 0;
+	int ret = 0;
+
+	/* average over the configured number of conversions */
+	for (n = 0; n < oversampling; n++) {
+		if (n)
+			usleep_range(REVPI_FLAT_AIN_DELAY,
+				     REVPI_FLAT_AIN_DELAY + 10);
+
+		ret = iio_read_channel_raw(&flat->ain, &raw_val);
+		if (ret < 0)
+			break;
+		sum += raw_val;
+	}
 
-	ret = iio_read_channel_raw(&flat->ain, &raw_val);
 	assign_bit_in_byte(REVPI_FLAT_AIN_TX_ERR, &image->drv.ain_status,
 			   ret < 0);
 	if (ret < 0) {
@@ -152,6 +233,10 @@ static int revpi_flat_handle_ain(struct revpi_flat *flat, bool mode_current)
 			"channel: %i\n", ret);
 		return ret;
 	}
+
+	raw_val = (int) div_s64(sum, oversampling);
+	raw_val = revpi_ain_filter_apply(&flat->ain_filter, raw_val);
+
 	/* AIN value in mV = ((raw * 12.5V) >> 21 bit) + 6.25V */
 	ain_val = shift_right((s64) raw_val * 12500, 21) + 6250;
 
@@ -163,9 +248,10 @@ static int revpi_flat_handle_ain(struct revpi_flat *flat, bool mode_current)
 
 	ain_val = (int) div_s64(ain_val, 1000000000LL);
 
-	my_rt_mutex_lock(&piDev_g.lockPI);
+	revpi_lock_pi(PICONTROL_LOCK_IO);
 	image->drv.ain = ain_val;
-	rt_mutex_unlock(&piDev_g.lockPI);
+	revpi_flat_publish_drv(flat);
+	revpi_unlock_pi();
 
 	return 0;
 }
@@ -175,13 +261,18 @@ static int revpi_flat_poll_ain(void *data)
 	struct revpi_flat *flat = (struct revpi_flat *) data;
 	struct revpi_flat_image *image = &flat->image;
 	bool ain_mode_current = false;
-	u16 prev_leds = 0;
-	int temperature;
-	int freq;
-	u16 leds;
+	bool prev_mode_current = false;
 	int ret;
 
+	revpi_flat_reset_ain_filter(flat);
+
 	while (!kthread_should_stop()) {
+		/* raw values of the other mode must not be mixed in */
+		if (smp_load_acquire(&flat->ain_filter_changed) ||
+		    ain_mode_current != prev_mode_current)
+			revpi_flat_reset_ain_filter(flat);
+		prev_mode_current = ain_mode_current;
+
 		ret = revpi_flat_handle_ain(flat, ain_mode_current);
 		if (ret)
 			msleep(REVPI_FLAT_AIN_POLL_INTERVAL);
@@ -190,38 +281,60 @@ static int revpi_flat_poll_ain(void *data)
 		 * value.
 		 */
 		usleep_range(REVPI_FLAT_AIN_DELAY, REVPI_FLAT_AIN_DELAY + 10);
-		/* read cpu temperature */
-		if (piDev_g.thermal_zone != NULL) {
-			ret = thermal_zone_get_temp(piDev_g.thermal_zone,
-						    &temperature);
-			if (ret)
-				dev_err(piDev_g.dev,"Failed to get cpu "
-					"temperature");
-		}
-
-		/*
-		   Get the CPU clock from CPU0 in kHz
-		   and divide it down to MHz.
-		*/
-		freq = cpufreq_quick_get(0);
-
-		my_rt_mutex_lock(&piDev_g.lockPI);
-		if ((piDev_g.thermal_zone != NULL) && !ret)
-			image->drv.cpu_temp = temperature / 1000;
-		image->drv.cpu_freq = freq / 10;
-		leds = image->usr.leds;
+		/* sampled by revpi_housekeeping_work() */
+		revpi_lock_pi(PICONTROL_LOCK_IO);
+		image->drv.cpu_temp = READ_ONCE(piDev_g.cpu_temperature) / 1000;
+		image->drv.cpu_freq = READ_ONCE(piDev_g.cpu_frequency) / 10;
+		revpi_flat_publish_drv(flat);
 		ain_mode_current = !!image->usr.ain_mode_current;
-		rt_mutex_unlock(&piDev_g.lockPI);
-
-		if (prev_leds != leds)
-			revpi_led_trigger_event(prev_leds, leds);
-
-		prev_leds = leds;
+		revpi_unlock_pi();
 	}
 
 	return 0;
 }
 
+static ssize_t ain_filter_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct revpi_flat *flat = piDev_g.machine;
+	struct revpi_ain_filter_config config;
+
+	spin_lock(&flat->ain_config_lock);
+	config = flat->ain_filter_config;
+	spin_unlock(&flat->ain_config_lock);
+
+	return revpi_ain_filter_show(buf, 0, 0, &config, &flat->ain_filter);
+}
+
+static ssize_t ain_filter_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct revpi_flat *flat = piDev_g.machine;
+	struct revpi_ain_filter_config config;
+	unsigned int chan;
+	int ret;
+
+	ret = revpi_ain_filter_parse(buf, &chan, &config);
+	if (ret)
+		return ret;
+
+	/* the flat has a single analog input */
+	if (chan)
+		return -EINVAL;
+
+	spin_lock(&flat->ain_config_lock);
+	flat->ain_filter_config = config;
+	spin_unlock(&flat->ain_config_lock);
+
+	/* the ain thread restarts the filter before the next sample */
+	smp_store_release(&flat->ain_filter_changed, true);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(ain_filter);
+
 static int revpi_flat_match_iio_name(struct device *dev, const void *data)
 {
 	return !strcmp(data, dev_to_iio_dev(dev)->name);
@@ -279,11 +392,13 @@ static void revpi_flat_adjust_config(void)
 
 static void revpi_flat_set_defaults(void)
 {
-	my_rt_mutex_lock(&piDev_g.lockPI);
+	revpi_lock_pi(PICONTROL_LOCK_USER);
 	memset(piDev_g.ai8uPI, 0, sizeof(piDev_g.ai8uPI));
 	if (piDev_g.ent)
 		revpi_set_defaults(piDev_g.ai8uPI, piDev_g.ent);
-	rt_mutex_unlock(&piDev_g.lockPI);
+	revpi_unlock_pi();
+
+	revpi_flat_outputs_written();
 }
 
 int revpi_flat_reset(void)
@@ -310,6 +425,9 @@ int revpi_flat_probe(struct platform_device *pdev)
 		return -ENOMEM;
 
 	piDev_g.machine = flat;
+	spin_lock_init(&flat->ain_config_lock);
+	flat->ain_filter_config.oversampling = 1;
+	init_waitqueue_head(&flat->dout_wq);
 
 	flat->digout = gpio_to_desc(REVPI_FLAT_RELAIS_GPIO);
 	if (!flat->digout) {
@@ -390,6 +508,25 @@ int revpi_flat_probe(struct platform_device *pdev)
 		goto err_stop_ain_thread;
 	}
 
+	ret = device_create_file(piDev_g.dev, &dev_attr_ain_filter);
+	if (ret) {
+		dev_err(piDev_g.dev, "failed to create device file: %i\n",
+			ret);
+		goto err_stop_ain_thread;
+	}
+
+	flat->button_irq = gpiod_to_irq(flat->button_desc);
+	if (flat->button_irq >= 0) {
+		ret = request_irq(flat->button_irq, revpi_flat_button_irq,
+				  IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+				  "piControl button", flat);
+		if (ret)
+			flat->button_irq = ret;
+	}
+	if (flat->button_irq < 0)
+		dev_warn(piDev_g.dev, "no irq for button, polling outputs: "
+			 "%i\n", flat->button_irq);
+
 	revpi_flat_reset();
 
 	wake_up_process(flat->dout_thread);
@@ -413,6 +550,9 @@ void revpi_flat_remove(struct platform_device *pdev)
 {
 	struct revpi_flat *flat = (struct revpi_flat *) piDev_g.machine;
 
+	if (flat->button_irq >= 0)
+		free_irq(flat->button_irq, flat);
+	device_remove_file(piDev_g.dev, &dev_attr_ain_filter);
 	kthread_stop(flat->ain_thread);
 	kthread_stop(flat->dout_thread);
 	iio_device_put(flat->aout.indio_dev);
@@ -10,5 +10,6 @@
 int revpi_flat_probe(struct platform_device *pdev);
 void revpi_flat_remove(struct platform_device *pdev);
 int revpi_flat_reset(void);
+void revpi_flat_outputs_written(void);
 
 #endif /* _REVPI_FLAT_H */
@@ -7,20 +7,31 @@
 #include <linux/netfilter.h>
 
 #include "ModGateComError.h"
+#include "revpi_common.h"
 #include "revpi_core.h"
 #include "revpi_gate.h"
 
 #define ETH_P_KUNBUSGW	0x419C		/* KUNBUS Gateway [ NOT AN OFFICIALLY REGISTERED ID ] */
-#define MG_AL_TIMEOUT	msecs_to_jiffies(80)
-#define MG_AL_SEND	msecs_to_jiffies(20)
+/* default and limits of the timeout and send interval in msecs */
+#define MG_AL_TIMEOUT	80
+#define MG_AL_SEND	20
+#define MG_AL_SEND_MIN	1
+#define MG_AL_SEND_MAX	1000
+#define MG_AL_TIMEOUT_MAX	10000
 #define KS8851_FIFO_SZ	(12 * SZ_1K)
+/* max number of packets pending for revpi_gate_ctrl_work */
+#define REVPI_GATE_CTRLQ_LEN	32
 
 static LIST_HEAD(revpi_gate_connections);
+static LIST_HEAD(revpi_gate_ports);
 static DEFINE_MUTEX(revpi_gate_lock);		/* serializes list add/del */
 DEFINE_STATIC_SRCU(revpi_gate_srcu);		/* protects list traversal */
 static DECLARE_WAIT_QUEUE_HEAD(revpi_gate_fini_wq);
-static struct sk_buff_head revpi_gate_rcvq;
-static struct task_struct *revpi_gate_rcv_thread;
+static struct sk_buff_head revpi_gate_ctrlq;	/* pending id packets */
+static struct work_struct revpi_gate_ctrl_work;
+/* packets queued or being processed by revpi_gate_ctrl_work */
+static atomic_t revpi_gate_ctrl_pending;
+static bool revpi_gate_stopping;
 
 static unsigned int revpi_gate_nf_hook(void *priv, struct sk_buff *skb,
 				       const struct nf_hook_state *state)
@@ -37,6 +48,57 @@ static const struct nf_hook_ops revpi_gate_nf_hook_ops = {
 	.priority = INT_MAX,
 };
 
+/**
+ * struct revpi_gate_stats - statistics of the gateway protocol
+ * @rx_frames: received data packets
+ * @tx_frames: sent data packets
+ * @lost: received packets missing according to the neighbor's counter
+ * @out_of_order: received packets with a counter older than expected
+ * @duplicates: data packets received twice
+ * @retransmissions: data packets sent because the neighbor was silent
+ * @timeouts: connections destroyed because the neighbor was silent
+ * @max_backlog: max number of sent packets not yet acked by the neighbor
+ * @last_rtt: time from sending a data packet until the neighbor acked it
+ * @max_rtt: max value of @last_rtt
+ */
+struct revpi_gate_stats {
+	u64 rx_frames;
+	u64 tx_frames;
+	u64 lost;
+	u64 out_of_order;
+	u64 duplicates;
+	u64 retransmissions;
+	u64 timeouts;
+	unsigned int max_backlog;
+	unsigned int last_rtt; /* usecs */
+	unsigned int max_rtt; /* usecs */
+};
+
+/**
+ * struct revpi_gate_port - network device over which a gateway is connected
+ * @list_node: node in @revpi_gate_ports list
+ * @name: name of the network device
+ * @conn: current connection on the network device, NULL if there is none
+ * @send_interval: a data packet is sent if the neighbor was silent for
+ *	this time (msecs)
+ * @timeout: the connection is destroyed if the neighbor was silent for
+ *	this time (msecs)
+ * @stats: statistics of the destroyed connections, protected by
+ *	revpi_gate_lock
+ *
+ * The settings and statistics are kept for the network device, so that they
+ * can be set before a connection exists and survive the connection being
+ * destroyed on timeout.
+ */
+struct revpi_gate_port {
+	struct list_head list_node;
+	char name[IFNAMSIZ];
+	struct revpi_gate_connection *conn;
+	unsigned int send_interval;
+	unsigned int timeout;
+	struct revpi_gate_stats stats;
+};
+
 /**
  * struct revpi_gate_connection - connection with a neighboring gateway
  * @list_node: node in @revpi_gate_connections list
@@ -56,6 +118,23 @@ static const struct nf_hook_ops revpi_gate_nf_hook_ops = {
  *	acked in next outgoing packet
  * @out_ctr: counter transmitted and incremented with every outgoing packet;
  *	acked by neighbor, allows for packet loss detection
+ * @lock: protects @state, the counters and the buffers below against
+ *	concurrent access by the receive path, the work items and the io cycle
+ * @in_buf: received data which was not yet copied into the process image
+ * @in_start: start of the range in @in_buf which is pending
+ * @in_end: end of the range in @in_buf which is pending
+ * @in_arrival: arrival time of the oldest pending data packet
+ * @in_pending: @in_buf contains data for the process image
+ * @out_buf: copy of the sent data, taken from the process image every cycle
+ * @coalesced: data packets which were merged with pending data
+ * @last_delay: time from the arrival of the oldest pending data packet until
+ *	it was copied into the process image (usecs)
+ * @max_delay: max value of @last_delay (usecs)
+ * @port: settings and statistics of the network device
+ * @tx_time: time the last data packet was sent, 0 if it was acked
+ * @stats: statistics of the connection, updated with @lock held, so the
+ *	receive path takes no lock of its own for them; added to those of
+ *	@port when the connection is destroyed
  */
 struct revpi_gate_connection {
 	struct list_head list_node;
@@ -71,8 +150,47 @@ struct revpi_gate_connection {
 	unsigned int out_len;
 	u8 in_ctr;
 	u8 out_ctr;
+	spinlock_t lock;
+	u8 in_buf[KB_PD_LEN];
+	unsigned int in_start;
+	unsigned int in_end;
+	ktime_t in_arrival;
+	bool in_pending;
+	u8 out_buf[KB_PD_LEN];
+	u64 coalesced;
+	unsigned int last_delay;
+	unsigned int max_delay;
+	struct revpi_gate_port *port;
+	ktime_t tx_time;
+	struct revpi_gate_stats stats;
 };
 
+static unsigned long revpi_gate_send_delay(struct revpi_gate_connection *conn)
+{
+	return msecs_to_jiffies(READ_ONCE(conn->port->send_interval));
+}
+
+static unsigned long revpi_gate_timeout(struct revpi_gate_connection *conn)
+{
+	return msecs_to_jiffies(READ_ONCE(conn->port->timeout));
+}
+
+static void revpi_gate_stats_add(struct revpi_gate_stats *sum,
+				 const struct revpi_gate_stats *stats)
+{
+	sum->rx_frames += stats->rx_frames;
+	sum->tx_frames += stats->tx_frames;
+	sum->lost += stats->lost;
+	sum->out_of_order += stats->out_of_order;
+	sum->duplicates += stats->duplicates;
+	sum->retransmissions += stats->retransmissions;
+	sum->timeouts += stats->timeouts;
+	sum->max_backlog = max(sum->max_backlog, stats->max_backlog);
+	if (stats->last_rtt)
+		sum->last_rtt = stats->last_rtt;
+	sum->max_rtt = max(sum->max_rtt, stats->max_rtt);
+}
+
 static const char *revpi_gate_state(MODGATE_AL_Status state)
 {
 	switch (state) {
@@ -107,6 +225,7 @@ static void revpi_gate_destroy_work(struct work_struct *work)
 	revpi_core_gate_connected(conn->revpi_dev, false);
 
 	mutex_lock(&revpi_gate_lock);
+	conn->port->conn = NULL;
 	list_del_rcu(&conn->list_node);
 	mutex_unlock(&revpi_gate_lock);
 	synchronize_srcu(&revpi_gate_srcu);
@@ -119,12 +238,19 @@ static void revpi_gate_destroy_work(struct work_struct *work)
 	cancel_delayed_work_sync(&conn->send_work);
 	cancel_delayed_work(&conn->destroy_work);
 
+	/* nothing updates the statistics of the connection anymore */
+	mutex_lock(&revpi_gate_lock);
+	revpi_gate_stats_add(&conn->port->stats, &conn->stats);
+	if (!revpi_gate_stopping)
+		conn->port->stats.timeouts++;
+	mutex_unlock(&revpi_gate_lock);
+
 	if (conn->revpi_dev &&
 	    !test_bit(PICONTROL_DEV_FLAG_STOP_IO, &piDev_g.flags)) {
 		conn->revpi_dev->i8uModuleState = FBSTATE_LINK;
-		rt_mutex_lock(&piDev_g.lockPI);
+		revpi_lock_pi(PICONTROL_LOCK_IO);
 		memset(conn->in, 0, conn->in_len);
-		rt_mutex_unlock(&piDev_g.lockPI);
+		revpi_unlock_pi();
 	}
 
 	if (conn->nf_hook_ops.dev)
@@ -145,7 +271,7 @@ static void revpi_gate_destroy_work(struct work_struct *work)
  *
  * Populate the Transport Layer fields, copy i8uACK and i8uCounter from @conn.
  * The out_ctr in @conn is incremented, so this must be called *after*
- * validating the i8uACK field in @rcv.
+ * validating the i8uACK field in @rcv and with the lock of @conn held.
  *
  * The caller is responsible for populating the payload and transmitting the
  * packet with dev_queue_xmit().
@@ -208,6 +334,8 @@ static struct sk_buff *revpi_gate_create_cyclicpd_packet(
 	(*al)->i16uOffset = 0;
 	(*al)->i16uDataLen = conn->out_len;
 
+	conn->tx_time = ktime_get();
+
 	return skb;
 }
 
@@ -232,40 +360,60 @@ static void revpi_gate_send_work(struct work_struct *work)
 	pr_debug("%s: sending data packet voluntarily\n",
 		dev->name);
 
+	spin_lock_bh(&conn->lock);
+	/* the connection was reset by an id request in the meantime */
+	if (conn->state != MODGATE_ST_ID_RESP) {
+		spin_unlock_bh(&conn->lock);
+		return;
+	}
 	skb = revpi_gate_create_cyclicpd_packet(conn, &al);
+	spin_unlock_bh(&conn->lock);
 	if (!skb)
 		return;
 
 	if (conn->revpi_dev &&
 	    !test_bit(PICONTROL_DEV_FLAG_STOP_IO, &piDev_g.flags)) {
-		rt_mutex_lock(&piDev_g.lockPI);
+		revpi_lock_pi(PICONTROL_LOCK_IO);
 		memcpy(al->i8uData, conn->out, conn->out_len);
-		rt_mutex_unlock(&piDev_g.lockPI);
+		revpi_unlock_pi();
 	} else {
 		memset(al->i8uData, 0, conn->out_len);
 	}
 
-	if (dev_queue_xmit(skb))
+	if (dev_queue_xmit(skb)) {
 		pr_err("%s: failed to transmit data packet\n", dev->name);
+		return;
+	}
+
+	spin_lock_bh(&conn->lock);
+	conn->stats.tx_frames++;
+	conn->stats.retransmissions++;
+	spin_unlock_bh(&conn->lock);
 }
 
 static int revpi_gate_process_cyclicpd(struct sk_buff *rcv,
 				       struct net_device *dev,
-				       struct revpi_gate_connection *conn)
+				       struct revpi_gate_connection *conn,
+				       ktime_t arrival)
 {
 	MODGATECOM_TransportLayer *rcv_tl;
 	MODGATECOM_CyclicPD *al, *rcv_al;
+	struct revpi_gate_stats *stats;
 	struct sk_buff *skb = NULL;
+	unsigned int rtt;
 	u8 backlog = 0;
 
 	if (!conn) {
 		pr_err("%s: received data packet without connection\n",
 		       dev->name);
 		goto drop;
-	} else if (conn->state != MODGATE_ST_ID_RESP) {
+	}
+
+	spin_lock(&conn->lock);
+	if (conn->state != MODGATE_ST_ID_RESP) {
 		pr_err("%s: received data packet while %s\n",
 		       dev->name, revpi_gate_state(conn->state));
-		goto drop;
+		goto unlock;
 	}
 
 	rcv_tl = (MODGATECOM_TransportLayer *)skb_network_header(rcv);
@@ -291,47 +439,88 @@ static int revpi_gate_process_cyclicpd(struct sk_buff *rcv,
 	if (!pskb_may_pull(rcv, sizeof(*rcv_al)) ||
 	    !pskb_may_pull(rcv, sizeof(*rcv_al) + rcv_al->i16uDataLen)) {
 		pr_err("%s: received truncated data packet\n", dev->name);
-		goto drop;
+		goto unlock;
 	}
 	if (rcv_al->i16uOffset + rcv_al->i16uDataLen > conn->in_len) {
 		pr_err("%s: received out of bounds data packet\n", dev->name);
-		goto drop;
+		goto unlock;
+	}
+
+	stats = &conn->stats;
+	stats->rx_frames++;
+	if (backlog > stats->max_backlog)
+		stats->max_backlog = backlog;
+	if (rcv_tl->i8uACK == conn->out_ctr && conn->tx_time) {
+		rtt = ktime_us_delta(arrival, conn->tx_time);
+		stats->last_rtt = rtt;
+		if (rtt > stats->max_rtt)
+			stats->max_rtt = rtt;
+		conn->tx_time = 0;
 	}
 
 	/*
 	 * Only send an answer packet if neighbor is not lagging behind.
 	 * If it is, remain silent to allow its RX FIFO to drain.
+	 * The packet is counted here while the lock is held and uncounted
+	 * in the rare case that it cannot be transmitted.
 	 */
 	if (!backlog) {
 		skb = revpi_gate_create_cyclicpd_packet(conn, &al);
 		if (!skb)
-			goto drop;
+			goto unlock;
+		stats->tx_frames++;
 	}
 
+	/*
+	 * The process image is only written by the io cycle, which copies
+	 * the pending data with a single lock of the process image. Data
+	 * which is received before that is merged into the pending range.
+	 */
 	if (conn->revpi_dev &&
 	    !test_bit(PICONTROL_DEV_FLAG_STOP_IO, &piDev_g.flags)) {
 		conn->revpi_dev->i8uModuleState = rcv_al->i8uFieldbusStatus;
-		rt_mutex_lock(&piDev_g.lockPI);
-		memcpy(conn->in + rcv_al->i16uOffset, rcv_al->i8uData,
+		memcpy(conn->in_buf + rcv_al->i16uOffset, rcv_al->i8uData,
 		       rcv_al->i16uDataLen);
+		if (conn->in_pending) {
+			conn->in_start = min_t(unsigned int, conn->in_start,
+					       rcv_al->i16uOffset);
+			conn->in_end = max_t(unsigned int, conn->in_end,
+					     rcv_al->i16uOffset + rcv_al->i16uDataLen);
+			conn->coalesced++;
+		} else {
+			conn->in_start = rcv_al->i16uOffset;
+			conn->in_end = rcv_al->i16uOffset + rcv_al->i16uDataLen;
+			conn->in_arrival = arrival;
+			conn->in_pending = true;
+		}
 		if (skb)
-			memcpy(al->i8uData, conn->out, conn->out_len);
-		rt_mutex_unlock(&piDev_g.lockPI);
+			memcpy(al->i8uData, conn->out_buf, conn->out_len);
 	} else {
 		if (skb)
 			memset(al->i8uData, 0, conn->out_len);
 	}
+	spin_unlock(&conn->lock);
 
-	if (skb && dev_queue_xmit(skb)) {
-		pr_err("%s: failed to transmit data packet\n", dev->name);
-		goto drop;
+	if (skb) {
+		if (dev_queue_xmit(skb)) {
+			pr_err("%s: failed to transmit data packet\n",
+			       dev->name);
+			spin_lock(&conn->lock);
+			stats->tx_frames--;
+			spin_unlock(&conn->lock);
+			goto drop;
+		}
 	}
 
-	mod_delayed_work(system_highpri_wq, &conn->send_work, MG_AL_SEND);
-	mod_delayed_work(system_highpri_wq, &conn->destroy_work, MG_AL_TIMEOUT);
+	mod_delayed_work(system_highpri_wq, &conn->send_work,
+			 revpi_gate_send_delay(conn));
+	mod_delayed_work(system_highpri_wq, &conn->destroy_work,
+			 revpi_gate_timeout(conn));
 	consume_skb(rcv);
 	return NET_RX_SUCCESS;
 
+unlock:
+	spin_unlock(&conn->lock);
 drop:
 	kfree_skb(rcv);
 	return NET_RX_DROP;
@@ -350,10 +539,13 @@ static int revpi_gate_process_id_resp(struct sk_buff *rcv,
 		pr_err("%s: received id response without connection\n",
 		       dev->name);
 		goto drop;
-	} else if (conn->state != MODGATE_ST_ID_REQ) {
+	}
+
+	spin_lock_bh(&conn->lock);
+	if (conn->state != MODGATE_ST_ID_REQ) {
 		pr_err("%s: received id response while %s\n",
 		       dev->name, revpi_gate_state(conn->state));
-		goto drop;
+		goto unlock;
 	}
 
 	rcv_tl = (MODGATECOM_TransportLayer *)skb_network_header(rcv);
@@ -364,7 +556,7 @@ static int revpi_gate_process_id_resp(struct sk_buff *rcv,
 	rcv_al = (MODGATECOM_IDResp *)pskb_pull(rcv, sizeof(*rcv_tl));
 	if (!pskb_may_pull(rcv, sizeof(*rcv_al))) {
 		pr_err("%s: received truncated id response\n", dev->name);
-		goto drop;
+		goto unlock;
 	}
 
 	pr_info("%s: id response from gateway (module type %hu hw V%hu sw V%hu.%hu svn %u serial %u mac %pM)\n",
@@ -392,7 +584,7 @@ static int revpi_gate_process_id_resp(struct sk_buff *rcv,
 	skb = revpi_gate_create_packet(conn, MODGATE_AL_CMD_ID_Resp,
 				       sizeof(*al));
 	if (!skb)
-		goto drop;
+		goto unlock;
 
 	al = (MODGATECOM_IDResp *)skb_put(skb, sizeof(*al));
 	al->i32uSerialnumber = RevPiDevice_getDev(0)->sId.i32uSerialnumber;
@@ -404,29 +596,66 @@ static int revpi_gate_process_id_resp(struct sk_buff *rcv,
 	al->i16uFBS_InputLength = conn->in_len;
 	al->i16uFBS_OutputLength = conn->out_len;
 	al->i16uFeatureDescriptor = MODGATE_feature_IODataExchange;
+	spin_unlock_bh(&conn->lock);
 
 	if (dev_queue_xmit(skb)) {
 		pr_err("%s: failed to transmit id response\n", dev->name);
 		goto drop;
 	}
 
+	spin_lock_bh(&conn->lock);
 	conn->state = MODGATE_ST_ID_RESP;
+	conn->in_pending = false;
+	memset(conn->out_buf, 0, sizeof(conn->out_buf));
+	spin_unlock_bh(&conn->lock);
 	revpi_core_gate_connected(conn->revpi_dev, true);
-	queue_delayed_work(system_highpri_wq, &conn->send_work, MG_AL_SEND);
-	mod_delayed_work(system_highpri_wq, &conn->destroy_work, MG_AL_TIMEOUT);
+	queue_delayed_work(system_highpri_wq, &conn->send_work,
+			   revpi_gate_send_delay(conn));
+	mod_delayed_work(system_highpri_wq, &conn->destroy_work,
+			 revpi_gate_timeout(conn));
 	consume_skb(rcv);
 	return NET_RX_SUCCESS;
 
+unlock:
+	spin_unlock_bh(&conn->lock);
 drop:
 	kfree_skb(rcv);
 	return NET_RX_DROP;
 }
 
+/**
+ * revpi_gate_get_port() - get the settings and statistics of a network device
+ * @name: name of the network device
+ *
+ * The port is allocated on the first connection on the network device or
+ * when its settings are changed.  Must be called with revpi_gate_lock held.
+ */
+static struct revpi_gate_port *revpi_gate_get_port(const char *name)
+{
+	struct revpi_gate_port *port;
+
+	list_for_each_entry(port, &revpi_gate_ports, list_node)
+		if (!strcmp(port->name, name))
+			return port;
+
+	port = kzalloc(sizeof(*port), GFP_KERNEL);
+	if (!port)
+		return NULL;
+
+	strscpy(port->name, name, sizeof(port->name));
+	port->send_interval = MG_AL_SEND;
+	port->timeout = MG_AL_TIMEOUT;
+	list_add_tail(&port->list_node, &revpi_gate_ports);
+
+	return port;
+}
+
 static int revpi_gate_process_id_req(struct sk_buff *rcv,
 				     struct net_device *dev,
 				     struct revpi_gate_connection *conn)
 {
 	MODGATECOM_TransportLayer *rcv_tl;
+	struct revpi_gate_port *port;
 	struct sk_buff *skb;
 	int ret;
 
@@ -437,6 +666,12 @@ static int revpi_gate_process_id_req(struct sk_buff *rcv,
 		pr_debug("%s: id request\n", dev->name);
 		rcv_tl = (MODGATECOM_TransportLayer *)skb_network_header(rcv);
 
+		mutex_lock(&revpi_gate_lock);
+		port = revpi_gate_get_port(dev->name);
+		mutex_unlock(&revpi_gate_lock);
+		if (!port)
+			goto drop;
+
 		conn = kzalloc(sizeof(*conn), GFP_ATOMIC);
 		if (!conn)
 			goto drop;
@@ -454,21 +689,29 @@ static int revpi_gate_process_id_req(struct sk_buff *rcv,
 		conn->dev = dev;
 		conn->state = MODGATE_ST_ID_REQ;
 		conn->in_ctr = rcv_tl->i8uCounter;
+		conn->port = port;
+		spin_lock_init(&conn->lock);
 		INIT_LIST_HEAD(&conn->list_node);
 		INIT_DELAYED_WORK(&conn->send_work, revpi_gate_send_work);
 		INIT_DELAYED_WORK(&conn->destroy_work, revpi_gate_destroy_work);
 
 		mutex_lock(&revpi_gate_lock);
+		port->conn = conn;
 		list_add_tail_rcu(&conn->list_node, &revpi_gate_connections);
 		mutex_unlock(&revpi_gate_lock);
 	} else {
 		pr_warn("%s: id request, resetting connection\n", dev->name);
+		spin_lock_bh(&conn->lock);
 		conn->state = MODGATE_ST_ID_REQ;
-		cancel_delayed_work_sync(&conn->send_work);
+		spin_unlock_bh(&conn->lock);
+		/* a running send work sees the new state and sends nothing */
+		cancel_delayed_work(&conn->send_work);
 		revpi_core_gate_connected(conn->revpi_dev, false);
 	}
 
+	spin_lock_bh(&conn->lock);
 	skb = revpi_gate_create_packet(conn, MODGATE_AL_CMD_ID_Req, 0);
+	spin_unlock_bh(&conn->lock);
 	if (!skb)
 		goto destroy;
 
@@ -477,7 +720,8 @@ static int revpi_gate_process_id_req(struct sk_buff *rcv,
 		goto destroy;
 	}
 
-	mod_delayed_work(system_highpri_wq, &conn->destroy_work, MG_AL_TIMEOUT);
+	mod_delayed_work(system_highpri_wq, &conn->destroy_work,
+			 revpi_gate_timeout(conn));
 	consume_skb(rcv);
 	return NET_RX_SUCCESS;
 
@@ -488,10 +732,12 @@ drop:
 	return NET_RX_DROP;
 }
 
-static int revpi_gate_process(struct sk_buff *skb, struct net_device *dev)
+static int revpi_gate_process(struct sk_buff *skb, struct net_device *dev,
+			      ktime_t arrival)
 {
 	struct revpi_gate_connection *conn;
 	MODGATECOM_TransportLayer *tl;
+	unsigned int gap;
 	u8 expected_ctr;
 	int idx, ret;
 
@@ -519,6 +765,7 @@ process:
 	}
 
 	if (conn) {
+		spin_lock_bh(&conn->lock);
 		/*
 		 * Some versions of the RevPi Gate firmware resend packets
 		 * if they haven't received a packet in a while.  React by
@@ -529,8 +776,10 @@ process:
 		    tl->i16uCmd == MODGATE_AL_CMD_cyclicPD) {
 			pr_err("%s: received duplicate data packet\n",
 			       dev->name);
+			conn->stats.duplicates++;
 			mod_delayed_work(system_highpri_wq, &conn->send_work,
 									  0);
+			spin_unlock_bh(&conn->lock);
 			kfree_skb(skb);
 			ret = NET_RX_DROP;
 			goto unlock;
@@ -540,11 +789,20 @@ process:
 		expected_ctr = conn->in_ctr + 1;
 		if (expected_ctr == 0)
 			expected_ctr = 1;
-		if (tl->i8uCounter != expected_ctr)
+		if (tl->i8uCounter != expected_ctr) {
 			pr_warn("%s: received ctr %#hhx, expected %#hhx\n",
 				dev->name, tl->i8uCounter, expected_ctr);
 
+			/* counters run from 1 to 255, 0 is skipped */
+			gap = (tl->i8uCounter + 255 - expected_ctr) % 255;
+			if (gap < 128)
+				conn->stats.lost += gap;
+			else
+				conn->stats.out_of_order++;
+		}
+
 		conn->in_ctr = tl->i8uCounter;
+		spin_unlock_bh(&conn->lock);
 	}
 
 	switch (tl->i16uCmd) {
@@ -555,7 +813,7 @@ process:
 		ret = revpi_gate_process_id_resp(skb, dev, conn);
 		break;
 	case MODGATE_AL_CMD_cyclicPD:
-		ret = revpi_gate_process_cyclicpd(skb, dev, conn);
+		ret = revpi_gate_process_cyclicpd(skb, dev, conn, arrival);
 		break;
 	default:
 		pr_err("%s: received packet with unsupported type %#hx\n",
@@ -570,32 +828,51 @@ unlock:
 	return ret;
 }
 
-static int revpi_gate_rcv_loop(void *data)
+/* arrival time of a packet handed over to revpi_gate_ctrl_work */
+struct revpi_gate_skb_cb {
+	ktime_t arrival;
+};
+
+#define REVPI_GATE_SKB_CB(skb) ((struct revpi_gate_skb_cb *)(skb)->cb)
+
+/**
+ * revpi_gate_ctrl_work_fn() - process id requests and responses
+ * @work: the work item revpi_gate_ctrl_work
+ *
+ * Setting up and resetting a connection may sleep, so these packets are
+ * handed over to a work item.  Data packets which arrive while id packets
+ * are pending are queued behind them, so that all packets are processed
+ * in the order of their arrival.  Data packets are processed with softirqs
+ * disabled like in revpi_gate_rcv().
+ */
+static void revpi_gate_ctrl_work_fn(struct work_struct *work)
 {
+	MODGATECOM_TransportLayer *tl;
 	struct sk_buff *skb;
-
-	while (true) {
-		while (!skb_queue_empty(&revpi_gate_rcvq)) {
-			skb = skb_dequeue(&revpi_gate_rcvq);
-			revpi_gate_process(skb, skb->dev);
-		}
-		set_current_state(TASK_IDLE);
-		if (kthread_should_stop()) {
-			__set_current_state(TASK_RUNNING);
-			return 0;
-		}
-		if (!skb_queue_empty(&revpi_gate_rcvq)) {
-			__set_current_state(TASK_RUNNING);
-			continue;
+	ktime_t arrival;
+
+	while ((skb = skb_dequeue(&revpi_gate_ctrlq))) {
+		tl = (MODGATECOM_TransportLayer *)skb_network_header(skb);
+		arrival = REVPI_GATE_SKB_CB(skb)->arrival;
+
+		if (tl->i16uCmd == MODGATE_AL_CMD_cyclicPD) {
+			local_bh_disable();
+			revpi_gate_process(skb, skb->dev, arrival);
+			local_bh_enable();
+		} else {
+			revpi_gate_process(skb, skb->dev, arrival);
 		}
-		schedule();
 
+		/* only now later packets may be processed directly again */
+		atomic_dec(&revpi_gate_ctrl_pending);
 	}
 }
 
 static int revpi_gate_rcv(struct sk_buff *skb, struct net_device *dev,
 			  struct packet_type *pt, struct net_device *orig_dev)
 {
+	MODGATECOM_TransportLayer *tl;
+
 	if (skb->pkt_type != PACKET_BROADCAST) {
 		pr_err("%s: received non-broadcast packet\n", dev->name);
 		goto drop;
@@ -610,8 +887,21 @@ static int revpi_gate_rcv(struct sk_buff *skb, struct net_device *dev,
 		goto drop;
 	}
 
-	skb_queue_tail(&revpi_gate_rcvq, skb);
-	wake_up_process(revpi_gate_rcv_thread);
+	tl = (MODGATECOM_TransportLayer *)skb_network_header(skb);
+	if (tl->i16uCmd == MODGATE_AL_CMD_cyclicPD &&
+	    !atomic_read(&revpi_gate_ctrl_pending))
+		return revpi_gate_process(skb, dev, ktime_get());
+
+	/* id packets are only exchanged on connection setup */
+	if (skb_queue_len(&revpi_gate_ctrlq) >= REVPI_GATE_CTRLQ_LEN) {
+		pr_err("%s: too many pending packets\n", dev->name);
+		goto drop;
+	}
+
+	REVPI_GATE_SKB_CB(skb)->arrival = ktime_get();
+	atomic_inc(&revpi_gate_ctrl_pending);
+	skb_queue_tail(&revpi_gate_ctrlq, skb);
+	queue_work(system_highpri_wq, &revpi_gate_ctrl_work);
 	return NET_RX_SUCCESS;
 
 drop:
@@ -624,23 +914,195 @@ static struct packet_type revpi_gate_packet_type __read_mostly = {
 	.func =	revpi_gate_rcv,
 };
 
-void revpi_gate_init(void)
+/**
+ * revpi_gate_sync_image() - exchange gateway data with the process image
+ *
+ * Called by the io thread once per cycle.  Copy the data received since the
+ * last cycle into the process image and take a copy of the data to send.
+ *
+ * Must be called with lockPI held.
+ */
+void revpi_gate_sync_image(void)
 {
-	struct task_struct *th;
+	struct revpi_gate_connection *conn;
+	unsigned int delay;
+	bool stop_io;
+	ktime_t now;
+	int idx;
 
-	skb_queue_head_init(&revpi_gate_rcvq);
+	idx = srcu_read_lock(&revpi_gate_srcu);
+	if (list_empty(&revpi_gate_connections))
+		goto unlock;
 
-	revpi_gate_rcv_thread = NULL;
+	stop_io = test_bit(PICONTROL_DEV_FLAG_STOP_IO, &piDev_g.flags);
 
-	th = kthread_run(&revpi_gate_rcv_loop, NULL, "revpi_gate_rcv");
-	if (IS_ERR(th)) {
-		pr_err("piControl: cannot run revpi_gate_rcv_thread (%ld), reset driver to retry\n",
-		       PTR_ERR(th));
-		return;
+	now = ktime_get();
+	list_for_each_entry_rcu(conn, &revpi_gate_connections, list_node) {
+		spin_lock_bh(&conn->lock);
+		if (!conn->revpi_dev || conn->state != MODGATE_ST_ID_RESP) {
+			spin_unlock_bh(&conn->lock);
+			continue;
+		}
+
+		if (conn->in_pending && !stop_io) {
+			memcpy(conn->in + conn->in_start,
+			       conn->in_buf + conn->in_start,
+			       conn->in_end - conn->in_start);
+			delay = ktime_us_delta(now, conn->in_arrival);
+			conn->last_delay = delay;
+			if (delay > conn->max_delay)
+				conn->max_delay = delay;
+		}
+		conn->in_pending = false;
+
+		if (stop_io)
+			memset(conn->out_buf, 0, conn->out_len);
+		else
+			memcpy(conn->out_buf, conn->out, conn->out_len);
+		spin_unlock_bh(&conn->lock);
+	}
+
+unlock:
+	srcu_read_unlock(&revpi_gate_srcu, idx);
+}
+
+ssize_t revpi_gate_show_latency(char *buf)
+{
+	struct revpi_gate_connection *conn;
+	ssize_t len = 0;
+	int idx;
+
+	idx = srcu_read_lock(&revpi_gate_srcu);
+	list_for_each_entry_rcu(conn, &revpi_gate_connections, list_node) {
+		spin_lock_bh(&conn->lock);
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %u %u %llu\n",
+				 conn->dev->name, conn->last_delay,
+				 conn->max_delay, conn->coalesced);
+		spin_unlock_bh(&conn->lock);
+	}
+	srcu_read_unlock(&revpi_gate_srcu, idx);
+
+	return len;
+}
+
+void revpi_gate_reset_latency(void)
+{
+	struct revpi_gate_connection *conn;
+	int idx;
+
+	idx = srcu_read_lock(&revpi_gate_srcu);
+	list_for_each_entry_rcu(conn, &revpi_gate_connections, list_node) {
+		spin_lock_bh(&conn->lock);
+		conn->max_delay = 0;
+		conn->coalesced = 0;
+		spin_unlock_bh(&conn->lock);
+	}
+	srcu_read_unlock(&revpi_gate_srcu, idx);
+}
+
+/*
+ * The connection of a port is only freed after it was removed from the port
+ * with revpi_gate_lock held, so it may be accessed with revpi_gate_lock held.
+ * Its statistics are added to those of the port only after it was removed,
+ * so they are missing for the short time until then.
+ */
+ssize_t revpi_gate_show_stats(char *buf)
+{
+	struct revpi_gate_port *port;
+	struct revpi_gate_stats tmp;
+	ssize_t len = 0;
+
+	mutex_lock(&revpi_gate_lock);
+	list_for_each_entry(port, &revpi_gate_ports, list_node) {
+		tmp = port->stats;
+		if (port->conn) {
+			spin_lock_bh(&port->conn->lock);
+			revpi_gate_stats_add(&tmp, &port->conn->stats);
+			spin_unlock_bh(&port->conn->lock);
+		}
+
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%s %llu %llu %llu %llu %llu %llu %llu %u %u %u\n",
+				 port->name, tmp.rx_frames, tmp.tx_frames,
+				 tmp.lost, tmp.out_of_order, tmp.duplicates,
+				 tmp.retransmissions, tmp.timeouts,
+				 tmp.max_backlog, tmp.last_rtt, tmp.max_rtt);
+	}
+	mutex_unlock(&revpi_gate_lock);
+
+	return len;
+}
+
+void revpi_gate_reset_stats(void)
+{
+	struct revpi_gate_port *port;
+
+	mutex_lock(&revpi_gate_lock);
+	list_for_each_entry(port, &revpi_gate_ports, list_node) {
+		memset(&port->stats, 0, sizeof(port->stats));
+		if (port->conn) {
+			spin_lock_bh(&port->conn->lock);
+			memset(&port->conn->stats, 0,
+			       sizeof(port->conn->stats));
+			spin_unlock_bh(&port->conn->lock);
+		}
 	}
-	revpi_gate_rcv_thread = th;
+	mutex_unlock(&revpi_gate_lock);
+}
+
+ssize_t revpi_gate_show_timing(char *buf)
+{
+	struct revpi_gate_port *port;
+	ssize_t len = 0;
 
-	sched_set_fifo(revpi_gate_rcv_thread);
+	mutex_lock(&revpi_gate_lock);
+	list_for_each_entry(port, &revpi_gate_ports, list_node)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %u %u\n",
+				 port->name, port->send_interval,
+				 port->timeout);
+	mutex_unlock(&revpi_gate_lock);
+
+	return len;
+}
+
+/**
+ * revpi_gate_set_timing() - set send interval and timeout of a port
+ * @name: name of the network device
+ * @send_interval: msecs of silence of the neighbor until a data packet is sent
+ * @timeout: msecs of silence of the neighbor until the connection is destroyed
+ *
+ * The timeout must be at least twice the send interval, so that a single
+ * lost packet does not destroy the connection.  The new values are used
+ * when the work items are armed the next time.
+ */
+int revpi_gate_set_timing(const char *name, unsigned int send_interval,
+			  unsigned int timeout)
+{
+	struct revpi_gate_port *port;
+
+	if (send_interval < MG_AL_SEND_MIN || send_interval > MG_AL_SEND_MAX)
+		return -EINVAL;
+
+	if (timeout < 2 * send_interval || timeout > MG_AL_TIMEOUT_MAX)
+		return -EINVAL;
+
+	mutex_lock(&revpi_gate_lock);
+	port = revpi_gate_get_port(name);
+	if (port) {
+		WRITE_ONCE(port->send_interval, send_interval);
+		WRITE_ONCE(port->timeout, timeout);
+	}
+	mutex_unlock(&revpi_gate_lock);
+
+	return port ? 0 : -ENOMEM;
+}
+
+void revpi_gate_init(void)
+{
+	revpi_gate_stopping = false;
+	skb_queue_head_init(&revpi_gate_ctrlq);
+	atomic_set(&revpi_gate_ctrl_pending, 0);
+	INIT_WORK(&revpi_gate_ctrl_work, revpi_gate_ctrl_work_fn);
 
 	dev_add_pack(&revpi_gate_packet_type);
 }
@@ -648,17 +1110,18 @@ void revpi_gate_init(void)
 void revpi_gate_fini(void)
 {
 	struct revpi_gate_connection *conn;
-	struct sk_buff *skb;
 	int idx;
 
 	dev_remove_pack(&revpi_gate_packet_type);
 
-	if (revpi_gate_rcv_thread)
-		kthread_stop(revpi_gate_rcv_thread);
-	while (!skb_queue_empty(&revpi_gate_rcvq)) {
-		skb = skb_dequeue(&revpi_gate_rcvq);
-		dev_kfree_skb(skb);
-	}
+	cancel_work_sync(&revpi_gate_ctrl_work);
+	skb_queue_purge(&revpi_gate_ctrlq);
+	atomic_set(&revpi_gate_ctrl_pending, 0);
+
+	/* connections destroyed from now on did not time out */
+	mutex_lock(&revpi_gate_lock);
+	revpi_gate_stopping = true;
+	mutex_unlock(&revpi_gate_lock);
 
 	/*
 	 * Remaining connections cannot be torn down with flush_delayed_work():
@@ -673,3 +1136,20 @@ void revpi_gate_fini(void)
 
 	wait_event(revpi_gate_fini_wq, list_empty(&revpi_gate_connections));
 }
+
+/**
+ * revpi_gate_exit() - free the settings and statistics of all ports
+ *
+ * Called on removal of the driver after revpi_gate_fini().
+ */
+void revpi_gate_exit(void)
+{
+	struct revpi_gate_port *port, *tmp;
+
+	mutex_lock(&revpi_gate_lock);
+	list_for_each_entry_safe(port, tmp, &revpi_gate_ports, list_node) {
+		list_del(&port->list_node);
+		kfree(port);
+	}
+	mutex_unlock(&revpi_gate_lock);
+}
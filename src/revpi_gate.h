@@ -4,6 +4,18 @@
 
 #ifndef _REVPI_GATE_H
 #define _REVPI_GATE_H
+
+#include <linux/types.h>
+
 void revpi_gate_init(void);
 void revpi_gate_fini(void);
+void revpi_gate_sync_image(void);
+ssize_t revpi_gate_show_latency(char *buf);
+void revpi_gate_reset_latency(void);
+ssize_t revpi_gate_show_stats(char *buf);
+void revpi_gate_reset_stats(void);
+ssize_t revpi_gate_show_timing(char *buf);
+int revpi_gate_set_timing(const char *name, unsigned int send_interval,
+			  unsigned int timeout);
+void revpi_gate_exit(void);
 #endif /* _REVPI_GATE_H */
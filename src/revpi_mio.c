@@ -1,11 +1,10 @@
 // SPDX-License-Identifier: GPL-2.0-only
 // SPDX-FileCopyrightText: 2020-2024 KUNBUS GmbH
 
-#include <linux/pibridge_comm.h>
-
 #include "revpi_common.h"
 #include "revpi_core.h"
 #include "revpi_mio.h"
+#include "revpi_replay.h"
 
 /* configurations of MIO modules */
 static struct mio_config mio_list[REVPI_MIO_MAX];
@@ -20,17 +19,11 @@ static int revpi_mio_cycle_dio(SDevice *dev, SMioDigitalRequestData *req_data,
 			       SMioDigitalResponseData *resp_data)
 {
 	SMioDigitalResponseData resp;
-	SMioDigitalRequestData req;
 	int ret;
 
-	/*copy: from process image:output to request*/
-	rt_mutex_lock(&piDev_g.lockPI);
-	memcpy(&req, req_data, sizeof(req));
-	rt_mutex_unlock(&piDev_g.lockPI);
-
-	ret = pibridge_req_io(piCore_g.pibridge, dev->i8uAddress,
-			      IOP_TYP1_CMD_DATA, &req, sizeof(req), &resp,
-			      sizeof(resp));
+	ret = revpi_replay_req_io(dev->i8uAddress,
+				  IOP_TYP1_CMD_DATA, req_data, sizeof(*req_data),
+				  &resp, sizeof(resp));
 	if (ret != sizeof(resp)) {
 		pr_debug("MIO addr %2d: dio communication failed (req:%zu,ret:%d)\n",
 			dev->i8uAddress, sizeof(resp), ret);
@@ -42,9 +35,7 @@ static int revpi_mio_cycle_dio(SDevice *dev, SMioDigitalRequestData *req_data,
 	}
 
 	/*copy: from response to process image:input*/
-	rt_mutex_lock(&piDev_g.lockPI);
 	memcpy(resp_data, &resp, sizeof(*resp_data));
-	rt_mutex_unlock(&piDev_g.lockPI);
 
 	return 0;
 }
@@ -56,10 +47,10 @@ static int revpi_mio_cycle_aio(SDevice *dev, SMioAnalogRequestData *req_data,
 	SMioAnalogResponseData resp;
 	int ret;
 
-	ret = pibridge_req_io(piCore_g.pibridge, dev->i8uAddress,
-			      IOP_TYP1_CMD_DATA2, req_data,
-			      sizeof(*req_data) - compressed, &resp,
-			      sizeof(resp));
+	ret = revpi_replay_req_io(dev->i8uAddress,
+				  IOP_TYP1_CMD_DATA2, req_data,
+				  sizeof(*req_data) - compressed, &resp,
+				  sizeof(resp));
 	if (ret != sizeof(resp)) {
 		pr_debug("MIO addr %2d: aio communication failed (req:%zd,ret:%d)\n",
 			dev->i8uAddress, sizeof(resp), ret);
@@ -71,9 +62,7 @@ static int revpi_mio_cycle_aio(SDevice *dev, SMioAnalogRequestData *req_data,
 	}
 
 	/*copy: from response to process image*/
-	rt_mutex_lock(&piDev_g.lockPI);
 	memcpy(resp_data, &resp, sizeof(*resp_data));
-	rt_mutex_unlock(&piDev_g.lockPI);
 
 	return 0;
 }
@@ -128,7 +117,11 @@ static unsigned int revpi_chnl_compress(void *dst, void *src,
 	return (d - (unsigned char *)dst) / step;
 }
 
-int revpi_mio_cycle(unsigned char devno)
+/*
+ * Exchange digital and, if @aio is set, analog data with the MIO. The analog
+ * exchange may be skipped if the cycle budget is exhausted.
+ */
+int revpi_mio_cycle(unsigned char devno, bool aio)
 {
 	SMioAnalogRequestData pending_values;
 	SMioAnalogRequestData io_req_ex;
@@ -142,16 +135,20 @@ int revpi_mio_cycle(unsigned char devno)
 	dev = RevPiDevice_getDev(devno);
 	last = &mio_aio_request_last[dev->i8uPriv];
 
-	img_out = (struct mio_img_out *)(piDev_g.ai8uPI +
+	img_out = (struct mio_img_out *)(piCore_g.cycle_image +
 					 dev->i16uOutputOffset);
-	img_in = (struct mio_img_in *)(piDev_g.ai8uPI + dev->i16uInputOffset);
+	img_in = (struct mio_img_in *)(piCore_g.cycle_image +
+				       dev->i16uInputOffset);
 
 	ret = revpi_mio_cycle_dio(dev, &img_out->dio, &img_in->dio);
 	if (ret)
 		return ret;
 
+	revpi_core_inputs_updated(devno);
+	if (!aio)
+		return 0;
+
 	/* for the AIO cycle */
-	my_rt_mutex_lock(&piDev_g.lockPI);
 	io_req_ex.i8uLogicLevel = img_out->aio.i8uLogicLevel;
 
 	io_req_ex.i8uChannels = revpi_chnl_cmp(&last->i16uOutputVoltage,
@@ -169,7 +166,6 @@ int revpi_mio_cycle(unsigned char devno)
 						&pending_values.i16uOutputVoltage,
 						io_req_ex.i8uChannels, 2);
 	}
-	rt_mutex_unlock(&piDev_g.lockPI);
 	ret = revpi_mio_cycle_aio(dev, &io_req_ex, ch_cnt, &img_in->aio);
 
 	if (ret)
@@ -312,23 +308,23 @@ int revpi_mio_init(unsigned char devno)
 	}
 
 	/*dio*/
-	ret = pibridge_req_io(piCore_g.pibridge, addr, IOP_TYP1_CMD_CFG,
-			      &conf->dio, sizeof(conf->dio), NULL, 0);
+	ret = revpi_replay_req_io(addr, IOP_TYP1_CMD_CFG,
+				  &conf->dio, sizeof(conf->dio), NULL, 0);
 	if (ret) {
 		pr_err("talk with mio for conf dio err(devno:%d, ret:%d)\n",
 		       devno, ret);
 	}
 
 	/*aio in*/
-	ret = pibridge_req_io(piCore_g.pibridge, addr, IOP_TYP1_CMD_DATA4,
-			      &conf->aio_i, sizeof(conf->aio_i), NULL, 0);
+	ret = revpi_replay_req_io(addr, IOP_TYP1_CMD_DATA4,
+				  &conf->aio_i, sizeof(conf->aio_i), NULL, 0);
 	if (ret)
 		pr_err("talk with mio for conf aio_i err(devno:%d, ret:%d)\n",
 		       devno, ret);
 
 	/*aio out*/
-	ret = pibridge_req_io(piCore_g.pibridge, addr, IOP_TYP1_CMD_DATA4,
-			      &conf->aio_o, sizeof(conf->aio_o), NULL, 0);
+	ret = revpi_replay_req_io(addr, IOP_TYP1_CMD_DATA4,
+				  &conf->aio_o, sizeof(conf->aio_o), NULL, 0);
 	if (ret)
 		pr_err("talk with mio for conf aio_o err(devno:%d, ret:%d)\n",
 		       devno, ret);
@@ -62,5 +62,5 @@ struct mio_img_in {
 int revpi_mio_init(unsigned char devno);
 int revpi_mio_config(unsigned char addr, unsigned short ent_cnt, SEntryInfo *ent);
 void revpi_mio_reset(void);
-int revpi_mio_cycle(unsigned char devno);
+int revpi_mio_cycle(unsigned char devno, bool aio);
 #endif /* _REVPI_MIO_H_ */
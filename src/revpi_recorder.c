@@ -0,0 +1,477 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+
+// Flight recorder of process image regions
+//
+// The io thread stores selected regions of the process image together with
+// the cycle number and a timestamp in a ring of fixed size. The ring is
+// frozen on demand or on a trigger (e.g. watchdog expiry or module loss)
+// and can then be read from sysfs.
+
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/version.h>
+
+#include "piControlMain.h"
+#include "revpi_common.h"
+#include "revpi_recorder.h"
+
+#define REVPI_RECORDER_RECORD_LEN	(sizeof(struct picontrol_recorder_record) + \
+					 REVPI_RECORDER_MAX_DATA)
+
+struct revpi_recorder_region {
+	u16 offset;
+	u16 length;
+};
+
+static struct revpi_recorder {
+	/* serializes configuration changes and dumps */
+	struct mutex lock;
+	/* protects everything below against the io thread */
+	spinlock_t ring_lock;
+	struct revpi_recorder_region regions[PICONTROL_RECORDER_MAX_REGIONS];
+	unsigned int num_regions;
+	unsigned int data_len;
+	/* incremented whenever the ring is restarted */
+	unsigned int generation;
+	unsigned int head;
+	unsigned int count;
+	bool frozen;
+	/* trigger which freezes the ring after the next record */
+	u32 pending_trigger;
+	/* trigger which froze the ring */
+	u32 trigger;
+	/* enabled triggers */
+	u32 triggers;
+	/* cost of recording a cycle */
+	unsigned int last_cost; /* nsecs */
+	unsigned int max_cost; /* nsecs */
+	u8 scratch[REVPI_RECORDER_MAX_DATA];
+	u8 ring[REVPI_RECORDER_DEPTH][REVPI_RECORDER_RECORD_LEN];
+} recorder = {
+	.lock = __MUTEX_INITIALIZER(recorder.lock),
+	.ring_lock = __SPIN_LOCK_UNLOCKED(recorder.ring_lock),
+	.triggers = PICONTROL_RECORDER_TRIGGER_WATCHDOG |
+		    PICONTROL_RECORDER_TRIGGER_LOGIRTS |
+		    PICONTROL_RECORDER_TRIGGER_MODULE_LOST,
+};
+
+/* Must be called with ring_lock held */
+static void revpi_recorder_restart(void)
+{
+	recorder.generation++;
+	recorder.head = 0;
+	recorder.count = 0;
+	recorder.frozen = false;
+	recorder.pending_trigger = 0;
+	recorder.trigger = 0;
+}
+
+/**
+ * revpi_recorder_record() - store the configured regions of the current cycle
+ * @cycle: number of the current cycle
+ *
+ * Called by the io thread once per cycle after the data exchange. The cost
+ * is bounded by REVPI_RECORDER_MAX_DATA bytes copied twice.
+ */
+void revpi_recorder_record(u64 cycle)
+{
+	struct revpi_recorder_region regions[PICONTROL_RECORDER_MAX_REGIONS];
+	struct picontrol_recorder_record *rec;
+	unsigned int num_regions;
+	unsigned int generation;
+	unsigned int data_len;
+	unsigned int cost;
+	unsigned int pos;
+	unsigned int i;
+	ktime_t start;
+
+	start = ktime_get();
+
+	spin_lock(&recorder.ring_lock);
+	if (recorder.frozen || !recorder.num_regions) {
+		spin_unlock(&recorder.ring_lock);
+		return;
+	}
+	num_regions = recorder.num_regions;
+	memcpy(regions, recorder.regions, sizeof(regions));
+	data_len = recorder.data_len;
+	generation = recorder.generation;
+	spin_unlock(&recorder.ring_lock);
+
+	revpi_io_lock_pi();
+	for (i = 0, pos = 0; i < num_regions; i++) {
+		memcpy(recorder.scratch + pos,
+		       piDev_g.ai8uPI + regions[i].offset, regions[i].length);
+		pos += regions[i].length;
+	}
+	revpi_io_unlock_pi();
+
+	spin_lock(&recorder.ring_lock);
+	/* the ring may have been frozen or reconfigured in the meantime */
+	if (recorder.frozen || recorder.generation != generation) {
+		spin_unlock(&recorder.ring_lock);
+		return;
+	}
+
+	rec = (struct picontrol_recorder_record *) recorder.ring[recorder.head];
+	rec->cycle = cycle;
+	rec->timestamp = ktime_to_ns(start);
+	memcpy(rec->data, recorder.scratch, data_len);
+
+	recorder.head = (recorder.head + 1) % REVPI_RECORDER_DEPTH;
+	if (recorder.count < REVPI_RECORDER_DEPTH)
+		recorder.count++;
+
+	/* the cycle which raised the trigger is the last one recorded */
+	if (recorder.pending_trigger) {
+		recorder.trigger = recorder.pending_trigger;
+		recorder.pending_trigger = 0;
+		recorder.frozen = true;
+	}
+
+	cost = ktime_to_ns(ktime_sub(ktime_get(), start));
+	recorder.last_cost = cost;
+	if (recorder.max_cost < cost)
+		recorder.max_cost = cost;
+	spin_unlock(&recorder.ring_lock);
+}
+
+/**
+ * revpi_recorder_trigger() - freeze the recorder after the current cycle
+ * @trigger: PICONTROL_RECORDER_TRIGGER_* which occurred
+ *
+ * The trigger is ignored if it is not enabled or the recorder is already
+ * frozen or about to be frozen.
+ */
+void revpi_recorder_trigger(u32 trigger)
+{
+	spin_lock(&recorder.ring_lock);
+	if ((recorder.triggers & trigger) && !recorder.frozen &&
+	    !recorder.pending_trigger)
+		recorder.pending_trigger = trigger;
+	spin_unlock(&recorder.ring_lock);
+}
+
+static ssize_t recorder_regions_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	ssize_t len = 0;
+	unsigned int i;
+
+	mutex_lock(&recorder.lock);
+	for (i = 0; i < recorder.num_regions; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s%u:%u",
+				 i ? " " : "", recorder.regions[i].offset,
+				 recorder.regions[i].length);
+	mutex_unlock(&recorder.lock);
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	return len;
+}
+
+/*
+ * Regions are given as "offset:length" pairs separated by spaces. An empty
+ * string disables the recorder. Changing the regions restarts the ring.
+ */
+static ssize_t recorder_regions_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct revpi_recorder_region regions[PICONTROL_RECORDER_MAX_REGIONS];
+	unsigned int offset, length;
+	unsigned int num_regions = 0;
+	unsigned int data_len = 0;
+	char *str, *cur, *tok;
+	int ret = count;
+
+	str = kstrndup(buf, count, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	cur = strim(str);
+	while ((tok = strsep(&cur, " ,")) != NULL) {
+		if (!*tok)
+			continue;
+
+		if (sscanf(tok, "%u:%u", &offset, &length) != 2 || !length ||
+		    offset + length > KB_PI_LEN ||
+		    data_len + length > REVPI_RECORDER_MAX_DATA ||
+		    num_regions >= PICONTROL_RECORDER_MAX_REGIONS) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+		regions[num_regions].offset = offset;
+		regions[num_regions].length = length;
+		num_regions++;
+		data_len += length;
+	}
+
+	mutex_lock(&recorder.lock);
+	spin_lock(&recorder.ring_lock);
+	memcpy(recorder.regions, regions,
+	       num_regions * sizeof(struct revpi_recorder_region));
+	recorder.num_regions = num_regions;
+	recorder.data_len = data_len;
+	revpi_recorder_restart();
+	spin_unlock(&recorder.ring_lock);
+	mutex_unlock(&recorder.lock);
+out:
+	kfree(str);
+	return ret;
+}
+
+static ssize_t recorder_triggers_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	u32 triggers;
+
+	spin_lock(&recorder.ring_lock);
+	triggers = recorder.triggers;
+	spin_unlock(&recorder.ring_lock);
+
+	return sprintf(buf, "0x%x\n", triggers);
+}
+
+static ssize_t recorder_triggers_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	u32 val;
+
+	if (kstrtou32(buf, 0, &val))
+		return -EINVAL;
+
+	spin_lock(&recorder.ring_lock);
+	recorder.triggers = val;
+	spin_unlock(&recorder.ring_lock);
+
+	return count;
+}
+
+static ssize_t recorder_freeze_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	bool frozen;
+
+	spin_lock(&recorder.ring_lock);
+	frozen = recorder.frozen;
+	spin_unlock(&recorder.ring_lock);
+
+	return sprintf(buf, "%u\n", frozen);
+}
+
+/* Write 1 to freeze the recorder, 0 to restart it */
+static ssize_t recorder_freeze_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	bool val;
+
+	if (kstrtobool(buf, &val))
+		return -EINVAL;
+
+	mutex_lock(&recorder.lock);
+	spin_lock(&recorder.ring_lock);
+	if (val) {
+		recorder.frozen = true;
+		recorder.pending_trigger = 0;
+	} else {
+		revpi_recorder_restart();
+	}
+	spin_unlock(&recorder.ring_lock);
+	mutex_unlock(&recorder.lock);
+
+	return count;
+}
+
+static ssize_t recorder_last_cost_show(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	unsigned int last;
+
+	spin_lock(&recorder.ring_lock);
+	last = recorder.last_cost;
+	spin_unlock(&recorder.ring_lock);
+
+	return sprintf(buf, "%u\n", last);
+}
+
+static ssize_t recorder_max_cost_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	unsigned int max;
+
+	spin_lock(&recorder.ring_lock);
+	max = recorder.max_cost;
+	spin_unlock(&recorder.ring_lock);
+
+	return sprintf(buf, "%u\n", max);
+}
+
+static ssize_t recorder_max_cost_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	unsigned long val;
+
+	if (kstrtoul(buf, 10, &val))
+		return -EINVAL;
+
+	if (val != 0)
+		return -EINVAL;
+
+	spin_lock(&recorder.ring_lock);
+	recorder.max_cost = 0;
+	spin_unlock(&recorder.ring_lock);
+
+	return count;
+}
+
+/*
+ * The dump is only available while the recorder is frozen. Since the io
+ * thread does not touch a frozen ring and restarting it requires the mutex,
+ * the ring can be read without the spinlock.
+ */
+#if KERNEL_VERSION(6, 13, 0) > LINUX_VERSION_CODE
+static ssize_t recorder_data_read(struct file *filp, struct kobject *kobj,
+				  struct bin_attribute *attr, char *buf,
+				  loff_t off, size_t count)
+#else
+static ssize_t recorder_data_read(struct file *filp, struct kobject *kobj,
+				  const struct bin_attribute *attr, char *buf,
+				  loff_t off, size_t count)
+#endif
+{
+	struct picontrol_recorder_header hdr;
+	unsigned int record_len;
+	unsigned int first;
+	size_t total;
+	size_t done = 0;
+	size_t pos, len;
+	unsigned int idx;
+	unsigned int i;
+	bool frozen;
+
+	mutex_lock(&recorder.lock);
+
+	spin_lock(&recorder.ring_lock);
+	frozen = recorder.frozen;
+	spin_unlock(&recorder.ring_lock);
+
+	if (!frozen) {
+		mutex_unlock(&recorder.lock);
+		return -EBUSY;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	record_len = sizeof(struct picontrol_recorder_record) +
+		     recorder.data_len;
+	hdr.magic = PICONTROL_RECORDER_MAGIC;
+	hdr.num_regions = recorder.num_regions;
+	hdr.record_len = record_len;
+	hdr.num_records = recorder.count;
+	hdr.trigger = recorder.trigger;
+	for (i = 0; i < recorder.num_regions; i++) {
+		hdr.regions[i].offset = recorder.regions[i].offset;
+		hdr.regions[i].length = recorder.regions[i].length;
+	}
+
+	total = sizeof(hdr) + (size_t) recorder.count * record_len;
+	if (off >= total) {
+		mutex_unlock(&recorder.lock);
+		return 0;
+	}
+	count = min_t(size_t, count, total - off);
+
+	if (off < sizeof(hdr)) {
+		len = min_t(size_t, count, sizeof(hdr) - off);
+		memcpy(buf, (u8 *) &hdr + off, len);
+		done = len;
+	}
+
+	/* records are stored oldest first, starting behind the head */
+	first = (recorder.head + REVPI_RECORDER_DEPTH - recorder.count) %
+		REVPI_RECORDER_DEPTH;
+
+	while (done < count) {
+		pos = off + done - sizeof(hdr);
+		idx = (first + pos / record_len) % REVPI_RECORDER_DEPTH;
+		len = min_t(size_t, count - done,
+			    record_len - pos % record_len);
+		memcpy(buf + done, recorder.ring[idx] + pos % record_len, len);
+		done += len;
+	}
+
+	mutex_unlock(&recorder.lock);
+
+	return done;
+}
+
+static DEVICE_ATTR_RW(recorder_regions);
+static DEVICE_ATTR_RW(recorder_triggers);
+static DEVICE_ATTR_RW(recorder_freeze);
+static DEVICE_ATTR_RO(recorder_last_cost);
+static DEVICE_ATTR_RW(recorder_max_cost);
+static BIN_ATTR_RO(recorder_data, 0);
+
+int revpi_recorder_init(struct device *dev)
+{
+	int ret;
+
+	ret = sysfs_create_file(&dev->kobj, &dev_attr_recorder_regions.attr);
+	if (ret)
+		return ret;
+
+	ret = sysfs_create_file(&dev->kobj, &dev_attr_recorder_triggers.attr);
+	if (ret)
+		goto remove_regions_file;
+
+	ret = sysfs_create_file(&dev->kobj, &dev_attr_recorder_freeze.attr);
+	if (ret)
+		goto remove_triggers_file;
+
+	ret = sysfs_create_file(&dev->kobj, &dev_attr_recorder_last_cost.attr);
+	if (ret)
+		goto remove_freeze_file;
+
+	ret = sysfs_create_file(&dev->kobj, &dev_attr_recorder_max_cost.attr);
+	if (ret)
+		goto remove_last_cost_file;
+
+	ret = sysfs_create_bin_file(&dev->kobj, &bin_attr_recorder_data);
+	if (ret)
+		goto remove_max_cost_file;
+
+	return 0;
+
+remove_max_cost_file:
+	sysfs_remove_file(&dev->kobj, &dev_attr_recorder_max_cost.attr);
+remove_last_cost_file:
+	sysfs_remove_file(&dev->kobj, &dev_attr_recorder_last_cost.attr);
+remove_freeze_file:
+	sysfs_remove_file(&dev->kobj, &dev_attr_recorder_freeze.attr);
+remove_triggers_file:
+	sysfs_remove_file(&dev->kobj, &dev_attr_recorder_triggers.attr);
+remove_regions_file:
+	sysfs_remove_file(&dev->kobj, &dev_attr_recorder_regions.attr);
+
+	return ret;
+}
+
+void revpi_recorder_fini(struct device *dev)
+{
+	sysfs_remove_bin_file(&dev->kobj, &bin_attr_recorder_data);
+	sysfs_remove_file(&dev->kobj, &dev_attr_recorder_max_cost.attr);
+	sysfs_remove_file(&dev->kobj, &dev_attr_recorder_last_cost.attr);
+	sysfs_remove_file(&dev->kobj, &dev_attr_recorder_freeze.attr);
+	sysfs_remove_file(&dev->kobj, &dev_attr_recorder_triggers.attr);
+	sysfs_remove_file(&dev->kobj, &dev_attr_recorder_regions.attr);
+}
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0-only
+ * SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+ *
+ * Flight recorder of process image regions
+ */
+
+#ifndef _REVPI_RECORDER_H
+#define _REVPI_RECORDER_H
+
+#include <linux/device.h>
+#include <linux/types.h>
+
+#include "piControl.h"
+
+/* number of cycles kept in the recorder */
+#define REVPI_RECORDER_DEPTH			256
+/* max bytes of all regions of one record */
+#define REVPI_RECORDER_MAX_DATA			256
+
+int revpi_recorder_init(struct device *dev);
+void revpi_recorder_fini(struct device *dev);
+void revpi_recorder_record(u64 cycle);
+void revpi_recorder_trigger(u32 trigger);
+
+#endif /* _REVPI_RECORDER_H */
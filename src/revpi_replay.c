@@ -0,0 +1,702 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+
+// Capture and replay of the PiBridge data exchange
+//
+// In capture mode the outputs written by the user between two cycles and
+// the responses of all module requests are stored in a buffer. In replay
+// mode the io thread runs the data exchange from such a capture instead of
+// the PiBridge, without any modules attached and without waiting for the
+// cycle timer. The crc32 of the module data at the end of each cycle is
+// compared with the captured one to detect deviations.
+
+#include <linux/crc32.h>
+#include <linux/pibridge_comm.h>
+#include <linux/rtmutex.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+
+#include "piControlMain.h"
+#include "PiBridgeMaster.h"
+#include "revpi_common.h"
+#include "revpi_core.h"
+#include "revpi_replay.h"
+#include "RevPiDevice.h"
+
+enum revpi_replay_mode {
+	REVPI_REPLAY_OFF,
+	REVPI_REPLAY_CAPTURE,
+	REVPI_REPLAY_REPLAY,
+};
+
+static const char * const revpi_replay_modes[] = {
+	[REVPI_REPLAY_OFF] = "off",
+	[REVPI_REPLAY_CAPTURE] = "capture",
+	[REVPI_REPLAY_REPLAY] = "replay",
+};
+
+static struct revpi_replay {
+	/*
+	 * Protects the buffer and the mode changes. The mode is only changed
+	 * by the io thread, the buffer is only accessed by sysfs if the mode
+	 * is off.
+	 */
+	struct rt_mutex lock;
+	/* mode requested by the user, applied at the start of a cycle */
+	enum revpi_replay_mode requested;
+	/* mode of the io thread */
+	enum revpi_replay_mode mode;
+	/* serve configuration requests of a replay without a capture */
+	bool configuring;
+	/*
+	 * The cycle failed, stop at its end. The mode must not change within
+	 * a cycle, otherwise the remaining requests of a replay would reach
+	 * the PiBridge.
+	 */
+	bool stopping;
+	/* the modules of the capture have to be replaced by the detected ones */
+	bool restore;
+	u8 *buf;
+	size_t len;
+	/* replay: position of the next record, capture: end of last cycle */
+	size_t pos;
+	/* outputs at the end of the previous cycle */
+	u8 shadow[KB_PI_LEN];
+	u64 cycles;
+	u64 mismatches;
+} replay;
+
+/*
+ * Module data which is compared after each cycle, the RevPi itself is skipped.
+ * The io thread's copy of the process image holds the data of the cycle.
+ */
+static u32 revpi_replay_crc(void)
+{
+	SDevice *dev;
+	u32 crc = 0;
+	int i;
+
+	for (i = 1; i < RevPiDevice_getDevCnt(); i++) {
+		dev = RevPiDevice_getDev(i);
+		if (!dev->i8uActive)
+			continue;
+		crc = crc32(crc, piCore_g.cycle_image + dev->i16uInputOffset,
+			    dev->sId.i16uFBS_InputLength);
+		crc = crc32(crc, piCore_g.cycle_image + dev->i16uOutputOffset,
+			    dev->sId.i16uFBS_OutputLength);
+	}
+
+	return crc;
+}
+
+/*
+ * Called by the io thread to stop on request, on error or at the end, only
+ * at cycle boundaries and without holding lockPI
+ */
+static void revpi_replay_stop(void)
+{
+	rt_mutex_lock(&replay.lock);
+	if (replay.mode == REVPI_REPLAY_CAPTURE) {
+		/* drop an incomplete cycle */
+		replay.len = replay.pos;
+		pr_info("capture stopped after %llu cycles (%zu bytes)\n",
+			replay.cycles, replay.len);
+	} else if (replay.mode == REVPI_REPLAY_REPLAY) {
+		pr_info("replay stopped after %llu cycles, %llu mismatches\n",
+			replay.cycles, replay.mismatches);
+		replay.restore = true;
+	}
+
+	replay.mode = REVPI_REPLAY_OFF;
+	replay.stopping = false;
+	WRITE_ONCE(replay.requested, REVPI_REPLAY_OFF);
+	rt_mutex_unlock(&replay.lock);
+}
+
+/* The replay is stopped at the end of the cycle */
+static void revpi_replay_diverged(void)
+{
+	if (replay.stopping)
+		return;
+
+	pr_warn("replay diverged from capture at cycle %llu\n", replay.cycles);
+	replay.mismatches++;
+	replay.stopping = true;
+}
+
+static bool revpi_replay_append(u8 type, u8 addr, u16 arg, s16 ret,
+				const void *data, u16 len)
+{
+	struct picontrol_capture_record rec = {
+		.type = type,
+		.addr = addr,
+		.len = len,
+		.arg = arg,
+		.ret = ret,
+	};
+
+	if (replay.stopping)
+		return false;
+
+	/* may be called with lockPI held, the capture is stopped later */
+	if (replay.len + sizeof(rec) + len > REVPI_REPLAY_BUF_SIZE) {
+		pr_warn("capture buffer full\n");
+		replay.stopping = true;
+		return false;
+	}
+
+	memcpy(replay.buf + replay.len, &rec, sizeof(rec));
+	memcpy(replay.buf + replay.len + sizeof(rec), data, len);
+	replay.len += sizeof(rec) + len;
+
+	return true;
+}
+
+/*
+ * Fetch the next record of the given type and return its data. The replay
+ * is stopped if the capture contains something else.
+ */
+static const u8 *revpi_replay_fetch(u8 type,
+				    struct picontrol_capture_record *rec)
+{
+	const u8 *data;
+
+	if (replay.pos + sizeof(*rec) > replay.len)
+		goto diverged;
+
+	memcpy(rec, replay.buf + replay.pos, sizeof(*rec));
+	if (rec->type != type ||
+	    replay.pos + sizeof(*rec) + rec->len > replay.len)
+		goto diverged;
+
+	data = replay.buf + replay.pos + sizeof(*rec);
+	replay.pos += sizeof(*rec) + rec->len;
+
+	return data;
+
+diverged:
+	revpi_replay_diverged();
+	return NULL;
+}
+
+static int revpi_replay_start_capture(void)
+{
+	struct picontrol_capture_header hdr = {
+		.magic = PICONTROL_CAPTURE_MAGIC,
+		.version = PICONTROL_CAPTURE_VERSION,
+		.device_len = sizeof(SDevice),
+		.config_crc = piControl_config_crc(),
+		.num_devices = RevPiDevice_getDevCnt(),
+		.pi_len = KB_PI_LEN,
+	};
+	size_t pos = 0;
+	int i;
+
+	memcpy(replay.buf, &hdr, sizeof(hdr));
+	pos += sizeof(hdr);
+
+	for (i = 0; i < hdr.num_devices; i++) {
+		memcpy(replay.buf + pos, RevPiDevice_getDev(i), sizeof(SDevice));
+		pos += sizeof(SDevice);
+	}
+
+	revpi_io_lock_pi();
+	memcpy(replay.buf + pos, piDev_g.ai8uPI, KB_PI_LEN);
+	memcpy(replay.shadow, piDev_g.ai8uPI, KB_PI_LEN);
+	memcpy(piCore_g.cycle_image, piDev_g.ai8uPI, KB_PI_LEN);
+	revpi_io_unlock_pi();
+	pos += KB_PI_LEN;
+
+	replay.len = pos;
+	replay.pos = pos;
+	replay.cycles = 0;
+	replay.mismatches = 0;
+	replay.mode = REVPI_REPLAY_CAPTURE;
+
+	pr_info("capture started\n");
+
+	return 0;
+}
+
+static int revpi_replay_start_replay(void)
+{
+	struct picontrol_capture_header hdr;
+	size_t pos = sizeof(hdr);
+	int i;
+
+	if (replay.len < sizeof(hdr))
+		return -EINVAL;
+
+	memcpy(&hdr, replay.buf, sizeof(hdr));
+	if (hdr.magic != PICONTROL_CAPTURE_MAGIC ||
+	    hdr.version != PICONTROL_CAPTURE_VERSION ||
+	    hdr.device_len != sizeof(SDevice) ||
+	    hdr.num_devices >= REV_PI_DEV_CNT_MAX ||
+	    hdr.pi_len != KB_PI_LEN ||
+	    replay.len < pos + hdr.num_devices * sizeof(SDevice) + KB_PI_LEN) {
+		pr_err("invalid capture\n");
+		return -EINVAL;
+	}
+
+	if (hdr.config_crc != piControl_config_crc()) {
+		pr_err("capture was taken with a different configuration\n");
+		return -EINVAL;
+	}
+
+	/* the modules of the capture replace the detected ones */
+	RevPiDevice_resetDevCnt();
+	for (i = 0; i < hdr.num_devices; i++) {
+		memcpy(RevPiDevice_getDev(i), replay.buf + pos, sizeof(SDevice));
+		RevPiDevice_incDevCnt();
+		pos += sizeof(SDevice);
+	}
+
+	replay.mode = REVPI_REPLAY_REPLAY;
+	replay.configuring = true;
+	PiBridgeMaster_Configure();
+	replay.configuring = false;
+
+	revpi_io_lock_pi();
+	memcpy(piDev_g.ai8uPI, replay.buf + pos, KB_PI_LEN);
+	memcpy(piCore_g.cycle_image, replay.buf + pos, KB_PI_LEN);
+	revpi_io_unlock_pi();
+	pos += KB_PI_LEN;
+
+	replay.pos = pos;
+	replay.cycles = 0;
+	replay.mismatches = 0;
+
+	pr_info("replay started\n");
+
+	return 0;
+}
+
+/**
+ * revpi_replay_req_io() - exchange data with a module
+ *
+ * Replacement of pibridge_req_io() which records the response in capture
+ * mode and takes it from the capture in replay mode.
+ */
+int revpi_replay_req_io(u8 addr, u16 cmd, void *snd_buf, u8 snd_len,
+			void *rcv_buf, u16 rcv_len)
+{
+	struct picontrol_capture_record rec;
+	const u8 *data;
+	int ret;
+
+	switch (replay.mode) {
+	case REVPI_REPLAY_CAPTURE:
+		ret = pibridge_req_io(piCore_g.pibridge, addr, cmd, snd_buf,
+				      snd_len, rcv_buf, rcv_len);
+		revpi_replay_append(PICONTROL_CAPTURE_IO, addr, cmd, ret,
+				    rcv_buf, ret > 0 ? ret : 0);
+		return ret;
+
+	case REVPI_REPLAY_REPLAY:
+		/* the modules of the capture are not attached */
+		if (replay.stopping)
+			return -EIO;
+
+		if (replay.configuring) {
+			memset(rcv_buf, 0, rcv_len);
+			return rcv_len;
+		}
+
+		data = revpi_replay_fetch(PICONTROL_CAPTURE_IO, &rec);
+		if (!data)
+			return -EIO;
+
+		if (rec.addr != addr) {
+			revpi_replay_diverged();
+			return -EIO;
+		}
+
+		/* a different command means different outputs were sent */
+		if (rec.arg != cmd)
+			replay.mismatches++;
+
+		memcpy(rcv_buf, data, min(rec.len, rcv_len));
+		return rec.ret;
+
+	default:
+		return pibridge_req_io(piCore_g.pibridge, addr, cmd, snd_buf,
+				       snd_len, rcv_buf, rcv_len);
+	}
+}
+
+/* Store the outputs written by the user since the previous cycle */
+static void revpi_replay_capture_writes(void)
+{
+	unsigned int start, end, i;
+	SDevice *dev;
+	int d;
+
+	revpi_io_lock_pi();
+	for (d = 0; d < RevPiDevice_getDevCnt(); d++) {
+		dev = RevPiDevice_getDev(d);
+		if (!dev->i8uActive)
+			continue;
+
+		end = dev->i16uOutputOffset + dev->sId.i16uFBS_OutputLength;
+		for (i = dev->i16uOutputOffset; i < end; i++) {
+			if (piDev_g.ai8uPI[i] == replay.shadow[i])
+				continue;
+
+			start = i;
+			while (i < end && piDev_g.ai8uPI[i] != replay.shadow[i])
+				i++;
+
+			if (!revpi_replay_append(PICONTROL_CAPTURE_WRITE, 0,
+						 start, 0,
+						 piDev_g.ai8uPI + start,
+						 i - start))
+				goto unlock;
+
+			memcpy(replay.shadow + start, piDev_g.ai8uPI + start,
+			       i - start);
+		}
+	}
+unlock:
+	revpi_io_unlock_pi();
+}
+
+/* Apply the captured user writes up to the first request of the cycle */
+static void revpi_replay_apply_writes(void)
+{
+	struct picontrol_capture_record rec;
+
+	while (replay.pos + sizeof(rec) <= replay.len) {
+		memcpy(&rec, replay.buf + replay.pos, sizeof(rec));
+		if (rec.type != PICONTROL_CAPTURE_WRITE)
+			break;
+
+		if (rec.arg + rec.len > KB_PI_LEN ||
+		    replay.pos + sizeof(rec) + rec.len > replay.len) {
+			revpi_replay_diverged();
+			return;
+		}
+
+		revpi_io_lock_pi();
+		memcpy(piDev_g.ai8uPI + rec.arg,
+		       replay.buf + replay.pos + sizeof(rec), rec.len);
+		revpi_io_unlock_pi();
+
+		replay.pos += sizeof(rec) + rec.len;
+	}
+}
+
+/**
+ * revpi_replay_cycle_start() - called by the io thread before the exchange
+ *
+ * Applies mode changes requested by the user. Capture and replay are only
+ * started and stopped at cycle boundaries.
+ */
+void revpi_replay_cycle_start(void)
+{
+	enum revpi_replay_mode requested = READ_ONCE(replay.requested);
+	int ret;
+
+	if (replay.mode == REVPI_REPLAY_OFF && requested == REVPI_REPLAY_OFF)
+		return;
+
+	/* a running capture or replay can only be switched off */
+	if (replay.mode != REVPI_REPLAY_OFF && requested == REVPI_REPLAY_OFF) {
+		revpi_replay_stop();
+		return;
+	}
+
+	if (replay.mode == REVPI_REPLAY_OFF) {
+		rt_mutex_lock(&replay.lock);
+		if (requested == REVPI_REPLAY_CAPTURE)
+			ret = revpi_replay_start_capture();
+		else
+			ret = revpi_replay_start_replay();
+		if (ret)
+			WRITE_ONCE(replay.requested, REVPI_REPLAY_OFF);
+		rt_mutex_unlock(&replay.lock);
+	}
+
+	/* deferring exchanges depends on timing and is not reproducible */
+	piCore_g.cycle_deadline = 0;
+
+	if (replay.mode == REVPI_REPLAY_CAPTURE) {
+		revpi_replay_capture_writes();
+	} else if (replay.mode == REVPI_REPLAY_REPLAY) {
+		/* the capture ended with the previous cycle */
+		if (replay.pos == replay.len) {
+			revpi_replay_stop();
+			return;
+		}
+		revpi_replay_apply_writes();
+	}
+}
+
+static void revpi_replay_check_cycle(void)
+{
+	struct picontrol_capture_record rec;
+	u32 crc, captured;
+	const u8 *data;
+
+	crc = revpi_replay_crc();
+
+	if (replay.mode == REVPI_REPLAY_CAPTURE) {
+		if (revpi_replay_append(PICONTROL_CAPTURE_CYCLE, 0, 0, 0,
+					&crc, sizeof(crc))) {
+			replay.pos = replay.len;
+			replay.cycles++;
+		}
+		return;
+	}
+
+	data = revpi_replay_fetch(PICONTROL_CAPTURE_CYCLE, &rec);
+	if (!data)
+		return;
+
+	if (rec.len != sizeof(captured)) {
+		revpi_replay_diverged();
+		return;
+	}
+
+	memcpy(&captured, data, sizeof(captured));
+	if (captured != crc)
+		replay.mismatches++;
+	replay.cycles++;
+}
+
+/**
+ * revpi_replay_cycle_end() - called by the io thread after the exchange
+ *
+ * A capture or replay which failed during the cycle is stopped here.
+ */
+void revpi_replay_cycle_end(void)
+{
+	if (replay.mode == REVPI_REPLAY_OFF)
+		return;
+
+	if (!replay.stopping)
+		revpi_replay_check_cycle();
+
+	if (replay.stopping)
+		revpi_replay_stop();
+}
+
+/* true if the io thread has to call revpi_replay_run() instead of the PiBridge */
+bool revpi_replay_active(void)
+{
+	return replay.mode == REVPI_REPLAY_REPLAY ||
+	       READ_ONCE(replay.requested) == REVPI_REPLAY_REPLAY;
+}
+
+/**
+ * revpi_replay_run() - run one cycle from the capture
+ *
+ * Once the replay has stopped, the PiBridge is reset. This replaces the
+ * module list of the capture by the detected modules before the data
+ * exchange with the real modules is resumed.
+ */
+void revpi_replay_run(void)
+{
+	revpi_replay_cycle_start();
+	if (replay.mode == REVPI_REPLAY_REPLAY) {
+		revpi_core_image_fetch();
+		RevPiDevice_run();
+		revpi_core_image_publish(false);
+		revpi_replay_cycle_end();
+	}
+
+	if (replay.restore) {
+		replay.restore = false;
+		PiBridgeMaster_Reset();
+	}
+}
+
+static ssize_t replay_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	enum revpi_replay_mode mode;
+
+	rt_mutex_lock(&replay.lock);
+	mode = replay.mode;
+	rt_mutex_unlock(&replay.lock);
+
+	return sprintf(buf, "%s\n", revpi_replay_modes[mode]);
+}
+
+/* Takes effect at the start of the next cycle */
+static ssize_t replay_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	int mode;
+
+	mode = sysfs_match_string(revpi_replay_modes, buf);
+	if (mode < 0)
+		return -EINVAL;
+
+	if (mode != REVPI_REPLAY_OFF && !piDev_g.pibridge_supported)
+		return -EOPNOTSUPP;
+
+	rt_mutex_lock(&replay.lock);
+	if (mode != REVPI_REPLAY_OFF && replay.mode != REVPI_REPLAY_OFF) {
+		rt_mutex_unlock(&replay.lock);
+		return -EBUSY;
+	}
+
+	if (!replay.buf) {
+		replay.buf = vmalloc(REVPI_REPLAY_BUF_SIZE);
+		if (!replay.buf) {
+			rt_mutex_unlock(&replay.lock);
+			return -ENOMEM;
+		}
+	}
+
+	WRITE_ONCE(replay.requested, mode);
+	rt_mutex_unlock(&replay.lock);
+
+	return count;
+}
+
+static ssize_t replay_cycles_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	u64 cycles;
+
+	rt_mutex_lock(&replay.lock);
+	cycles = replay.cycles;
+	rt_mutex_unlock(&replay.lock);
+
+	return sprintf(buf, "%llu\n", cycles);
+}
+
+static ssize_t replay_mismatches_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	u64 mismatches;
+
+	rt_mutex_lock(&replay.lock);
+	mismatches = replay.mismatches;
+	rt_mutex_unlock(&replay.lock);
+
+	return sprintf(buf, "%llu\n", mismatches);
+}
+
+/* The capture can only be read and written while capture and replay are off */
+#if KERNEL_VERSION(6, 13, 0) > LINUX_VERSION_CODE
+static ssize_t replay_data_read(struct file *filp, struct kobject *kobj,
+				struct bin_attribute *attr, char *buf,
+				loff_t off, size_t count)
+#else
+static ssize_t replay_data_read(struct file *filp, struct kobject *kobj,
+				const struct bin_attribute *attr, char *buf,
+				loff_t off, size_t count)
+#endif
+{
+	ssize_t ret;
+
+	rt_mutex_lock(&replay.lock);
+	if (replay.mode != REVPI_REPLAY_OFF ||
+	    READ_ONCE(replay.requested) != REVPI_REPLAY_OFF) {
+		ret = -EBUSY;
+	} else if (!replay.buf || off >= replay.len) {
+		ret = 0;
+	} else {
+		ret = min_t(size_t, count, replay.len - off);
+		memcpy(buf, replay.buf + off, ret);
+	}
+	rt_mutex_unlock(&replay.lock);
+
+	return ret;
+}
+
+/* Writing at offset 0 replaces the capture */
+#if KERNEL_VERSION(6, 13, 0) > LINUX_VERSION_CODE
+static ssize_t replay_data_write(struct file *filp, struct kobject *kobj,
+				 struct bin_attribute *attr, char *buf,
+				 loff_t off, size_t count)
+#else
+static ssize_t replay_data_write(struct file *filp, struct kobject *kobj,
+				 const struct bin_attribute *attr, char *buf,
+				 loff_t off, size_t count)
+#endif
+{
+	ssize_t ret = count;
+
+	if (off >= REVPI_REPLAY_BUF_SIZE ||
+	    count > REVPI_REPLAY_BUF_SIZE - off)
+		return -EFBIG;
+
+	rt_mutex_lock(&replay.lock);
+	if (replay.mode != REVPI_REPLAY_OFF ||
+	    READ_ONCE(replay.requested) != REVPI_REPLAY_OFF) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	if (!replay.buf) {
+		replay.buf = vmalloc(REVPI_REPLAY_BUF_SIZE);
+		if (!replay.buf) {
+			ret = -ENOMEM;
+			goto unlock;
+		}
+	}
+
+	if (!off)
+		replay.len = 0;
+	memcpy(replay.buf + off, buf, count);
+	replay.len = max_t(size_t, replay.len, off + count);
+unlock:
+	rt_mutex_unlock(&replay.lock);
+
+	return ret;
+}
+
+static DEVICE_ATTR_RW(replay);
+static DEVICE_ATTR_RO(replay_cycles);
+static DEVICE_ATTR_RO(replay_mismatches);
+static BIN_ATTR_RW(replay_data, 0);
+
+int revpi_replay_init(struct device *dev)
+{
+	int ret;
+
+	rt_mutex_init(&replay.lock);
+
+	ret = sysfs_create_file(&dev->kobj, &dev_attr_replay.attr);
+	if (ret)
+		return ret;
+
+	ret = sysfs_create_file(&dev->kobj, &dev_attr_replay_cycles.attr);
+	if (ret)
+		goto remove_replay_file;
+
+	ret = sysfs_create_file(&dev->kobj, &dev_attr_replay_mismatches.attr);
+	if (ret)
+		goto remove_replay_cycles_file;
+
+	ret = sysfs_create_bin_file(&dev->kobj, &bin_attr_replay_data);
+	if (ret)
+		goto remove_replay_mismatches_file;
+
+	return 0;
+
+remove_replay_mismatches_file:
+	sysfs_remove_file(&dev->kobj, &dev_attr_replay_mismatches.attr);
+remove_replay_cycles_file:
+	sysfs_remove_file(&dev->kobj, &dev_attr_replay_cycles.attr);
+remove_replay_file:
+	sysfs_remove_file(&dev->kobj, &dev_attr_replay.attr);
+
+	return ret;
+}
+
+void revpi_replay_fini(struct device *dev)
+{
+	sysfs_remove_bin_file(&dev->kobj, &bin_attr_replay_data);
+	sysfs_remove_file(&dev->kobj, &dev_attr_replay_mismatches.attr);
+	sysfs_remove_file(&dev->kobj, &dev_attr_replay_cycles.attr);
+	sysfs_remove_file(&dev->kobj, &dev_attr_replay.attr);
+
+	vfree(replay.buf);
+	replay.buf = NULL;
+}
@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: GPL-2.0-only
+ * SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+ *
+ * Capture and replay of the PiBridge data exchange
+ */
+
+#ifndef _REVPI_REPLAY_H
+#define _REVPI_REPLAY_H
+
+#include <linux/device.h>
+#include <linux/types.h>
+
+#include "piControl.h"
+
+/* max size of a capture */
+#define REVPI_REPLAY_BUF_SIZE			(4 * 1024 * 1024)
+
+int revpi_replay_init(struct device *dev);
+void revpi_replay_fini(struct device *dev);
+int revpi_replay_req_io(u8 addr, u16 cmd, void *snd_buf, u8 snd_len,
+			void *rcv_buf, u16 rcv_len);
+void revpi_replay_cycle_start(void);
+void revpi_replay_cycle_end(void);
+bool revpi_replay_active(void);
+void revpi_replay_run(void);
+
+#endif /* _REVPI_REPLAY_H */
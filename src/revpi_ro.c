@@ -3,11 +3,10 @@
 
 // RevPi RO module (Relais Output)
 
-#include <linux/pibridge_comm.h>
-
 #include "piControlMain.h"
 #include "revpi_common.h"
 #include "revpi_core.h"
+#include "revpi_replay.h"
 #include "revpi_ro.h"
 #include "RevPiDevice.h"
 
@@ -92,9 +91,9 @@ int revpi_ro_init(unsigned int devnum)
 	if (i == num_devices)
 		return 4;  // unknown device
 
-	return pibridge_req_io(piCore_g.pibridge, addr, IOP_TYP1_CMD_CFG,
-			       &itm->config, sizeof(struct revpi_ro_config),
-			       NULL, 0);
+	return revpi_replay_req_io(addr, IOP_TYP1_CMD_CFG,
+				   &itm->config, sizeof(struct revpi_ro_config),
+				   NULL, 0);
 }
 
 int revpi_ro_cycle(unsigned int devnum)
@@ -108,18 +107,16 @@ int revpi_ro_cycle(unsigned int devnum)
 
 	dev = RevPiDevice_getDev(devnum);
 
-	img_out = (struct revpi_ro_img_out *) (piDev_g.ai8uPI +
+	img_out = (struct revpi_ro_img_out *) (piCore_g.cycle_image +
 					       dev->i16uOutputOffset);
-	img_in = (struct revpi_ro_img_in *) (piDev_g.ai8uPI +
+	img_in = (struct revpi_ro_img_in *) (piCore_g.cycle_image +
 					     dev->i16uInputOffset);
 
-	rt_mutex_lock(&piDev_g.lockPI);
 	state_out = img_out->target_state;
-	rt_mutex_unlock(&piDev_g.lockPI);
 
-	ret = pibridge_req_io(piCore_g.pibridge, dev->i8uAddress,
-			      IOP_TYP1_CMD_DATA, &state_out, sizeof(state_out),
-			      &status_in, sizeof(status_in));
+	ret = revpi_replay_req_io(dev->i8uAddress,
+				  IOP_TYP1_CMD_DATA, &state_out, sizeof(state_out),
+				  &status_in, sizeof(status_in));
 
 	if (ret != sizeof(status_in)) {
 		pr_debug("RO addr %2d: communication failed (req:%zu,ret:%d)\n",
@@ -131,9 +128,8 @@ int revpi_ro_cycle(unsigned int devnum)
 		return ret;
 	}
 
-	rt_mutex_lock(&piDev_g.lockPI);
 	img_in->status = status_in;
-	rt_mutex_unlock(&piDev_g.lockPI);
+	revpi_core_inputs_updated(devnum);
 
 	return 0;
 }
@@ -0,0 +1,229 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+
+// cycle_align_test.c - alignment of the io cycle of src/revpi_cycle.c
+//
+// Checks picontrol_cycle_align() at the boundaries of a cycle, then runs
+// two simulated io threads on the same clock which are started at
+// different times. Like piIoThread() each of them aligns its timer when
+// the cycle duration or phase changed and forwards it by the cycle
+// duration otherwise. The cycles take a random time, some of them longer
+// than the cycle duration. After every change of the settings both timers
+// have to expire on the same grid, i.e. at the same points in time.
+//
+// The exit status is 0 if all checks passed.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "revpi_cycle.h"
+
+/* TAI in 2024, large enough to catch overflows */
+#define CLOCK_START		((s64)1700000000000000000LL)	/* nsecs */
+
+struct settings {
+	s64 from;		/* nsecs after CLOCK_START */
+	unsigned int duration;	/* usecs */
+	unsigned int phase;	/* usecs */
+};
+
+static const struct settings settings[] = {
+	{ 0,			1000,	0 },
+	{ 2000000000LL,		2500,	0 },
+	{ 4000000000LL,		2500,	700 },
+	{ 6000000000LL,		2500,	2700 },	/* same as 200 */
+	{ 8000000000LL,		250,	100 },
+	{ 10000000000LL,	5000,	4999 },
+};
+
+#define NUM_SETTINGS	(sizeof(settings) / sizeof(settings[0]))
+#define SIM_END		12000000000LL	/* nsecs after CLOCK_START */
+
+/* simulated io thread */
+struct sim {
+	const char *name;
+	s64 start;		/* nsecs after CLOCK_START */
+	s64 expires;
+	unsigned int last_duration;
+	unsigned int last_phase;
+	unsigned long cycles;
+	unsigned long overruns;
+	unsigned long missed;
+	/* first expiry with the settings of the current interval */
+	s64 first[NUM_SETTINGS];
+};
+
+static unsigned int failures;
+
+static void check_align(s64 now, unsigned int duration, unsigned int phase,
+			s64 expected)
+{
+	s64 got = ktime_to_ns(picontrol_cycle_align(ns_to_ktime(now),
+						    duration, phase));
+
+	if (got != expected) {
+		printf("align(%" PRId64 ", %u, %u) = %" PRId64 ", expected %" PRId64 "\n",
+		       now, duration, phase, got, expected);
+		failures++;
+	}
+}
+
+static void check_boundaries(void)
+{
+	s64 base = CLOCK_START;	/* a multiple of 1000 usecs */
+
+	check_align(base - 1, 1000, 0, base);
+	check_align(base, 1000, 0, base + 1000000);
+	check_align(base + 1, 1000, 0, base + 1000000);
+	check_align(base + 999999, 1000, 0, base + 1000000);
+	check_align(base, 1000, 300, base + 300000);
+	check_align(base + 300000, 1000, 300, base + 1300000);
+	check_align(base + 299999, 1000, 300, base + 300000);
+	/* the phase is taken modulo the duration */
+	check_align(base, 1000, 1300, base + 300000);
+	check_align(base, 1000, 1000, base + 1000000);
+}
+
+static const struct settings *settings_at(s64 t)
+{
+	unsigned int i;
+
+	for (i = NUM_SETTINGS - 1; i > 0; i--)
+		if (t >= settings[i].from)
+			break;
+
+	return &settings[i];
+}
+
+/* end of a cycle of piIoThread(), sets the start of the next one */
+static void sim_cycle(struct sim *sim, s64 now)
+{
+	const struct settings *set = settings_at(now - CLOCK_START);
+	s64 period = (s64)set->duration * NSEC_PER_USEC;
+	s64 n;
+
+	if (set->duration != sim->last_duration ||
+	    set->phase != sim->last_phase) {
+		sim->expires = ktime_to_ns(picontrol_cycle_align(ns_to_ktime(now),
+								 set->duration,
+								 set->phase));
+		sim->last_duration = set->duration;
+		sim->last_phase = set->phase;
+		sim->first[set - settings] = sim->expires;
+		return;
+	}
+
+	/* hrtimer_forward_now() */
+	if (sim->expires > now)
+		return;
+	n = (now - sim->expires) / period + 1;
+	sim->missed += n - 1;
+	sim->expires += n * period;
+}
+
+static void sim_check(struct sim *sim)
+{
+	const struct settings *set = settings_at(sim->expires - CLOCK_START);
+	s64 period = (s64)set->duration * NSEC_PER_USEC;
+	s64 offset = (s64)(set->phase % set->duration) * NSEC_PER_USEC;
+
+	/* the first cycle after a change may still use the old settings */
+	if (set->duration != sim->last_duration ||
+	    set->phase != sim->last_phase)
+		return;
+
+	if ((sim->expires - offset) % period) {
+		printf("%s: expiry %" PRId64 " is %" PRId64 " nsecs off the grid of %u/%u\n",
+		       sim->name, sim->expires,
+		       (sim->expires - offset) % period,
+		       set->duration, set->phase);
+		failures++;
+	}
+}
+
+static void sim_run(struct sim *sim)
+{
+	s64 now = CLOCK_START + sim->start;
+	s64 period, busy;
+
+	sim->expires = now;
+
+	while (now < CLOCK_START + SIM_END) {
+		period = (s64)settings_at(now - CLOCK_START)->duration *
+			 NSEC_PER_USEC;
+
+		/* the data exchange takes 10 … 90 % of the cycle, 1 % overrun */
+		if (rand() % 100 == 0) {
+			busy = period + rand() % (2 * period);
+			sim->overruns++;
+		} else {
+			busy = period / 10 + rand() % (period * 8 / 10);
+		}
+
+		now += busy;
+		sim_cycle(sim, now);
+		sim_check(sim);
+		sim->cycles++;
+
+		/* the timer expires, the next cycle starts */
+		if (sim->expires > now)
+			now = sim->expires;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct sim sims[2] = {
+		{ .name = "a", .start = 0 },
+		{ .name = "b", .start = 123456789 },
+	};
+	unsigned int seed = 1;
+	unsigned int i, j;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:h")) != -1) {
+		switch (opt) {
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s seed]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	check_boundaries();
+
+	srand(seed);
+	for (i = 0; i < 2; i++)
+		sim_run(&sims[i]);
+
+	/* both timers start each setting on the same point in time */
+	for (j = 0; j < NUM_SETTINGS; j++) {
+		s64 period = (s64)settings[j].duration * NSEC_PER_USEC;
+		s64 diff = sims[0].first[j] - sims[1].first[j];
+
+		printf("%u/%u usecs: first cycle a %+" PRId64 " b %+" PRId64 " nsecs\n",
+		       settings[j].duration, settings[j].phase,
+		       sims[0].first[j] - CLOCK_START,
+		       sims[1].first[j] - CLOCK_START);
+
+		if (diff % period) {
+			printf("%u/%u usecs: timers are %" PRId64 " nsecs apart\n",
+			       settings[j].duration, settings[j].phase,
+			       diff % period);
+			failures++;
+		}
+	}
+
+	for (i = 0; i < 2; i++)
+		printf("%s: %lu cycles, %lu overruns, %lu missed cycles\n",
+		       sims[i].name, sims[i].cycles, sims[i].overruns,
+		       sims[i].missed);
+
+	printf("%u failures\n", failures);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0-only
+ * SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+ */
+
+/* The parts of <linux/kernel.h> needed to build parts of src/ in userspace */
+
+#ifndef TOOLS_LINUX_KERNEL_H
+#define TOOLS_LINUX_KERNEL_H
+
+#include <stdint.h>
+
+typedef int32_t s32;
+typedef int64_t s64;
+
+#define DIV_ROUND_CLOSEST(x, divisor) ({			\
+	__typeof__(x) __x = x;					\
+	__typeof__(divisor) __d = divisor;			\
+	(((__x) > 0) == ((__d) > 0)) ?				\
+		(((__x) + ((__d) / 2)) / (__d)) :		\
+		(((__x) - ((__d) / 2)) / (__d));		\
+})
+
+#endif /* TOOLS_LINUX_KERNEL_H */
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-2.0-only
+ * SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+ */
+
+/* The parts of <linux/ktime.h> needed to build src/revpi_cycle.c in userspace */
+
+#ifndef TOOLS_LINUX_KTIME_H
+#define TOOLS_LINUX_KTIME_H
+
+#include <linux/kernel.h>
+
+#define NSEC_PER_USEC	1000L
+
+typedef s64 ktime_t;
+
+static inline s64 ktime_to_ns(const ktime_t kt)
+{
+	return kt;
+}
+
+static inline ktime_t ns_to_ktime(s64 ns)
+{
+	return ns;
+}
+
+#endif /* TOOLS_LINUX_KTIME_H */
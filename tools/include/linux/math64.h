@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0-only
+ * SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+ */
+
+/* The parts of <linux/math64.h> needed to build src/revpi_cycle.c in userspace */
+
+#ifndef TOOLS_LINUX_MATH64_H
+#define TOOLS_LINUX_MATH64_H
+
+#include <linux/kernel.h>
+
+static inline s64 div64_s64(s64 dividend, s64 divisor)
+{
+	return dividend / divisor;
+}
+
+#endif /* TOOLS_LINUX_MATH64_H */
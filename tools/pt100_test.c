@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+
+// pt100_test.c - accuracy and cost of the PT100 conversion of src/pt100.c
+//
+// Compares GetPt100Temperature() with the Callendar-Van Dusen equation at
+// every table entry, at the limits of the range and at random resistances,
+// and checks the clamping outside of the range. The result is rounded to
+// 0.1 °C, so it may deviate up to 0.05 °C plus the error of the
+// interpolation. Finally the time per conversion is measured.
+//
+// The exit status is 0 if all conversions are within the limit.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pt100.h"
+
+#define TABLE_R_MIN		18432	/* mOhm */
+#define TABLE_STEP		1024	/* mOhm */
+
+#define R_MIN			18520	/* mOhm, -200 °C */
+#define R_MAX			390481	/* mOhm, 850 °C */
+
+/* rounding to 0.1 °C plus the interpolation error */
+#define MAX_ERROR		0.052	/* °C */
+
+#define CVD_R0			100.0
+#define CVD_A			3.9083e-3
+#define CVD_B			-5.775e-7
+#define CVD_C			-4.183e-12
+
+static unsigned int failures;
+static double max_error;
+static unsigned int max_error_r;
+
+/* resistance in Ohm at t °C */
+static double cvd_resistance(double t)
+{
+	double r = 1 + CVD_A * t + CVD_B * t * t;
+
+	if (t < 0)
+		r += CVD_C * (t - 100) * t * t * t;
+
+	return CVD_R0 * r;
+}
+
+/* temperature in °C at r Ohm, R(t) is ascending over -200 … 850 °C */
+static double cvd_temperature(double r)
+{
+	double lo = -200, hi = 850, mid;
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		mid = (lo + hi) / 2;
+		if (cvd_resistance(mid) < r)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return (lo + hi) / 2;
+}
+
+static void check(unsigned int resistance)
+{
+	double expected, error;
+	int temp, ret;
+
+	ret = GetPt100Temperature(resistance, &temp);
+
+	if (resistance < R_MIN) {
+		if (ret != -1 || temp != -2000) {
+			printf("%u mOhm: got %d (%d), expected -2000 (-1)\n",
+			       resistance, temp, ret);
+			failures++;
+		}
+		return;
+	}
+
+	if (resistance > R_MAX) {
+		if (ret != 1 || temp != 8500) {
+			printf("%u mOhm: got %d (%d), expected 8500 (1)\n",
+			       resistance, temp, ret);
+			failures++;
+		}
+		return;
+	}
+
+	expected = cvd_temperature(resistance / 1000.0);
+	error = fabs(temp / 10.0 - expected);
+
+	if (error > max_error) {
+		max_error = error;
+		max_error_r = resistance;
+	}
+
+	if (ret || error > MAX_ERROR) {
+		printf("%u mOhm: got %.1f °C (%d), expected %.3f °C\n",
+		       resistance, temp / 10.0, ret, expected);
+		failures++;
+	}
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-n random] [-c calls] [-s seed]\n"
+		"  -n  number of random resistances to check (default 1000000)\n"
+		"  -c  number of conversions to time (default 10000000)\n"
+		"  -s  seed of the random resistances (default 1)\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int random = 1000000, calls = 10000000, seed = 1;
+	unsigned int i, r, checked = 0;
+	double start, elapsed;
+	long long sum = 0;
+	int opt, temp;
+
+	while ((opt = getopt(argc, argv, "n:c:s:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			random = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			calls = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	/* every table entry and its neighbours */
+	for (r = TABLE_R_MIN; r <= R_MAX + TABLE_STEP; r += TABLE_STEP) {
+		check(r - 1);
+		check(r);
+		check(r + 1);
+		checked += 3;
+	}
+
+	/* the limits of the range and the clamping outside of it */
+	check(0);
+	check(R_MIN - 1);
+	check(R_MIN);
+	check(R_MAX);
+	check(R_MAX + 1);
+	check(~0U);
+	checked += 6;
+
+	/* random resistances within and slightly outside of the range */
+	srand(seed);
+	for (i = 0; i < random; i++) {
+		r = R_MIN - 1000 + (unsigned int)((double)rand() / RAND_MAX *
+						  (R_MAX - R_MIN + 2000));
+
+		check(r);
+		checked++;
+	}
+
+	/* sweep the range so the table is accessed like with real inputs */
+	start = now_ns();
+	for (i = 0; i < calls; i++) {
+		GetPt100Temperature(R_MIN + (i * 7919U) % (R_MAX - R_MIN),
+				    &temp);
+		sum += temp;
+	}
+	elapsed = now_ns() - start;
+
+	printf("checked %u resistances, %u failures\n", checked, failures);
+	printf("max error %.4f °C at %u mOhm (limit %.3f °C)\n",
+	       max_error, max_error_r, MAX_ERROR);
+	printf("%.2f nsecs per conversion (%u conversions, checksum %lld)\n",
+	       calls ? elapsed / calls : 0, calls, sum);
+
+	return failures ? 1 : 0;
+}
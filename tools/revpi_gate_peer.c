@@ -0,0 +1,588 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+
+// revpi_gate_peer.c - simulated RevPi Gate speaking the gateway protocol
+//
+// Runs the gateway side of the protocol handled by src/revpi_gate.c over a
+// raw socket, e.g. on one end of a veth pair whose other end is named
+// piright or pileft. The peer requests a connection, answers the id
+// request of piControl and exchanges data packets with it. Packets sent by
+// the peer can be lost, delayed and reordered on purpose. Packets received
+// by the peer can be lost as well.
+//
+// The counters of both directions, the round trip time and the connection
+// setups and timeouts are printed on exit. The exit status is 0 if a
+// connection was set up at least once.
+
+#include <endian.h>
+#include <errno.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ETH_P_KUNBUSGW		0x419C
+
+/* see MODGATE_AL_Command and MODGATECOM_FieldbusStatus */
+#define CMD_ID_REQ		0x0001
+#define CMD_ID_RESP		0x8001
+#define CMD_CYCLIC_PD		0x0002
+#define FEATURE_IO_DATA		0x0001
+#define FBSTATE_CYCLIC_IO	0x03
+
+#define MAX_PD_LEN		512
+#define TXQ_LEN			64
+
+/* wire format, see src/ModGateComMain.h, all fields are little endian */
+struct gate_tl {
+	uint8_t ack;
+	uint8_t ctr;
+	uint16_t cmd;
+	uint16_t len;
+	uint32_t error;
+	uint8_t version;
+	uint8_t reserved;
+} __attribute__((packed));
+
+struct gate_id_resp {
+	uint32_t serial;
+	uint16_t module_type;
+	uint16_t hw_revision;
+	uint16_t sw_major;
+	uint16_t sw_minor;
+	uint32_t svn_revision;
+	uint16_t input_len;
+	uint16_t output_len;
+	uint16_t features;
+} __attribute__((packed));
+
+struct gate_pd {
+	uint8_t fb_status;
+	uint16_t offset;
+	uint16_t len;
+	uint8_t data[];
+} __attribute__((packed));
+
+#define FRAME_LEN (sizeof(struct ether_header) + sizeof(struct gate_tl) + \
+		   sizeof(struct gate_pd) + MAX_PD_LEN)
+
+enum peer_state {
+	ST_ID_REQ,		/* id request sent, awaiting id request */
+	ST_ID_RESP,		/* id response sent, awaiting id response */
+	ST_RUN,			/* exchanging data packets */
+};
+
+struct frame {
+	uint64_t due;		/* usecs */
+	size_t len;
+	uint8_t buf[FRAME_LEN];
+};
+
+static struct {
+	const char *ifname;
+	unsigned int module_type;
+	unsigned int data_len;
+	unsigned int send_interval;	/* msecs */
+	unsigned int timeout;		/* msecs */
+	unsigned int period;		/* msecs, 0: answer data packets */
+	double loss;			/* percent */
+	unsigned int delay;		/* msecs */
+	unsigned int jitter;		/* msecs */
+	double reorder;			/* percent */
+	unsigned int duration;		/* secs */
+	unsigned long count;
+	long seed;
+} opt = {
+	.module_type = 93,	/* KUNBUS_FW_DESCR_TYP_MG_MODBUS_TCP */
+	.data_len = 64,
+	.send_interval = 20,
+	.timeout = 80,
+};
+
+static struct {
+	int fd;
+	int ifindex;
+	uint8_t mac[ETH_ALEN];
+	enum peer_state state;
+	uint8_t tx_ctr;
+	uint8_t rx_ctr;
+	uint32_t seq;
+	uint64_t tx_time;	/* of the last data packet, 0 if it was acked */
+	uint64_t last_tx;
+	uint64_t last_rx;
+	uint64_t next_period;
+	struct frame txq[TXQ_LEN];
+	unsigned int txq_len;
+	struct frame held;	/* reordered frame, sent after the next one */
+	bool held_valid;
+} peer;
+
+static struct {
+	unsigned long long tx;
+	unsigned long long rx;
+	unsigned long long tx_dropped;
+	unsigned long long rx_dropped;
+	unsigned long long reordered;
+	unsigned long long lost;
+	unsigned long long out_of_order;
+	unsigned long long duplicates;
+	unsigned long long voluntary;
+	unsigned int connects;
+	unsigned int timeouts;
+	unsigned long long rtt_sum;
+	unsigned long long rtt_count;
+	unsigned int rtt_last;
+	unsigned int rtt_min;
+	unsigned int rtt_max;
+} stats;
+
+static volatile sig_atomic_t stop;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool chance(double percent)
+{
+	return percent > 0 && drand48() * 100 < percent;
+}
+
+static void txq_push(const struct frame *f)
+{
+	unsigned int i;
+
+	if (peer.txq_len == TXQ_LEN) {
+		stats.tx_dropped++;
+		return;
+	}
+
+	/* keep the queue sorted by due time, frames due together in order */
+	for (i = peer.txq_len; i > 0 && peer.txq[i - 1].due > f->due; i--)
+		peer.txq[i] = peer.txq[i - 1];
+	peer.txq[i] = *f;
+	peer.txq_len++;
+}
+
+static void txq_flush(uint64_t now)
+{
+	struct sockaddr_ll addr = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = htons(ETH_P_KUNBUSGW),
+		.sll_ifindex = peer.ifindex,
+		.sll_halen = ETH_ALEN,
+	};
+
+	memset(addr.sll_addr, 0xff, ETH_ALEN);
+
+	if (peer.held_valid && peer.held.due <= now) {
+		txq_push(&peer.held);
+		peer.held_valid = false;
+	}
+
+	while (peer.txq_len && peer.txq[0].due <= now) {
+		if (sendto(peer.fd, peer.txq[0].buf, peer.txq[0].len, 0,
+			   (struct sockaddr *)&addr, sizeof(addr)) < 0)
+			perror("sendto");
+		else
+			stats.tx++;
+
+		peer.txq_len--;
+		memmove(&peer.txq[0], &peer.txq[1],
+			peer.txq_len * sizeof(peer.txq[0]));
+	}
+}
+
+/* Apply loss, delay and reordering to a frame and queue it */
+static void queue_frame(struct frame *f, uint64_t now)
+{
+	if (chance(opt.loss)) {
+		stats.tx_dropped++;
+		return;
+	}
+
+	f->due = now + opt.delay * 1000ULL;
+	if (opt.jitter)
+		f->due += (uint64_t)(drand48() * opt.jitter * 1000);
+
+	/* a frame which no other frame follows is sent after the interval */
+	if (!peer.held_valid && chance(opt.reorder)) {
+		peer.held = *f;
+		peer.held.due = f->due + opt.send_interval * 1000ULL;
+		peer.held_valid = true;
+		stats.reordered++;
+		return;
+	}
+
+	txq_push(f);
+	if (peer.held_valid) {
+		peer.held.due = f->due;
+		txq_push(&peer.held);
+		peer.held_valid = false;
+	}
+
+	txq_flush(now);
+}
+
+static void send_packet(uint16_t cmd, const void *payload, uint16_t len,
+			uint64_t now)
+{
+	struct ether_header *eth;
+	struct gate_tl *tl;
+	struct frame f;
+
+	eth = (struct ether_header *)f.buf;
+	memset(eth->ether_dhost, 0xff, ETH_ALEN);
+	memcpy(eth->ether_shost, peer.mac, ETH_ALEN);
+	eth->ether_type = htons(ETH_P_KUNBUSGW);
+
+	/* counters run from 1 to 255, 0 is skipped */
+	if (++peer.tx_ctr == 0)
+		peer.tx_ctr = 1;
+
+	tl = (struct gate_tl *)(eth + 1);
+	tl->ack = peer.rx_ctr;
+	tl->ctr = peer.tx_ctr;
+	tl->cmd = htole16(cmd);
+	tl->len = htole16(len);
+	tl->error = 0;
+	tl->version = 0;
+	tl->reserved = 0;
+	if (len)
+		memcpy(tl + 1, payload, len);
+
+	f.len = sizeof(*eth) + sizeof(*tl) + len;
+	peer.last_tx = now;
+	queue_frame(&f, now);
+}
+
+static void send_id_req(uint64_t now)
+{
+	peer.state = ST_ID_REQ;
+	peer.tx_time = 0;
+	send_packet(CMD_ID_REQ, NULL, 0, now);
+}
+
+static void send_id_resp(uint64_t now)
+{
+	struct gate_id_resp resp = {
+		.serial = htole32(getpid()),
+		.module_type = htole16(opt.module_type),
+		.hw_revision = htole16(1),
+		.sw_major = htole16(1),
+		.input_len = htole16(opt.data_len),
+		.output_len = htole16(opt.data_len),
+		.features = htole16(FEATURE_IO_DATA),
+	};
+
+	peer.state = ST_ID_RESP;
+	send_packet(CMD_ID_RESP, &resp, sizeof(resp), now);
+}
+
+static void send_data(uint64_t now)
+{
+	uint8_t buf[sizeof(struct gate_pd) + MAX_PD_LEN] = { 0 };
+	struct gate_pd *pd = (struct gate_pd *)buf;
+	uint32_t seq = htole32(++peer.seq);
+
+	pd->fb_status = FBSTATE_CYCLIC_IO;
+	pd->offset = 0;
+	pd->len = htole16(opt.data_len);
+	memcpy(pd->data, &seq, opt.data_len < sizeof(seq) ?
+	       opt.data_len : sizeof(seq));
+
+	peer.tx_time = now;
+	send_packet(CMD_CYCLIC_PD, buf, sizeof(*pd) + opt.data_len, now);
+}
+
+static void receive(const uint8_t *buf, size_t len, uint64_t now)
+{
+	const struct gate_tl *tl;
+	unsigned int gap, rtt;
+	uint8_t expected;
+	uint16_t cmd;
+
+	if (len < sizeof(struct ether_header) + sizeof(*tl))
+		return;
+
+	if (chance(opt.loss)) {
+		stats.rx_dropped++;
+		return;
+	}
+
+	tl = (const struct gate_tl *)(buf + sizeof(struct ether_header));
+	cmd = le16toh(tl->cmd);
+	if (!cmd)
+		return;
+
+	/* the id request of piControl starts its sequence of counters */
+	if (cmd == CMD_ID_REQ) {
+		peer.rx_ctr = tl->ctr;
+	} else {
+		if (cmd == CMD_CYCLIC_PD && tl->ctr == peer.rx_ctr) {
+			stats.duplicates++;
+			return;
+		}
+
+		expected = peer.rx_ctr + 1;
+		if (expected == 0)
+			expected = 1;
+		if (tl->ctr != expected) {
+			gap = (tl->ctr + 255 - expected) % 255;
+			if (gap < 128)
+				stats.lost += gap;
+			else
+				stats.out_of_order++;
+		}
+		peer.rx_ctr = tl->ctr;
+	}
+
+	peer.last_rx = now;
+
+	if (peer.tx_time && tl->ack == peer.tx_ctr) {
+		rtt = now - peer.tx_time;
+		stats.rtt_last = rtt;
+		if (!stats.rtt_count || rtt < stats.rtt_min)
+			stats.rtt_min = rtt;
+		if (rtt > stats.rtt_max)
+			stats.rtt_max = rtt;
+		stats.rtt_sum += rtt;
+		stats.rtt_count++;
+		peer.tx_time = 0;
+	}
+
+	switch (cmd) {
+	case CMD_ID_REQ:
+		/* piControl answers an id request with its own */
+		send_id_resp(now);
+		break;
+	case CMD_ID_RESP:
+		if (peer.state != ST_ID_RESP)
+			break;
+		peer.state = ST_RUN;
+		stats.connects++;
+		fprintf(stderr, "%s: connected\n", opt.ifname);
+		peer.next_period = now;
+		if (!opt.period)
+			send_data(now);
+		break;
+	case CMD_CYCLIC_PD:
+		if (peer.state != ST_RUN)
+			break;
+		stats.rx++;
+		if (!opt.period)
+			send_data(now);
+		break;
+	default:
+		break;
+	}
+}
+
+static void handle_timers(uint64_t now)
+{
+	uint64_t silent = now - (peer.last_rx > peer.last_tx ?
+				 peer.last_rx : peer.last_tx);
+
+	switch (peer.state) {
+	case ST_ID_REQ:
+		if (now - peer.last_tx >= opt.send_interval * 1000ULL)
+			send_id_req(now);
+		break;
+	case ST_ID_RESP:
+		if (now - peer.last_rx >= opt.timeout * 1000ULL)
+			send_id_req(now);
+		break;
+	case ST_RUN:
+		if (now - peer.last_rx >= opt.timeout * 1000ULL) {
+			fprintf(stderr, "%s: timeout\n", opt.ifname);
+			stats.timeouts++;
+			send_id_req(now);
+		} else if (opt.period) {
+			while (peer.next_period <= now) {
+				send_data(now);
+				peer.next_period += opt.period * 1000ULL;
+			}
+		} else if (silent >= opt.send_interval * 1000ULL) {
+			stats.voluntary++;
+			send_data(now);
+		}
+		break;
+	}
+
+	txq_flush(now);
+}
+
+static void print_stats(void)
+{
+	printf("tx %llu rx %llu tx_dropped %llu rx_dropped %llu reordered %llu\n",
+	       stats.tx, stats.rx, stats.tx_dropped, stats.rx_dropped,
+	       stats.reordered);
+	printf("lost %llu out_of_order %llu duplicates %llu voluntary %llu connects %u timeouts %u\n",
+	       stats.lost, stats.out_of_order, stats.duplicates,
+	       stats.voluntary, stats.connects, stats.timeouts);
+	printf("rtt last %u min %u avg %llu max %u usecs\n",
+	       stats.rtt_last, stats.rtt_min,
+	       stats.rtt_count ? stats.rtt_sum / stats.rtt_count : 0,
+	       stats.rtt_max);
+}
+
+static int open_socket(void)
+{
+	struct sockaddr_ll addr = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = htons(ETH_P_KUNBUSGW),
+	};
+	struct ifreq ifr = { 0 };
+
+	peer.ifindex = if_nametoindex(opt.ifname);
+	if (!peer.ifindex) {
+		perror(opt.ifname);
+		return -1;
+	}
+
+	peer.fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_KUNBUSGW));
+	if (peer.fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	strncpy(ifr.ifr_name, opt.ifname, IFNAMSIZ - 1);
+	if (ioctl(peer.fd, SIOCGIFHWADDR, &ifr) < 0) {
+		perror("SIOCGIFHWADDR");
+		goto err;
+	}
+	memcpy(peer.mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	addr.sll_ifindex = peer.ifindex;
+	if (bind(peer.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		goto err;
+	}
+
+	return 0;
+
+err:
+	close(peer.fd);
+	return -1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s -i <ifname> [options]\n"
+		"  -m <type>    module type in the id response (default %u)\n"
+		"  -n <bytes>   data length of both directions (default %u, max %u)\n"
+		"  -e <msecs>   send a data packet if piControl was silent this long (default %u)\n"
+		"  -o <msecs>   start over if piControl was silent this long (default %u)\n"
+		"  -p <msecs>   send data packets with this period instead of answering\n"
+		"  -l <percent> lose sent and received packets\n"
+		"  -d <msecs>   delay sent packets\n"
+		"  -j <msecs>   add a random delay of up to this to sent packets\n"
+		"  -r <percent> send packets after the following packet\n"
+		"  -t <secs>    stop after this time\n"
+		"  -c <count>   stop after this number of received data packets\n"
+		"  -s <seed>    seed of the random numbers\n",
+		prog, opt.module_type, opt.data_len, MAX_PD_LEN,
+		opt.send_interval, opt.timeout);
+}
+
+static void handle_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t buf[2048];
+	struct sockaddr_ll from;
+	socklen_t from_len;
+	struct pollfd pfd;
+	uint64_t start, now;
+	ssize_t len;
+	int c;
+
+	while ((c = getopt(argc, argv, "i:m:n:e:o:p:l:d:j:r:t:c:s:h")) != -1) {
+		switch (c) {
+		case 'i': opt.ifname = optarg; break;
+		case 'm': opt.module_type = strtoul(optarg, NULL, 0); break;
+		case 'n': opt.data_len = strtoul(optarg, NULL, 0); break;
+		case 'e': opt.send_interval = strtoul(optarg, NULL, 0); break;
+		case 'o': opt.timeout = strtoul(optarg, NULL, 0); break;
+		case 'p': opt.period = strtoul(optarg, NULL, 0); break;
+		case 'l': opt.loss = strtod(optarg, NULL); break;
+		case 'd': opt.delay = strtoul(optarg, NULL, 0); break;
+		case 'j': opt.jitter = strtoul(optarg, NULL, 0); break;
+		case 'r': opt.reorder = strtod(optarg, NULL); break;
+		case 't': opt.duration = strtoul(optarg, NULL, 0); break;
+		case 'c': opt.count = strtoul(optarg, NULL, 0); break;
+		case 's': opt.seed = strtol(optarg, NULL, 0); break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (!opt.ifname || !opt.data_len || opt.data_len > MAX_PD_LEN ||
+	    !opt.send_interval || opt.timeout < opt.send_interval) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	srand48(opt.seed);
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	if (open_socket())
+		return 1;
+
+	pfd.fd = peer.fd;
+	pfd.events = POLLIN;
+
+	start = now_us();
+	send_id_req(start);
+
+	while (!stop) {
+		/* timers have a resolution of 1 msec, packets are handled at once */
+		if (poll(&pfd, 1, 1) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		now = now_us();
+		if (pfd.revents & POLLIN) {
+			from_len = sizeof(from);
+			len = recvfrom(peer.fd, buf, sizeof(buf), 0,
+				       (struct sockaddr *)&from, &from_len);
+			/* the socket also sees the packets sent by the peer */
+			if (len > 0 && from.sll_pkttype != PACKET_OUTGOING)
+				receive(buf, len, now);
+		}
+
+		handle_timers(now);
+
+		if (opt.duration && now - start >= opt.duration * 1000000ULL)
+			break;
+		if (opt.count && stats.rx >= opt.count)
+			break;
+	}
+
+	print_stats();
+	close(peer.fd);
+
+	return stats.connects ? 0 : 1;
+}
@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: GPL-2.0-only
+// SPDX-FileCopyrightText: 2024 KUNBUS GmbH
+
+// watchdog_bench.c - io cycle time with many clients using the watchdog
+//
+// Opens /dev/piControl0 the given number of times and activates the output
+// watchdog (KB_SET_OUTPUT_WATCHDOG) on every file descriptor. The watchdogs
+// are refreshed by an empty write, which does not change the process image,
+// or left to expire with -e. Meanwhile last_cycle is sampled from sysfs.
+// At the end the mean of the samples and min_cycle and max_cycle are
+// printed in usecs.
+//
+// With -e the outputs are set to their safe state on every expiry, so only
+// run it on a system whose outputs may be switched off.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "piControl.h"
+
+#define PICONTROL_DEV		"/dev/piControl0"
+#define PICONTROL_SYSFS		"/sys/class/piControl/piControl0/"
+
+static int sysfs_read(const char *attr, unsigned long *val)
+{
+	char path[128];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), PICONTROL_SYSFS "%s", attr);
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	ret = fscanf(f, "%lu", val) == 1 ? 0 : -EINVAL;
+	fclose(f);
+
+	return ret;
+}
+
+static int sysfs_write(const char *attr, const char *val)
+{
+	char path[128];
+	FILE *f;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), PICONTROL_SYSFS "%s", attr);
+	f = fopen(path, "w");
+	if (!f)
+		return -errno;
+
+	if (fputs(val, f) == EOF)
+		ret = -EIO;
+	if (fclose(f))
+		ret = -errno;
+
+	return ret;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-n clients] [-w msecs] [-t secs] [-e]\n"
+		"  -n  number of file descriptors with a watchdog (default 500)\n"
+		"  -w  watchdog period in msecs (default 100)\n"
+		"  -t  duration of the measurement in secs (default 10)\n"
+		"  -e  do not refresh the watchdogs, let them expire\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long period = 100, last, min, max, samples = 0;
+	unsigned int clients = 500, secs = 10, i;
+	double end, next_refresh, sum = 0;
+	struct rlimit rlim;
+	bool expire = false;
+	int *fds;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:w:t:eh")) != -1) {
+		switch (opt) {
+		case 'n':
+			clients = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			period = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			secs = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			expire = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (!period) {
+		fprintf(stderr, "the watchdog period must not be 0\n");
+		return 2;
+	}
+
+	/* room for the clients besides stdio and sysfs */
+	if (!getrlimit(RLIMIT_NOFILE, &rlim) && rlim.rlim_cur < clients + 16) {
+		rlim.rlim_cur = clients + 16;
+		if (rlim.rlim_max < rlim.rlim_cur)
+			rlim.rlim_max = rlim.rlim_cur;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	fds = calloc(clients, sizeof(*fds));
+	if (!fds) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; i < clients; i++) {
+		fds[i] = open(PICONTROL_DEV, O_RDWR);
+		if (fds[i] < 0) {
+			fprintf(stderr, "open %s (client %u): %s\n",
+				PICONTROL_DEV, i, strerror(errno));
+			return 1;
+		}
+
+		if (ioctl(fds[i], KB_SET_OUTPUT_WATCHDOG, &period) < 0) {
+			perror("KB_SET_OUTPUT_WATCHDOG");
+			return 1;
+		}
+	}
+
+	if (sysfs_write("min_cycle", "0") || sysfs_write("max_cycle", "0")) {
+		fprintf(stderr, "cannot reset min_cycle and max_cycle\n");
+		return 1;
+	}
+
+	end = now_sec() + secs;
+	next_refresh = 0;
+
+	while (now_sec() < end) {
+		/* refresh well within the period */
+		if (!expire && now_sec() >= next_refresh) {
+			for (i = 0; i < clients; i++) {
+				if (write(fds[i], NULL, 0) < 0) {
+					perror("write");
+					return 1;
+				}
+			}
+			next_refresh = now_sec() + period / 4000.0;
+		}
+
+		if (!sysfs_read("last_cycle", &last)) {
+			sum += last;
+			samples++;
+		}
+
+		usleep(1000);
+	}
+
+	if (sysfs_read("min_cycle", &min) || sysfs_read("max_cycle", &max)) {
+		fprintf(stderr, "cannot read min_cycle and max_cycle\n");
+		return 1;
+	}
+
+	printf("%u clients, watchdog %lu msecs%s: mean %.1f min %lu max %lu usecs (%lu samples)\n",
+	       clients, period, expire ? " expiring" : "",
+	       samples ? sum / samples : 0, min, max, samples);
+
+	for (i = 0; i < clients; i++)
+		close(fds[i]);
+	free(fds);
+
+	return 0;
+}